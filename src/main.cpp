@@ -12,44 +12,18 @@ Use pin 22 to toggle RS485 read/write
 
 #include <Arduino.h>
 
-// Config for ESP8266 or ESP32
-#if defined(ESP8266)
-    #include <SoftwareSerial.h>
-    SoftwareSerial rs485;  // Use SoftwareSerial port
-    #define RS485_DIR_PIN -1  // != -1: Use pin for explicit DE/!RE
-    #define RS485_RX_PIN -1
-    #define RS485_TX_PIN -1
-
-    #define HEALTH_LED_ON LOW
-    #define HEALTH_LED_OFF HIGH
-    #define HEALTH_LED_PIN LED_BUILTIN
-    #define LOAD_LED_ON HIGH
-    #define LOAD_LED_OFF LOW
-    #define LOAD_LED_PIN D5
-    #define LOAD_BUTTON_PIN 0
-
-    // Web Updater
-    #include <ESP8266HTTPUpdateServer.h>
-    #include <ESP8266WebServer.h>
-    #include <ESP8266WiFi.h>
-    #include <ESP8266mDNS.h>
-    #include <WiFiClient.h>
-    #define WebServer ESP8266WebServer
-    #define HTTPUpdateServer ESP8266HTTPUpdateServer
-
-    // Post to InfluxDB
-    #include <ESP8266HTTPClient.h>
-
-    // Time sync
-    #include <NTPClient.h>
-    #include <WiFiUdp.h>
-    WiFiUDP ntpUDP;
-    NTPClient ntp(ntpUDP, NTP_SERVER);
-#elif defined(ESP32)
+// Config for ESP32 (FreeRTOS tasks and timers, NVS, flash partitions, esp_timer and power management are used)
+#if defined(ESP32)
     HardwareSerial &rs485 = Serial2;
     #define RS485_DIR_PIN -1  // != -1: Use pin for explicit DE/!RE
     #define RS485_RX_PIN  14  // != -1: Use non-default pin for Rx
     #define RS485_TX_PIN  13  // != -1: Use non-default pin for Tx
+    #ifndef BMS1_RX_PIN
+        #define BMS1_RX_PIN 32  // Serial1 pins for an extra BMS on port 1 (see BMS_PORTS)
+    #endif
+    #ifndef BMS1_TX_PIN
+        #define BMS1_TX_PIN 25  // no strapping pins, a transceiver on 12 or 15 can break boot
+    #endif
 
     #define HEALTH_LED_ON HIGH
     #define HEALTH_LED_OFF LOW
@@ -58,7 +32,6 @@ Use pin 22 to toggle RS485 read/write
     #else
         #define HEALTH_LED_PIN 16
     #endif
-    #define HEALTH_PWM_CH 0
     #define LOAD_LED_ON LOW
     #define LOAD_LED_OFF HIGH
     #define LOAD_LED_PIN 33
@@ -80,7 +53,7 @@ Use pin 22 to toggle RS485 read/write
     // Reset reason
     #include "rom/rtc.h"
 #else
-    #error "No ESP8266 or ESP32, define your rs485 stream, pins and includes here!"
+    #error "No ESP32, define your rs485 stream, pins and includes here!"
 #endif
 
 // Infrastructure
@@ -120,996 +93,5275 @@ bool enabledBreathing = true;  // global flag to switch breathing animation on o
 // Syslog
 WiFiUDP logUDP;
 Syslog syslog(logUDP, SYSLOG_PROTO_IETF);
-char msg[512];  // one buffer for all syslog and json messages
 char start_time[30];
 
-// eSmart3 device
-#include <esmart3.h>
-
-uint32_t rs485_access_ms = 0;              // rs485 access timestamp for esmart3 and jbdbms
-ESmart3 esmart3(rs485, &rs485_access_ms);  // Serial port to communicate with RS485 adapter
+// Fixed pool of message buffers for syslog, json and influx lines.
+// Subsystems lease a buffer for the scope of one message instead of sharing a global one.
+// Nesting is shallow (handler -> postInflux), so a few buffers are enough.
+#define POOL_BUFFERS 4
+#define POOL_BUFFER_SIZE 512
+
+typedef enum { POOL_SYSTEM, POOL_ES3, POOL_JBD, POOL_NET, POOL_MQTT, POOL_WEB, POOL_USERS } pool_user_t;
+
+typedef struct pool_stats {
+    const char *name;  // subsystem name for metrics
+    uint16_t leased;   // buffers currently held
+    uint16_t peak;     // max buffers held at once
+    uint32_t count;    // leases granted
+    uint32_t failed;   // leases refused because pool was empty
+} pool_stats_t;
+
+char pool_buffers[POOL_BUFFERS][POOL_BUFFER_SIZE];
+uint32_t pool_used = 0;  // bit mask of leased buffers
+uint16_t pool_peak = 0;  // max buffers leased at once
+pool_stats_t pool_stats[POOL_USERS] = {
+    { "System" }, { "ES3" }, { "JBD" }, { "Net" }, { "Mqtt" }, { "Web" }
+};
+portMUX_TYPE pool_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Scoped buffer lease: usable like a char array, returned to the pool at end of scope.
+// If the pool is empty, the lease is a tiny empty string and ok() is false, so callers can skip
+// their output instead of publishing empty payloads. The failure is counted.
+class Lease {
+public:
+    Lease( pool_user_t user ) : _user(user), _index(-1), _buf(_fallback), _size(sizeof(_fallback)) {
+        _fallback[0] = '\0';
+        portENTER_CRITICAL(&pool_mux);
+        pool_stats_t &stats = pool_stats[_user];
+        for (int i = 0; i < POOL_BUFFERS; i++) {
+            if (!(pool_used & (1 << i))) {
+                pool_used |= 1 << i;
+                _index = i;
+                _buf = pool_buffers[i];
+                _size = POOL_BUFFER_SIZE;
+                break;
+            }
+        }
+        if (_index < 0) {
+            stats.failed++;
+        }
+        else {
+            stats.count++;
+            if (++stats.leased > stats.peak) {
+                stats.peak = stats.leased;
+            }
+            uint16_t used = __builtin_popcount(pool_used);
+            if (used > pool_peak) {
+                pool_peak = used;
+            }
+        }
+        portEXIT_CRITICAL(&pool_mux);
+    }
 
-// JbdBms device
-#include <jbdbms.h>
+    ~Lease() {
+        if (_index >= 0) {
+            portENTER_CRITICAL(&pool_mux);
+            pool_used &= ~(1 << _index);
+            pool_stats[_user].leased--;
+            portEXIT_CRITICAL(&pool_mux);
+        }
+    }
 
-JbdBms jbdbms(rs485, &rs485_access_ms);  // Same serial port as esmart3 is ok, if parameters are the same
+    Lease( const Lease & ) = delete;
+    Lease &operator=( const Lease & ) = delete;
 
+    operator char *() { return _buf; }
+    size_t size() const { return _size; }
+    bool ok() const { return _index >= 0; }
 
-void slog(const char *message, uint16_t pri = LOG_INFO) {
-    static bool log_infos = true;
-    
-    if (pri < LOG_INFO || log_infos) {
-        Serial.println(message);
-        syslog.log(pri, message);
-    }
+private:
+    pool_user_t _user;
+    int _index;
+    char *_buf;
+    size_t _size;
+    char _fallback[1];
+};
 
-    if (log_infos && millis() > 10 * 60 * 1000) {
-        log_infos = false;  // log infos only for first 10 minutes
-        slog("Switch off info level messages", LOG_NOTICE);
-    }
-}
 
+// Bus addresses of the chargers and serial ports of the BMSes, the first ones are the primary devices
+// Port 0 is rs485, port 1 is Serial1 on BMS1_RX_PIN/BMS1_TX_PIN (see device registry)
+#ifndef CHARGER_ADDRESSES
+    #define CHARGER_ADDRESSES 0
+#endif
+#ifndef BMS_PORTS
+    #define BMS_PORTS 0
+#endif
 
-void publish( const char *topic, const char *payload ) {
-    if (mqtt.connected() && !mqtt.publish(topic, payload)) {
-        slog("Mqtt publish failed");
-    }
-}
+constexpr uint8_t charger_addresses[] = { CHARGER_ADDRESSES };
+constexpr uint8_t bms_ports[] = { BMS_PORTS };
 
+// Bus tap: the devices talk through this stream, so the sniffer sees every byte (see sniff_byte)
+void sniff_byte( uint8_t port, bool tx, uint8_t b );
 
-// Post data to InfluxDB
-bool postInflux(const char *line) {
-    static const char uri[] = "/write?db=" INFLUX_DB "&precision=s";
+class SniffStream : public Stream {
+public:
+    SniffStream( Stream &serial, uint8_t port ) : _serial(serial), _port(port) {}
 
-    WiFiClient wifiHttp;
-    HTTPClient http;
+    int available() override { return _serial.available(); }
+    int peek() override { return _serial.peek(); }
+    void flush() override { _serial.flush(); }
 
-    http.begin(wifiHttp, INFLUX_SERVER, INFLUX_PORT, uri);
-    http.setUserAgent(PROGNAME);
-    int prev = influx_status;
-    influx_status = http.POST(line);
-    String payload;
-    if (http.getSize() > 0) { // workaround for bug in getString()
-        payload = http.getString();
+    int read() override {
+        int b = _serial.read();
+        if (b >= 0) {
+            sniff_byte(_port, false, b);
+        }
+        return b;
     }
-    http.end();
 
-    if (influx_status != prev) {
-        snprintf(msg, sizeof(msg), "%d", influx_status);
-        publish(MQTT_TOPIC "/status/DBResponse", msg);
+    size_t write( uint8_t b ) override {
+        sniff_byte(_port, true, b);
+        return _serial.write(b);
     }
 
-    if (influx_status < 200 || influx_status >= 300) {
-        snprintf(msg, sizeof(msg), "Post %s:%d%s status=%d line='%s' response='%s'",
-            INFLUX_SERVER, INFLUX_PORT, uri, influx_status, line, payload.c_str());
-        slog(msg, LOG_ERR);
-        return false;
+    size_t write( const uint8_t *buf, size_t len ) override {
+        for (size_t i = 0; i < len; i++) {
+            sniff_byte(_port, true, buf[i]);
+        }
+        return _serial.write(buf, len);
     }
 
-    post_time = time(NULL);
-    return true;
-}
-
+    using Print::write;
 
-// Wifi status as JSON
-bool json_Wifi(char *json, size_t maxlen, const char *bssid, int8_t rssi) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Wifi\":{"
-        "\"BSSID\":\"%s\","
-        "\"IP\":\"%s\","
-        "\"Subnet\":\"%s\","
-        "\"Gateway\":\"%s\","
-        "\"DNS0\":\"%s\","
-        "\"DNS1\":\"%s\","
-        "\"RSSI\":%d}}";
+private:
+    Stream &_serial;
+    uint8_t _port;
+};
 
-    int len = snprintf(json, maxlen, jsonFmt, WiFi.getHostname(), bssid, 
-        WiFi.localIP().toString().c_str(), 
-        WiFi.subnetMask().toString().c_str(), 
-        WiFi.gatewayIP().toString().c_str(), 
-        WiFi.dnsIP(0).toString().c_str(), 
-        WiFi.dnsIP(1).toString().c_str(), 
-        rssi);
+SniffStream rs485_bus(rs485, 0);  // port 0
 
-    return len < maxlen;
-}
+// eSmart3 device
+#include <esmart3.h>
 
+uint32_t rs485_access_ms = 0;              // rs485 access timestamp for esmart3 and jbdbms
+ESmart3 esmart3(rs485_bus, &rs485_access_ms, charger_addresses[0]);  // Serial port to communicate with RS485 adapter
 
-char lastBssid[] = "00:00:00:00:00:00";  // last known connected AP (for web page) 
-int8_t lastRssi = 0;                     // last RSSI (for web page)
+// JbdBms device
+#include <jbdbms.h>
 
-// Report a change of RSSI or BSSID
-void report_wifi( int8_t rssi, const byte *bssid ) {
-    static const char digits[] = "0123456789abcdef";
-    static const char lineFmt[] =
-        "Wifi,Host=%s,Version=" VERSION " "
-        "BSSID=\"%s\","
-        "IP=\"%s\","
-        "RSSI=%d";
-    static const uint32_t interval = 10000;
-    static const int8_t min_diff = 5;
-    static uint32_t prev = 0;
-    static int8_t reportedRssi = 0;
+JbdBms jbdbms(rs485_bus, &rs485_access_ms);  // Same serial port as esmart3 is ok, if parameters are the same
 
-    // Update for web page
-    lastRssi = rssi;
-    for (size_t i=0; i<sizeof(lastBssid); i+=3) {
-        lastBssid[i] = digits[bssid[i/3] >> 4];
-        lastBssid[i+1] = digits[bssid[i/3] & 0xf];
-    }
+// Idle mode: loop() sleeps until the earliest time a task is due (see dispatch),
+// at most IDLE_MAX_MS so web server and mqtt stay responsive (see handle_idle)
+#define IDLE_MAX_MS 50
 
-    // RSSI rate limit for log and db
-    int8_t diff = reportedRssi - lastRssi;
-    if (diff < 0 ) {
-        diff = -diff;
-    }
-    uint32_t now = millis();
-    if (diff >= min_diff || (now - prev > interval) ) {
-        json_Wifi(msg, sizeof(msg), lastBssid, lastRssi);
-        slog(msg);
-        publish(MQTT_TOPIC "/json/Wifi", msg);
+bool idle_sleep = IDLE_SLEEP;
+uint32_t idle_budget_ms = IDLE_MAX_MS;  // ms until the running task wants to run again
+uint64_t idle_us = 0;                   // slept in total
+bool dispatch_timed = true;             // false: run all tasks on every loop (see dispatch)
 
-        snprintf(msg, sizeof(msg), lineFmt, WiFi.getHostname(), lastBssid, WiFi.localIP().toString().c_str(), lastRssi);
-        postInflux(msg);
+// Loop statistics
+uint32_t loop_count = 0;
+uint64_t loop_awake_us = 0;     // loop time without idle sleep
+uint64_t loop_overhead_us = 0;  // of that, not spent in tasks
 
-        reportedRssi = lastRssi;
-        prev = now;
+// Ask for the next run of the current task within ms
+void idle_within( uint32_t ms ) {
+    if (ms < idle_budget_ms) {
+        idle_budget_ms = ms;
     }
 }
 
+// Device state cache: records when each device value was last read successfully.
+// The values themselves are the es3* and jbd* record globals and the load status below.
+// Consumers that accept some staleness are served from here without touching the rs485 bus.
+typedef enum { 
+    STATE_LOAD, STATE_INFORMATION, STATE_CHGSTS, STATE_BATPARAM, STATE_LOG, STATE_PARAMETERS, 
+    STATE_LOADPARAM, STATE_PROPARAM, STATE_HARDWARE, STATE_STATUS, STATE_CELLS, STATE_ITEMS 
+} state_item_t;
+
+typedef struct state_entry {
+    const char *name;  // record name for json
+    uint32_t read_ms;  // millis() of last successful read
+    bool valid;        // read at least once
+} state_entry_t;
+
+state_entry_t device_state[STATE_ITEMS] = {
+    { "Load" }, { "Information" }, { "ChgSts" }, { "BatParam" }, { "Log" }, { "Parameters" }, 
+    { "LoadParam" }, { "ProParam" }, { "Hardware" }, { "Status" }, { "Cells" }
+};
+
+bool es3Load = true;                  // cached load status, assume on until read
+const uint32_t load_poll_ms = 500;    // load status is polled this often (see handle_load_led)
+const uint32_t load_max_age = 1500;   // staleness of load status accepted by web and mqtt
+
+extern bool samples_pending;
+
+// Remember successful read of a device value
+void state_touch( state_item_t item ) {
+    device_state[item].read_ms = millis();
+    device_state[item].valid = true;
+    samples_pending = true;  // wake consumers of new samples
+}
 
-// check and report RSSI and BSSID changes
-void handle_wifi() {
-    static byte prevBssid[6] = {0};
-    static int8_t prevRssi = 0;
-    static bool prevConnected = false;
+// Return true if value was read within max_age ms
+bool state_fresh( state_item_t item, uint32_t max_age ) {
+    return device_state[item].valid && millis() - device_state[item].read_ms <= max_age;
+}
 
-    static const uint32_t reconnectInterval = 10000;  // try reconnect every 10s
-    static const uint32_t reconnectLimit = 60;        // try restart after 10min
-    static uint32_t reconnectPrev = 0;
-    static uint32_t reconnectCount = 0;
+// Records to poll now, regardless of their interval
+uint32_t poll_forced_items = 0;
+bool replay_active = false;  // records come from a replayed log instead of the bus (see replay)
+uint32_t replay_ready = 0;   // items with a struct in replay_slot that its handler did not take yet
 
-    bool currConnected = WiFi.isConnected();
-    int8_t currRssi = 0;
-    byte *currBssid = prevBssid;
+void force_poll( state_item_t item ) {
+    poll_forced_items |= 1 << item;
+}
 
-    if (currConnected) {
-        currRssi = WiFi.RSSI();
-        currBssid = WiFi.BSSID();
+// Return true once if a poll of item was forced
+// While replaying only if a struct waits, e.g. the fault path must not count failed reads then
+bool poll_forced( state_item_t item ) {
+    bool forced = poll_forced_items & (1 << item);
+    poll_forced_items &= ~(1 << item);
+    return forced && (!replay_active || (replay_ready & (1 << item)));
+}
 
-        if (!prevConnected) {
-            report_wifi(prevRssi, prevBssid);
-        }
+// Adaptive poll intervals: a record that changed is polled twice as often (down to min_ms),
+// an unchanged one a quarter less often each time (up to max_ms, lowered by the operating state).
+// base_ms is the former fixed interval, used to measure how many polls and how much bus time is saved.
+typedef struct poll_entry {
+    uint32_t min_ms, max_ms, base_ms;
+    uint32_t interval_ms;  // current
+    uint32_t first_ms;     // millis() of the first poll
+    uint32_t polls;        // successful reads
+    uint32_t changes;      // reads with changed values
+    uint64_t bus_us;       // time spent in successful reads
+    uint32_t errors;       // failed reads
+} poll_entry_t;
+
+poll_entry_t poll_state[STATE_ITEMS] = {
+    {},                                 // Load: see load_poll_ms
+    {},                                 // Information: fixed 60s
+    { 300, 10000, 550, 550 },           // ChgSts
+    { 10000, 300000, 10000, 10000 },    // BatParam
+    { 10000, 60000, 10000, 10000 },     // Log
+    { 10000, 300000, 10000, 10000 },    // Parameters
+    { 10000, 300000, 10000, 10000 },    // LoadParam
+    { 10000, 300000, 10000, 10000 },    // ProParam
+    {},                                 // Hardware: fixed 60s
+    { 3000, 30000, 6000, 6000 },        // Status
+    { 3000, 30000, 6000, 6000 }         // Cells
+};
+
+// Operating state, updated by the ChgSts and Status polls
+bool op_night = false;         // PV voltage below battery voltage
+bool op_charging = false;      // charger current flows
+bool op_battery_idle = false;  // battery current below 0.5A
+
+// Highest interval for item in the current operating state
+uint32_t poll_limit( state_item_t item ) {
+    const poll_entry_t &entry = poll_state[item];
+    switch (item) {
+        case STATE_CHGSTS:
+            return op_charging ? 2 * entry.base_ms : op_night ? entry.max_ms : 4 * entry.base_ms;
+        case STATE_STATUS:
+        case STATE_CELLS:
+            return op_battery_idle ? entry.max_ms : entry.base_ms;
+        case STATE_LOG:
+            return op_night ? entry.max_ms : entry.base_ms;  // energy counters move with PV
+        default:
+            return entry.max_ms;
+    }
+}
 
-        if (currRssi != prevRssi || memcmp(currBssid, prevBssid, sizeof(prevBssid))) {
-            report_wifi(currRssi, currBssid);
-        }
+// Return true if the interval of item has passed since prev and advance prev
+bool poll_due( state_item_t item, uint32_t &prev, uint32_t now ) {
+    if (replay_active) {
+        return false;  // the replay forces the polls
+    }
+    uint32_t interval = poll_state[item].interval_ms;
+    if (now - prev < interval) {
+        idle_within(interval - (now - prev));
+        return false;
+    }
+    prev = (now - prev < 2 * interval) ? prev + interval : now;  // keep the phase unless far behind
+    int32_t left = prev + interval - now;
+    idle_within(left > 0 ? left : 0);
+    return true;
+}
 
-        memcpy(prevBssid, currBssid, sizeof(prevBssid));
-        reconnectCount = 0;
+// Account a successful read of item that started at start_us and adapt its interval
+void poll_adapt( state_item_t item, uint32_t start_us, bool changed ) {
+    poll_entry_t &entry = poll_state[item];
+    if (!entry.polls++) {
+        entry.first_ms = millis();
+    }
+    entry.bus_us += micros() - start_us;
+    if (changed) {
+        entry.changes++;
+        entry.interval_ms = max(entry.min_ms, entry.interval_ms / 2);
     }
     else {
-        uint32_t now = millis();
-        if (reconnectCount == 0 || now - reconnectPrev > reconnectInterval) {
-            WiFi.reconnect();
-            reconnectCount++;
-            if (reconnectCount > reconnectLimit) {
-                Serial.println("Failed to reconnect WLAN, about to reset");
-                for (int i = 0; i < 20; i++) {
-                    digitalWrite(HEALTH_LED_PIN, (i & 1) ? HEALTH_LED_ON : HEALTH_LED_OFF);
-                    delay(100);
-                }
-                ESP.restart();
-                while (true)
-                    ;
-            }
-            reconnectPrev = now;
-        }
+        entry.interval_ms += entry.interval_ms / 4;
     }
+    entry.interval_ms = min(entry.interval_ms, max(poll_limit(item), entry.min_ms));
+}
 
-    prevRssi = currRssi;
-    prevConnected = currConnected;
+// Changes that speed up polling: state and fault bits, or values beyond their noise deadband.
+// Temperatures, CO2 and other slow fields only count at the next regular poll
+bool differs( int32_t a, int32_t b, int32_t deadband ) {
+    return abs(a - b) > deadband;
 }
 
+bool poll_changed( const ESmart3::ChgSts_t &a, const ESmart3::ChgSts_t &b ) {
+    // volts and amps in 0.1 units
+    return a.wChgMode != b.wChgMode || a.wFault != b.wFault
+        || differs(a.wPvVolt, b.wPvVolt, 2) || differs(a.wBatVolt, b.wBatVolt, 1)
+        || differs(a.wChgCurr, b.wChgCurr, 2) || differs(a.wLoadCurr, b.wLoadCurr, 2);
+}
 
-bool json_Information(char *json, size_t maxlen, ESmart3::Information_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"Information\":{"
-        "\"Model\":\"%16.16s\","
-        "\"Date\":\"%8.8s\","
-        "\"FirmWare\":\"%4.4s\"}}";
+bool poll_changed( const JbdBms::Status_t &a, const JbdBms::Status_t &b ) {
+    // 10mV and 10mA units
+    return a.fault != b.fault || a.mosfetStatus != b.mosfetStatus || a.balance != b.balance
+        || differs(a.voltage, b.voltage, 5) || differs(a.current, b.current, 20);
+}
 
-    int len = snprintf(json, maxlen, jsonFmt, (char *)data.wSerial, 
-        (char *)data.wModel, (char *)data.wDate, (char *)data.wFirmWare);
+bool poll_changed( const JbdBms::Cells_t &a, const JbdBms::Cells_t &b ) {
+    for (size_t i = 0; i < sizeof(a.voltages) / sizeof(*a.voltages); i++) {
+        if (differs(a.voltages[i], b.voltages[i], 5)) {  // mV
+            return true;
+        }
+    }
+    return false;
+}
 
-    return len < maxlen;
+// Polls and bus time in ms saved compared to the fixed base_ms interval (negative if polled more often)
+void poll_savings( state_item_t item, int32_t &polls, int32_t &bus_ms ) {
+    const poll_entry_t &entry = poll_state[item];
+    polls = bus_ms = 0;
+    if (entry.polls && entry.base_ms) {
+        polls = (int32_t)((millis() - entry.first_ms) / entry.base_ms + 1) - (int32_t)entry.polls;
+        bus_ms = (int64_t)polls * (int64_t)(entry.bus_us / entry.polls) / 1000;
+    }
 }
 
+// Fault bit transitions of charger and bms, handled by handle_faults() right after detection
+typedef enum { FAULT_CHARGER, FAULT_BMS, FAULT_SOURCES } fault_source_t;
+
+typedef struct fault_state {
+    const char *name;    // for topic and json
+    bool pending;        // transition not yet handled
+    uint32_t prev;       // fault bits before transition
+    uint32_t bits;       // fault bits after transition
+    uint32_t detect_ms;  // millis() of the read that saw the transition
+} fault_state_t;
+
+fault_state_t fault_state[FAULT_SOURCES] = { { "Charger" }, { "BMS" } };
+
+// Remember a fault transition and re-poll the records of the affected device
+void fault_detected( fault_source_t source, uint32_t prev, uint32_t bits ) {
+    fault_state_t &fault = fault_state[source];
+    if (!fault.pending) {
+        fault.prev = prev;
+        fault.detect_ms = millis();
+    }
+    fault.bits = bits;
+    fault.pending = true;
+    if (source == FAULT_CHARGER) {
+        force_poll(STATE_CHGSTS);
+    }
+    else {
+        force_poll(STATE_STATUS);
+        force_poll(STATE_CELLS);
+    }
+}
 
-ESmart3::Information_t es3Information = {0};
 
-// get device info once every minute
-void handle_es3Information() {
-    static const uint32_t interval = 60000;
-    static uint32_t prev = 0 - interval + 0;  // check at start first
+// Get load status, from cache if not older than max_age ms, else from the bus
+bool get_load( bool &on, uint32_t max_age ) {
+    if (!state_fresh(STATE_LOAD, max_age)) {
+        bool load;
+        if (!esmart3.getLoad(load)) {
+            return false;
+        }
+        es3Load = load;
+        state_touch(STATE_LOAD);
+    }
+    on = es3Load;
+    return true;
+}
+
+// Switch load and keep the cache in sync
+bool set_load( bool on ) {
+    if (!esmart3.setLoad(on)) {
+        device_state[STATE_LOAD].valid = false;  // unknown now, read again on next poll
+        return false;
+    }
+    es3Load = on;
+    state_touch(STATE_LOAD);
+    return true;
+}
 
+// Cached load status and age of all cached device values in ms (null if never read)
+bool json_State( char *json, size_t maxlen ) {
     uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        ESmart3::Information_t data = {0};
-        if (esmart3.getInformation(data)) {
-            if (strncmp((const char *)data.wSerialID, (const char *)es3Information.wSerialID, sizeof(data.wSerialID))) {
-                // found a new/different eSmart3
-                static const char lineFmt[] =
-                    "Information,Serial=%8.8s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "Model=\"%16.16s\","
-                    "Date=\"%8.8s\","
-                    "FirmWare=\"%4.4s\"";
+    int len = snprintf(json, maxlen, "{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"State\":{\"Load\":%s,\"Age\":{",
+        WiFi.getHostname(), device_state[STATE_LOAD].valid ? (es3Load ? "true" : "false") : "null");
+    for (size_t i = 0; i < STATE_ITEMS && len < maxlen; i++) {
+        const state_entry_t &entry = device_state[i];
+        if (entry.valid) {
+            len += snprintf(&json[len], maxlen - len, "%s\"%s\":%u", i ? "," : "", entry.name, (unsigned)(now - entry.read_ms));
+        }
+        else {
+            len += snprintf(&json[len], maxlen - len, "%s\"%s\":null", i ? "," : "", entry.name);
+        }
+    }
+    if (len < maxlen) {
+        len += snprintf(&json[len], maxlen - len, "}}}");
+    }
 
-                es3Information = data;
-                json_Information(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/Information", msg);
+    return len < maxlen;
+}
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)data.wSerial,
-                    WiFi.getHostname(), (char *)data.wModel,
-                    (char *)data.wDate, (char *)data.wFirmWare);
-                postInflux(msg);
+
+// Log pipeline: slog() only queues a record into a lock-free ring (multiple producers, one consumer).
+// A low priority task writes the records to serial and syslog and keeps a tail of recent lines in RAM.
+// Each message class has a token bucket. Over-rate messages are counted and reported as suppressed.
+#include <atomic>
+
+typedef enum { LOG_CLASS_SYSTEM, LOG_CLASS_DATA, LOG_CLASS_BUS, LOG_CLASS_NET, LOG_CLASS_CMD, LOG_CLASSES } log_class_t;
+
+typedef struct log_limit {
+    const char *name;
+    uint32_t interval;     // ms per message on average
+    uint32_t burst;        // messages allowed in a row
+    uint32_t credit;       // ms of unused interval, up to burst * interval
+    uint32_t prev;         // ms of last credit update
+    uint32_t suppressed;   // messages dropped since last summary
+} log_limit_t;
+
+log_limit_t log_limits[LOG_CLASSES] = {
+    { "system", 1000, 20 },
+    { "data", 1000, 5 },
+    { "bus", 10000, 5 },
+    { "net", 5000, 5 },
+    { "cmd", 1000, 10 }
+};
+portMUX_TYPE log_limit_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#define LOG_RING_SLOTS 32
+#define LOG_TEXT_SIZE 160
+#define LOG_TAIL_SIZE 4096
+
+typedef struct log_record {
+    std::atomic<uint32_t> seq;  // ring position the slot is ready for
+    uint32_t ms;
+    uint16_t pri;
+    char text[LOG_TEXT_SIZE];
+} log_record_t;
+
+log_record_t log_ring[LOG_RING_SLOTS];
+std::atomic<uint32_t> log_head(0);  // next position to write
+uint32_t log_tail_pos = 0;          // next position to read (log task only)
+std::atomic<uint32_t> log_lost(0);  // records dropped because the ring was full
+
+uint8_t log_level = LOG_INFO;       // runtime level, change with mqtt cmd or /loglevel
+
+char log_tail[LOG_TAIL_SIZE];       // recent lines for /log
+size_t log_tail_end = 0;            // next write position in log_tail
+bool log_tail_wrapped = false;
+portMUX_TYPE log_tail_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+// Queue a record without blocking. Return false if the ring is full
+bool log_push( const char *message, uint16_t pri ) {
+    uint32_t pos = log_head.load(std::memory_order_relaxed);
+    log_record_t *rec;
+
+    for (;;) {
+        rec = &log_ring[pos % LOG_RING_SLOTS];
+        int32_t diff = (int32_t)(rec->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (log_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;  // slot is ours
             }
         }
+        else if (diff < 0) {
+            log_lost++;
+            return false;  // consumer did not free this slot yet
+        }
         else {
-            slog("getInformation error", LOG_ERR);
+            pos = log_head.load(std::memory_order_relaxed);  // another producer was faster
         }
     }
-}
 
+    rec->ms = millis();
+    rec->pri = pri;
+    snprintf(rec->text, sizeof(rec->text), "%s", message);
+    rec->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
 
-static const char *bits( uint16_t faults, uint8_t num_bits ) {
-    static char str[17];
 
-    if (num_bits >= sizeof(str)) {
-        *str = '\0';
+// Token bucket of message class. Return true if the message may pass
+bool log_allowed( log_class_t cls ) {
+    log_limit_t &limit = log_limits[cls];
+    uint32_t now = millis();
+    bool allowed = false;
+
+    portENTER_CRITICAL(&log_limit_mux);
+    limit.credit = min(limit.credit + (now - limit.prev), limit.burst * limit.interval);
+    limit.prev = now;
+    if (limit.credit >= limit.interval) {
+        limit.credit -= limit.interval;
+        allowed = true;
     }
     else {
-        char *ptr = &str[num_bits];
-        *ptr = '\0';
-        uint16_t mask = 1;
-        while (num_bits--) {
-            *(--ptr) = (faults & mask) ? '1' : '0';
-            mask <<= 1;
-        }
+        limit.suppressed++;
     }
+    portEXIT_CRITICAL(&log_limit_mux);
 
-    return str;
+    return allowed;
 }
 
 
-bool json_ChgSts(char *json, size_t maxlen, ESmart3::ChgSts_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"ChgSts\":{"
-        "\"ChgMode\":%u,"
-        "\"PvVolt\":%u,"
-        "\"BatVolt\":%u,"
-        "\"ChgCurr\":%u,"
-        "\"OutVolt\":%u,"
-        "\"LoadVolt\":%u,"
-        "\"LoadCurr\":%u,"
-        "\"ChgPower\":%u,"
-        "\"LoadPower\":%u,"
-        "\"BatTemp\":%d,"
-        "\"InnerTemp\":%d,"
-        "\"BatCap\":%u,"
-        "\"CO2\":%u,"
-        "\"Fault\":\"%s\","
-        "\"SystemReminder\":%u}}";
+void slog(const char *message, uint16_t pri = LOG_INFO, log_class_t cls = LOG_CLASS_SYSTEM) {
+    if (LOG_PRI(pri) <= log_level && log_allowed(cls)) {
+        log_push(message, pri);
+    }
+}
 
-    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
-        data.wChgMode, data.wPvVolt, data.wBatVolt, data.wChgCurr, data.wOutVolt,
-        data.wLoadVolt, data.wLoadCurr, data.wChgPower, data.wLoadPower, data.wBatTemp, 
-        data.wInnerTemp, data.wBatCap, data.dwCO2, bits(data.wFault, 10), data.wSystemReminder);
 
-    return len < maxlen;
+// Append a line to the RAM tail, overwriting the oldest lines
+void log_append_tail( const char *line ) {
+    portENTER_CRITICAL(&log_tail_mux);
+    while (*line) {
+        log_tail[log_tail_end++] = *line++;
+        if (log_tail_end == sizeof(log_tail)) {
+            log_tail_end = 0;
+            log_tail_wrapped = true;
+        }
+    }
+    portEXIT_CRITICAL(&log_tail_mux);
 }
 
 
-ESmart3::ChgSts_t es3ChgSts = {0};
+// Copy the tail, oldest complete line first, into buf and terminate it
+size_t log_tail_copy( char *buf, size_t size ) {
+    size_t len = 0;
 
-// get device status once every 1/2 second
-void handle_es3ChgSts() {
-    static const uint32_t interval = 500 + 50;
-    static uint32_t prev = 0 - interval;  // check at start + delay
+    portENTER_CRITICAL(&log_tail_mux);
+    bool wrapped = log_tail_wrapped;
+    if (wrapped) {  // oldest part behind the write position first
+        len = min(sizeof(log_tail) - log_tail_end, size - 1);
+        memcpy(buf, &log_tail[log_tail_end], len);
+    }
+    size_t n = min(log_tail_end, size - 1 - len);
+    memcpy(&buf[len], log_tail, n);
+    len += n;
+    portEXIT_CRITICAL(&log_tail_mux);
+    buf[len] = '\0';
+
+    if (wrapped) {  // first line is partly overwritten
+        char *first = (char *)memchr(buf, '\n', len);
+        if (first) {
+            size_t skip = first + 1 - buf;
+            len -= skip;
+            memmove(buf, first + 1, len + 1);
+        }
+    }
+    return len;
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        ESmart3::ChgSts_t data = {0};
-        if( esmart3.getChgSts(data) ) {
-            if( memcmp(&data, &es3ChgSts, sizeof(data) ) ) {
-                // values have changed: publish
-                static const char lineFmt[] =
-                    "ChgSts,Serial=%8.8s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "ChgMode=%u,"
-                    "PvVolt=%u,"
-                    "BatVolt=%u,"
-                    "ChgCurr=%u,"
-                    "OutVolt=%u,"
-                    "LoadVolt=%u,"
-                    "LoadCurr=%u,"
-                    "ChgPower=%u,"
-                    "LoadPower=%u,"
-                    "BatTemp=%d,"
-                    "InnerTemp=%d,"
-                    "BatCap=%u,"
-                    "CO2=%u,"
-                    "Fault=\"%s\","
-                    "SystemReminder=%u";
-                
-                
-                json_ChgSts(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/ChgSts", msg);
 
-                const char *faults = bits(data.wFault, 10);
-                if (es3ChgSts.wFault != data.wFault) {
-                    publish(MQTT_TOPIC "/status/Charger", faults);        
-                }
+// The uart baud rate derives from the APB clock, which idle mode lets drop (see setup_idle)
+#include <esp_pm.h>
 
-                es3ChgSts = data;
+esp_pm_lock_handle_t log_lock = 0;
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
-                    data.wChgMode, data.wPvVolt, data.wBatVolt, data.wChgCurr, data.wOutVolt,
-                    data.wLoadVolt, data.wLoadCurr, data.wChgPower, data.wLoadPower, data.wBatTemp, 
-                    data.wInnerTemp, data.wBatCap, data.dwCO2, faults, data.wSystemReminder);
-                postInflux(msg);
-            }
-        }
+// Write one record to all log targets
+void log_write( uint32_t ms, uint16_t pri, const char *text ) {
+    static const char *const names[] = { "EMERG", "ALERT", "CRIT", "ERR", "WARNING", "NOTICE", "INFO", "DEBUG" };
+    char line[LOG_TEXT_SIZE + 32];
+
+    if (log_lock) {
+        esp_pm_lock_acquire(log_lock);
+    }
+    Serial.println(text);
+    Serial.flush();  // keep the APB clock until the last bit is out
+    if (log_lock) {
+        esp_pm_lock_release(log_lock);
+    }
+    if (WiFi.isConnected()) {
+        syslog.log(pri, text);
+    }
+    snprintf(line, sizeof(line), "%u.%03u %s %s\n", (unsigned)(ms / 1000), (unsigned)(ms % 1000), names[LOG_PRI(pri)], text);
+    log_append_tail(line);
+}
+
+
+// Report suppressed messages of classes that have credit again
+void log_summaries() {
+    for (size_t cls = 0; cls < LOG_CLASSES; cls++) {
+        uint32_t suppressed = 0;
+        portENTER_CRITICAL(&log_limit_mux);
+        if (log_limits[cls].suppressed && log_limits[cls].credit >= log_limits[cls].interval) {
+            suppressed = log_limits[cls].suppressed;
+            log_limits[cls].suppressed = 0;
+        }
+        portEXIT_CRITICAL(&log_limit_mux);
+        if (suppressed) {
+            char text[64];
+            snprintf(text, sizeof(text), "%u %s messages suppressed", (unsigned)suppressed, log_limits[cls].name);
+            log_write(millis(), LOG_NOTICE, text);
+        }
+    }
+    uint32_t lost = log_lost.exchange(0);
+    if (lost) {
+        char text[64];
+        snprintf(text, sizeof(text), "%u messages lost, log ring full", (unsigned)lost);
+        log_write(millis(), LOG_WARNING, text);
+    }
+}
+
+
+// Log consumer task: drains the ring, then sleeps a bit
+void log_task( void *param ) {
+    static const uint32_t summary_interval = 5000;
+    uint32_t prev = 0;
+
+    for (;;) {
+        log_record_t &rec = log_ring[log_tail_pos % LOG_RING_SLOTS];
+        if (rec.seq.load(std::memory_order_acquire) == log_tail_pos + 1) {
+            log_write(rec.ms, rec.pri, rec.text);
+            rec.seq.store(log_tail_pos + LOG_RING_SLOTS, std::memory_order_release);
+            log_tail_pos++;
+            continue;
+        }
+
+        uint32_t now = millis();
+        if (now - prev >= summary_interval) {
+            prev = now;
+            log_summaries();
+        }
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+}
+
+
+void setup_log() {
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++) {
+        log_ring[i].seq = i;
+    }
+    for (auto &limit: log_limits) {
+        limit.credit = limit.burst * limit.interval;
+    }
+    #if CONFIG_PM_ENABLE
+        esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "log", &log_lock);
+    #endif
+    // not above the priority of the arduino loop task
+    xTaskCreate(log_task, "log", 4096, 0, tskIDLE_PRIORITY + 1, 0);
+}
+
+
+// Set log level from name or number. Return false if unknown
+bool set_log_level( const char *level ) {
+    static const char *const names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+    for (uint8_t i = 0; i < sizeof(names)/sizeof(*names); i++) {
+        if (strcasecmp(level, names[i]) == 0 || (level[0] == '0' + i && level[1] == '\0')) {
+            log_level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Bounded chunk writer: formats into a small buffer and hands full chunks to sink()
+// The base class only counts bytes, e.g. to know a content length before streaming
+class ChunkWriter {
+public:
+    ChunkWriter() : _len(0), _total(0) {}
+    virtual ~ChunkWriter() {}
+
+    void print( const char *str ) {
+        while (*str) {
+            if (_len == sizeof(_buf)) {
+                flush_chunk();
+            }
+            _buf[_len++] = *str++;
+            _total++;
+        }
+    }
+
+    void printf( const char *fmt, ... ) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(&_buf[_len], sizeof(_buf) - _len, fmt, args);
+        va_end(args);
+        if (n >= 0 && _len + n >= sizeof(_buf)) {
+            // did not fit: retry in empty buffer
+            flush_chunk();
+            if (n >= (int)sizeof(_buf)) {
+                // longer than a chunk: format into a temporary buffer and hand it to sink() as is
+                char local[512];
+                char *piece = n < (int)sizeof(local) ? local : (char *)malloc(n + 1);
+                if (piece) {
+                    va_start(args, fmt);
+                    vsnprintf(piece, n + 1, fmt, args);
+                    va_end(args);
+                    sink(piece, n);
+                    _total += n;
+                    if (piece != local) {
+                        free(piece);
+                    }
+                }
+                return;
+            }
+            va_start(args, fmt);
+            n = vsnprintf(_buf, sizeof(_buf), fmt, args);
+            va_end(args);
+        }
+        if (n > 0) {
+            _len += n;
+            _total += n;
+        }
+    }
+
+    // binary data, e.g. a capture download
+    void write( const uint8_t *data, size_t len ) {
+        while (len--) {
+            if (_len == sizeof(_buf)) {
+                flush_chunk();
+            }
+            _buf[_len++] = *data++;
+            _total++;
+        }
+    }
+
+    // hand over remaining bytes and return number of bytes written so far
+    size_t flush() {
+        flush_chunk();
+        return _total;
+    }
+
+protected:
+    virtual void sink( const char *chunk, size_t len ) {}
+
+private:
+    void flush_chunk() {
+        if (_len) {
+            sink(_buf, _len);
+            _len = 0;
+        }
+    }
+
+    char _buf[128];
+    size_t _len;
+    size_t _total;
+};
+
+
+// Stream chunks into a started mqtt publish
+class MqttWriter : public ChunkWriter {
+protected:
+    void sink( const char *chunk, size_t len ) override {
+        mqtt.write((const uint8_t *)chunk, len);
+    }
+};
+
+
+// Stream chunks as content of a started web server response
+class WebWriter : public ChunkWriter {
+protected:
+    void sink( const char *chunk, size_t len ) override {
+        web_server.sendContent(chunk, len);
+    }
+};
+
+
+// Stream chunks into a connected tcp client
+class ClientWriter : public ChunkWriter {
+public:
+    ClientWriter( WiFiClient &client ) : _client(client) {}
+
+protected:
+    void sink( const char *chunk, size_t len ) override {
+        _client.write((const uint8_t *)chunk, len);
+    }
+
+private:
+    WiFiClient &_client;
+};
+
+
+// Collect chunks in a buffer. Result is always terminated, but might be cut
+class BufferWriter : public ChunkWriter {
+public:
+    BufferWriter( char *buf, size_t size ) : _buf(buf), _size(size), _used(0) {
+        *_buf = '\0';
+    }
+
+    // return true if all written bytes fit into the buffer
+    bool finish() {
+        return flush() < _size;
+    }
+
+protected:
+    void sink( const char *chunk, size_t len ) override {
+        size_t n = min(len, _size - 1 - _used);
+        memcpy(&_buf[_used], chunk, n);
+        _used += n;
+        _buf[_used] = '\0';
+    }
+
+private:
+    char *_buf;
+    size_t _size;
+    size_t _used;
+};
+
+
+// Send a response of unlimited size, streamed by write() in chunks
+template<typename W> void send_streamed( const char *content_type, W write ) {
+    ChunkWriter counter;
+    write(counter);
+    web_server.setContentLength(counter.flush());
+    web_server.send(200, content_type, "");
+    WebWriter out;
+    write(out);
+    out.flush();
+}
+
+
+// Event journal: fault edges, load and mosfet changes, resets and wifi drops survive resets and 
+// network outages in the otherwise unused spiffs partition. Entries are appended to a ring of 
+// flash sectors and a sector is only erased when the ring wraps into it, so each sector sees 
+// one erase per 256 entries.
+#include <esp_partition.h>
+
+typedef enum { JOURNAL_RESET, JOURNAL_FAULT, JOURNAL_LOAD, JOURNAL_MOSFETS, JOURNAL_WIFI, JOURNAL_SOC, JOURNAL_TYPES } journal_type_t;
+const char *const journal_types[] = { "Reset", "Fault", "Load", "Mosfets", "Wifi", "SoC" };
+
+#define JOURNAL_UPTIME 0x80  // type flag: time is seconds since boot, ntp time was not known yet
+#define JOURNAL_SECTOR 4096
+#define JOURNAL_ERASED 0xffffffff
+
+typedef struct journal_entry {
+    uint32_t seq;    // 1, 2, ...
+    uint32_t time;   // unix time or uptime, see JOURNAL_UPTIME
+    uint8_t type;    // journal_type_t | flags
+    uint8_t arg;     // e.g. fault source or reset reason
+    uint16_t check;  // detects partially written or foreign entries
+    uint32_t value;  // e.g. fault bits | previous bits << 16, load on
+} journal_entry_t;
+
+const esp_partition_t *journal_partition = 0;
+size_t journal_size = 0;     // usable bytes, whole sectors
+size_t journal_pos = 0;      // offset of next entry
+uint32_t journal_seq = 0;    // sequence of last entry
+uint32_t journal_errors = 0; // failed flash operations
+
+uint16_t journal_check( const journal_entry_t &entry ) {
+    uint32_t sum = entry.seq ^ entry.time ^ entry.value ^ (entry.type << 8 | entry.arg);
+    return (sum ^ (sum >> 16) ^ 0xa55a) & 0xffff;
+}
+
+// Read entry at pos, return false if it is not a valid entry
+bool journal_read( size_t pos, journal_entry_t &entry ) {
+    return esp_partition_read(journal_partition, pos, &entry, sizeof(entry)) == ESP_OK
+        && entry.seq != JOURNAL_ERASED && entry.check == journal_check(entry)
+        && (entry.type & ~JOURNAL_UPTIME) < JOURNAL_TYPES;
+}
+
+// Append an event
+void journal_write( journal_type_t type, uint8_t arg, uint32_t value ) {
+    if (replay_active && type != JOURNAL_WIFI) return;  // replayed events did not happen now
+    if (!journal_partition) {
+        return;
+    }
+    journal_entry_t entry;
+    entry.seq = ++journal_seq;
+    entry.type = type;
+    time_t now = time(NULL);
+    if (now > 1582230020) {  // same as check_ntptime()
+        entry.time = now;
+    }
+    else {
+        entry.time = millis() / 1000;
+        entry.type |= JOURNAL_UPTIME;
+    }
+    entry.arg = arg;
+    entry.value = value;
+    entry.check = journal_check(entry);
+
+    if (journal_pos % JOURNAL_SECTOR == 0 
+     && esp_partition_erase_range(journal_partition, journal_pos, JOURNAL_SECTOR) != ESP_OK) {
+        journal_errors++;
+    }
+    if (esp_partition_write(journal_partition, journal_pos, &entry, sizeof(entry)) != ESP_OK) {
+        journal_errors++;
+    }
+    journal_pos = (journal_pos + sizeof(entry)) % journal_size;
+}
+
+// Find the end of the journal: the newest sector is the one whose first entry has the highest seq
+void setup_journal() {
+    journal_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    if (!journal_partition) {
+        slog("No spiffs partition for the event journal", LOG_ERR);
+        return;
+    }
+    journal_size = journal_partition->size / JOURNAL_SECTOR * JOURNAL_SECTOR;
+
+    journal_entry_t entry;
+    bool found = false;
+    size_t newest = 0;
+    for (size_t sector = 0; sector < journal_size; sector += JOURNAL_SECTOR) {
+        if (journal_read(sector, entry) && (!found || entry.seq > journal_seq)) {
+            found = true;
+            newest = sector;
+            journal_seq = entry.seq;
+        }
+    }
+    if (found) {
+        journal_pos = newest + sizeof(entry);
+        while (journal_pos % JOURNAL_SECTOR && journal_read(journal_pos, entry) && entry.seq == journal_seq + 1) {
+            journal_seq = entry.seq;
+            journal_pos += sizeof(entry);
+        }
+        journal_pos %= journal_size;
+    }
+
+    char msg[80];
+    snprintf(msg, sizeof(msg), "Event journal %u KB, last event %u", (unsigned)(journal_size / 1024), (unsigned)journal_seq);
+    slog(msg, LOG_INFO);
+    journal_write(JOURNAL_RESET, esp_reset_reason(), 0);
+}
+
+// Events as json, newest first, filtered by unix time (entries with only uptime match if from is 0)
+void write_Events( ChunkWriter &out, uint32_t from, uint32_t to, uint32_t max_count ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Events\":[", WiFi.getHostname());
+    journal_entry_t entry;
+    uint32_t seq = journal_seq + 1;
+    size_t pos = journal_pos;
+    uint32_t count = 0;
+    for (size_t n = journal_partition ? journal_size / sizeof(entry) : 0; n && count < max_count; n--) {
+        pos = (pos ? pos : journal_size) - sizeof(entry);
+        if (!journal_read(pos, entry) || entry.seq != seq - 1) {
+            break;  // reached erased or stale entries
+        }
+        seq = entry.seq;
+        bool uptime = entry.type & JOURNAL_UPTIME;
+        if (uptime ? from != 0 : (entry.time < from || entry.time > to)) {
+            continue;
+        }
+        out.printf("%s{\"Seq\":%u,\"%s\":%u,\"Type\":\"%s\",\"Arg\":%u,\"Value\":%u}", count ? "," : "",
+            (unsigned)entry.seq, uptime ? "Uptime" : "Time", (unsigned)entry.time, 
+            journal_types[entry.type & ~JOURNAL_UPTIME], entry.arg, (unsigned)entry.value);
+        count++;
+    }
+    out.print("]}");
+}
+
+
+// Mqtt outbox: keeps only the latest payload per topic until the broker session is up
+// Document slots hold full json payloads, value slots the short per field payloads
+#define OUTBOX_DOC_SLOTS 16
+#define OUTBOX_VALUE_SLOTS 64
+#define OUTBOX_VALUE_SIZE 24
+#define OUTBOX_TOPIC_SIZE 64
+
+typedef struct outbox_slot {
+    char topic[OUTBOX_TOPIC_SIZE];
+    char *payload;  // points into document or value storage
+    size_t size;    // capacity of payload
+    size_t len;     // used bytes of payload (might be binary)
+    void (*writer)(ChunkWriter &);  // if set: payload is streamed by writer when sent
+    uint32_t seq;   // enqueue order, 0: slot is free
+    bool retained;
+    bool urgent;    // sent before all other payloads, e.g. fault events
+} outbox_slot_t;
+
+char outbox_docs[OUTBOX_DOC_SLOTS][MQTT_MAX_PACKET_SIZE];
+char outbox_values[OUTBOX_VALUE_SLOTS][OUTBOX_VALUE_SIZE];
+outbox_slot_t outbox[OUTBOX_DOC_SLOTS + OUTBOX_VALUE_SLOTS];
+uint32_t outbox_seq = 0;        // last used sequence number
+uint32_t outbox_coalesced = 0;  // payloads replaced by a newer one before sending
+uint32_t outbox_dropped = 0;    // payloads lost because outbox was full or the client rejected them
+uint32_t outbox_sent = 0;       // payloads handed over to the broker
+
+
+// Assign payload storage to the outbox slots
+void setup_outbox() {
+    for (size_t i = 0; i < OUTBOX_DOC_SLOTS; i++) {
+        outbox[i].payload = outbox_docs[i];
+        outbox[i].size = sizeof(outbox_docs[i]);
+    }
+    for (size_t i = 0; i < OUTBOX_VALUE_SLOTS; i++) {
+        outbox[OUTBOX_DOC_SLOTS + i].payload = outbox_values[i];
+        outbox[OUTBOX_DOC_SLOTS + i].size = sizeof(outbox_values[i]);
+    }
+}
+
+
+// Get outbox slot for topic with room for len payload bytes, the smallest free one that fits,
+// so short values do not take the document slots
+// Replaces a not yet sent payload of the same topic and keeps its position in the queue,
+// unless coalesce is false (events, each one counts)
+// During a replay the payloads go to MQTT_TOPIC/replay/... and are not retained, only status and
+// command results keep their topics
+outbox_slot_t *outbox_slot( const char *topic, size_t len, bool retained, bool coalesce = true ) {
+    outbox_slot_t *slot = 0;
+    outbox_slot_t *oldest = 0;
+    uint32_t seq = 0;
+
+    static const size_t base = sizeof(MQTT_TOPIC "/") - 1;
+    char replay_topic[OUTBOX_TOPIC_SIZE];
+    if (replay_active && strncmp(topic, MQTT_TOPIC "/", base) == 0
+            && strncmp(&topic[base], "status/", 7) && strncmp(&topic[base], "cmd/", 4)) {
+        snprintf(replay_topic, sizeof(replay_topic), MQTT_TOPIC "/replay/%s", &topic[base]);
+        topic = replay_topic;
+        retained = false;
+    }
+
+    for (auto &s: outbox) {
+        if (coalesce && s.seq && strncmp(s.topic, topic, sizeof(s.topic)) == 0) {
+            seq = s.seq;  // same topic: coalesce
+            s.seq = 0;
+            outbox_coalesced++;
+            break;
+        }
+    }
+
+    for (auto &s: outbox) {
+        if (len > s.size) {
+            continue;  // payload does not fit
+        }
+        if (!s.seq) {
+            if (!slot || s.size < slot->size) {
+                slot = &s;
+            }
+            continue;
+        }
+        if (!s.urgent && (!oldest || s.seq < oldest->seq)) {
+            oldest = &s;
+        }
+    }
+
+    if (!slot) {
+        slot = oldest;  // full: sacrifice the oldest payload, never an urgent one
+        outbox_dropped++;
+        if (!slot) {
+            return 0;  // payload too big for any slot
+        }
+    }
+
+    snprintf(slot->topic, sizeof(slot->topic), "%s", topic);
+    slot->len = 0;
+    slot->writer = 0;
+    slot->retained = retained;
+    slot->urgent = false;
+    slot->seq = seq ? seq : ++outbox_seq;
+    return slot;
+}
+
+
+// Queue payload for topic
+void publish( const char *topic, const uint8_t *payload, size_t len, bool retained = false ) {
+    outbox_slot_t *slot = outbox_slot(topic, len, retained);
+    if (slot) {
+        memcpy(slot->payload, payload, len);
+        slot->len = len;
+    }
+}
+
+
+// Queue a payload that is streamed by writer from the then current data when it is sent
+// Used for payloads that can exceed MQTT_MAX_PACKET_SIZE
+void publish( const char *topic, void (*writer)(ChunkWriter &), bool retained = false ) {
+    outbox_slot_t *slot = outbox_slot(topic, 0, retained);
+    if (slot) {
+        slot->writer = writer;
+    }
+}
+
+
+void publish( const char *topic, const char *payload, bool retained = false ) {
+    publish(topic, (const uint8_t *)payload, strlen(payload), retained);
+}
+
+
+// Queue payload ahead of all queued telemetry, it is never evicted by a full queue.
+// Status replaces a queued payload of the same topic, an event is queued in addition to it
+void publish_urgent( const char *topic, const char *payload, bool retained = false, bool event = false ) {
+    size_t len = strlen(payload);
+    outbox_slot_t *slot = outbox_slot(topic, len, retained, !event);
+    if (slot) {
+        memcpy(slot->payload, payload, len);
+        slot->len = len;
+        slot->urgent = true;
+    }
+}
+
+
+// Field mode: each value has its own retained topic MQTT_TOPIC/<record>/<field>
+// and is only published if it changed
+bool mqtt_fields = MQTT_FIELDS;
+
+void publish_field( const char *record, const char *field, const char *value ) {
+    char topic[OUTBOX_TOPIC_SIZE];
+    snprintf(topic, sizeof(topic), MQTT_TOPIC "/%s/%s", record, field);
+    publish(topic, value, true);
+}
+
+
+void publish_field( const char *record, const char *field, long value ) {
+    char str[12];
+    snprintf(str, sizeof(str), "%ld", value);
+    publish_field(record, field, str);
+}
+
+
+// Minimal CBOR (RFC 8949) writer for compact binary mqtt payloads
+// Records are maps with small integer keys, see MQTT_TOPIC/cbor/schema/<record> for the key names
+typedef struct cbor {
+    uint8_t *buf;
+    size_t size;
+    size_t len;  // > size: buffer was too small
+} cbor_t;
+
+#define CBOR_COUNT(keys) (sizeof(keys)/sizeof(*keys))
+
+void cbor_head( cbor_t &c, uint8_t major, uint32_t value ) {
+    uint8_t head[5];
+    size_t n;
+
+    if (value < 24) {
+        head[0] = major << 5 | value;
+        n = 1;
+    }
+    else if (value <= 0xff) {
+        head[0] = major << 5 | 24;
+        head[1] = value;
+        n = 2;
+    }
+    else if (value <= 0xffff) {
+        head[0] = major << 5 | 25;
+        head[1] = value >> 8;
+        head[2] = value;
+        n = 3;
+    }
+    else {
+        head[0] = major << 5 | 26;
+        head[1] = value >> 24;
+        head[2] = value >> 16;
+        head[3] = value >> 8;
+        head[4] = value;
+        n = 5;
+    }
+
+    if (c.len + n <= c.size) {
+        memcpy(&c.buf[c.len], head, n);
+    }
+    c.len += n;
+}
+
+
+void cbor_uint( cbor_t &c, uint32_t value ) {
+    cbor_head(c, 0, value);
+}
+
+
+void cbor_int( cbor_t &c, int32_t value ) {
+    if (value < 0) {
+        cbor_head(c, 1, (uint32_t)(-1 - value));
+    }
+    else {
+        cbor_head(c, 0, value);
+    }
+}
+
+
+void cbor_text( cbor_t &c, const char *str, size_t maxlen ) {
+    size_t n = strnlen(str, maxlen);
+    cbor_head(c, 3, n);
+    if (c.len + n <= c.size) {
+        memcpy(&c.buf[c.len], str, n);
+    }
+    c.len += n;
+}
+
+
+void cbor_array( cbor_t &c, size_t count ) {
+    cbor_head(c, 4, count);
+}
+
+
+void cbor_map( cbor_t &c, size_t count ) {
+    cbor_head(c, 5, count);
+}
+
+
+// Optional cbor encoding of the json records on MQTT_TOPIC/cbor/<record>
+bool mqtt_cbor = MQTT_CBOR;
+
+template<typename T> void publish_cbor( const char *record, bool (*encode)(cbor_t &, const T &), const T &data ) {
+    if (mqtt_cbor) {
+        uint8_t buf[MQTT_MAX_PACKET_SIZE];
+        cbor_t c = { buf, sizeof(buf), 0 };
+        if (encode(c, data)) {
+            char topic[OUTBOX_TOPIC_SIZE];
+            snprintf(topic, sizeof(topic), MQTT_TOPIC "/cbor/%s", record);
+            publish(topic, buf, c.len);
+        }
+    }
+}
+
+
+// Send queued payloads in order while the session is up
+// A payload the client rejects while still connected (e.g. too big) is logged and dropped
+// Return false if the session was lost
+bool drain_outbox( uint8_t max_count ) {
+    while (max_count--) {
+        outbox_slot_t *next = 0;
+        for (auto &s: outbox) {
+            if (s.seq && (!next || s.urgent > next->urgent || (s.urgent == next->urgent && s.seq < next->seq))) {
+                next = &s;
+            }
+        }
+        if (!next) {
+            break;  // all sent
+        }
+        bool sent;
+        if (next->writer) {
+            ChunkWriter counter;
+            next->writer(counter);
+            sent = mqtt.beginPublish(next->topic, counter.flush(), next->retained);
+            if (sent) {
+                MqttWriter out;
+                next->writer(out);
+                out.flush();
+                sent = mqtt.endPublish();
+            }
+        }
+        else {
+            sent = mqtt.publish(next->topic, (const uint8_t *)next->payload, next->len, next->retained);
+        }
+        if (!sent && !mqtt.connected()) {
+            return false;  // keep it for the next session
+        }
+        if (!sent) {
+            char msg[OUTBOX_TOPIC_SIZE + 40];
+            snprintf(msg, sizeof(msg), "Mqtt publish of %s failed", next->topic);
+            slog(msg);
+            outbox_dropped++;
+        }
+        else {
+            outbox_sent++;
+        }
+        next->seq = 0;
+    }
+    return true;
+}
+
+
+// Read a line from client into buf (without line end, cut if too long)
+// Return length or -1 if there was no complete line until deadline
+int read_line( WiFiClient &client, char *buf, size_t size, uint32_t deadline ) {
+    size_t len = 0;
+    while ((int32_t)(deadline - millis()) > 0) {
+        if (client.available()) {
+            int c = client.read();
+            if (c == '\n') {
+                buf[len] = '\0';
+                return len;
+            }
+            if (c != '\r' && len < size - 1) {
+                buf[len++] = c;
+            }
+        }
+        else if (!client.connected()) {
+            break;
+        }
+        else {
+            delay(1);
+        }
+    }
+    buf[len] = '\0';
+    return -1;
+}
+
+
+#ifndef INFLUX_REPLAY_DB
+    #define INFLUX_REPLAY_DB INFLUX_DB "_replay"
+#endif
+
+// Post lines streamed by write_lines() to InfluxDB
+template<typename W> bool postInfluxStreamed( W write_lines ) {
+    static const char uri[] = "/write?db=" INFLUX_DB "&precision=s";
+    static const char replay_uri[] = "/write?db=" INFLUX_REPLAY_DB "&precision=s";  // keeps replays out of the history
+    static const int32_t timeout = 2000;  // ms for connect and for response
+
+    ChunkWriter counter;
+    write_lines(counter);
+    size_t len = counter.flush();
+
+    int prev = influx_status;
+    char response[128] = "";
+    WiFiClient client;
+    if (client.connect(INFLUX_SERVER, INFLUX_PORT, timeout)) {
+        ClientWriter out(client);
+        out.printf("POST %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: " PROGNAME "\r\n"
+            "Content-Type: text/plain\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+            replay_active ? replay_uri : uri, INFLUX_SERVER, INFLUX_PORT, (unsigned)len);
+        write_lines(out);
+        out.flush();
+
+        // status line, headers up to an empty line and maybe an error message
+        uint32_t deadline = millis() + timeout;
+        influx_status = HTTPC_ERROR_READ_TIMEOUT;
+        if (read_line(client, response, sizeof(response), deadline) > 0) {
+            if (sscanf(response, "HTTP/%*s %d", &influx_status) != 1) {
+                influx_status = HTTPC_ERROR_NO_HTTP_SERVER;
+            }
+            while (read_line(client, response, sizeof(response), deadline) > 0);
+            read_line(client, response, sizeof(response), deadline);
+        }
+        client.stop();
+    }
+    else {
+        influx_status = HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+
+    if (influx_status != prev) {
+        Lease msg(POOL_NET);
+        if (msg.ok()) {
+            snprintf(msg, msg.size(), "%d", influx_status);
+            publish(MQTT_TOPIC "/status/DBResponse", msg);
+        }
+    }
+
+    if (influx_status < 200 || influx_status >= 300) {
+        char body[96];  // start of the rejected lines, to see which record failed
+        BufferWriter head(body, sizeof(body));
+        write_lines(head);
+        head.flush();
+        Lease msg(POOL_NET);
+        snprintf(msg, msg.size(), "Post %s:%d%s status=%d bytes=%u body='%s' response='%s'",
+            INFLUX_SERVER, INFLUX_PORT, replay_active ? replay_uri : uri, influx_status, (unsigned)len, body, response);
+        slog(msg, LOG_ERR, LOG_CLASS_NET);
+        return false;
+    }
+
+    post_time = time(NULL);
+    return true;
+}
+
+
+// Post data to InfluxDB
+bool postInflux( const char *line ) {
+    return postInfluxStreamed([line](ChunkWriter &out) { out.print(line); });
+}
+
+
+// Dotted quad of an ipv4 address without the heap String of IPAddress::toString()
+typedef struct ip_str { char str[16]; } ip_str_t;
+
+ip_str_t ip_str( uint32_t ip ) {
+    ip_str_t result;
+    snprintf(result.str, sizeof(result.str), "%u.%u.%u.%u", 
+        (unsigned)(ip & 0xff), (unsigned)((ip >> 8) & 0xff), (unsigned)((ip >> 16) & 0xff), (unsigned)(ip >> 24));
+    return result;
+}
+
+
+// Wifi status as JSON
+bool json_Wifi(char *json, size_t maxlen, const char *bssid, int8_t rssi) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Wifi\":{"
+        "\"BSSID\":\"%s\","
+        "\"IP\":\"%s\","
+        "\"Subnet\":\"%s\","
+        "\"Gateway\":\"%s\","
+        "\"DNS0\":\"%s\","
+        "\"DNS1\":\"%s\","
+        "\"RSSI\":%d}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, WiFi.getHostname(), bssid, 
+        ip_str(WiFi.localIP()).str, 
+        ip_str(WiFi.subnetMask()).str, 
+        ip_str(WiFi.gatewayIP()).str, 
+        ip_str(WiFi.dnsIP(0)).str, 
+        ip_str(WiFi.dnsIP(1)).str, 
+        rssi);
+
+    return len < maxlen;
+}
+
+
+char lastBssid[] = "00:00:00:00:00:00";  // last known connected AP (for web page) 
+int8_t lastRssi = 0;                     // last RSSI (for web page)
+
+// Report a change of RSSI or BSSID
+void report_wifi( int8_t rssi, const byte *bssid ) {
+    static const char digits[] = "0123456789abcdef";
+    static const char lineFmt[] =
+        "Wifi,Host=%s,Version=" VERSION " "
+        "BSSID=\"%s\","
+        "IP=\"%s\","
+        "RSSI=%d";
+    static const uint32_t interval = 10000;
+    static const int8_t min_diff = 5;
+    static uint32_t prev = 0;
+    static int8_t reportedRssi = 0;
+
+    // Update for web page
+    lastRssi = rssi;
+    for (size_t i=0; i<sizeof(lastBssid); i+=3) {
+        lastBssid[i] = digits[bssid[i/3] >> 4];
+        lastBssid[i+1] = digits[bssid[i/3] & 0xf];
+    }
+
+    // RSSI rate limit for log and db
+    int8_t diff = reportedRssi - lastRssi;
+    if (diff < 0 ) {
+        diff = -diff;
+    }
+    uint32_t now = millis();
+    if (diff >= min_diff || (now - prev > interval) ) {
+        Lease msg(POOL_NET);
+        if (msg.ok()) {
+            json_Wifi(msg, msg.size(), lastBssid, lastRssi);
+            slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+            publish(MQTT_TOPIC "/json/Wifi", msg);
+
+            snprintf(msg, msg.size(), lineFmt, WiFi.getHostname(), lastBssid, ip_str(WiFi.localIP()).str, lastRssi);
+            postInflux(msg);
+        }
+
+        reportedRssi = lastRssi;
+        prev = now;
+    }
+}
+
+
+// check and report RSSI and BSSID changes
+void handle_wifi() {
+    static byte prevBssid[6] = {0};
+    static int8_t prevRssi = 0;
+    static bool prevConnected = false;
+
+    static const uint32_t reconnectInterval = 10000;  // try reconnect every 10s
+    static const uint32_t reconnectLimit = 60;        // try restart after 10min
+    static uint32_t reconnectPrev = 0;
+    static uint32_t reconnectCount = 0;
+
+    bool currConnected = WiFi.isConnected();
+    int8_t currRssi = 0;
+    byte *currBssid = prevBssid;
+
+    if (currConnected) {
+        currRssi = WiFi.RSSI();
+        currBssid = WiFi.BSSID();
+
+        if (!prevConnected) {
+            report_wifi(prevRssi, prevBssid);
+            if (reconnectCount) {
+                journal_write(JOURNAL_WIFI, 0, 1);  // reconnected
+            }
+        }
+
+        if (currRssi != prevRssi || memcmp(currBssid, prevBssid, sizeof(prevBssid))) {
+            report_wifi(currRssi, currBssid);
+        }
+
+        memcpy(prevBssid, currBssid, sizeof(prevBssid));
+        reconnectCount = 0;
+    }
+    else {
+        if (prevConnected) {
+            journal_write(JOURNAL_WIFI, 0, 0);  // dropped
+        }
+        uint32_t now = millis();
+        if (reconnectCount == 0 || now - reconnectPrev > reconnectInterval) {
+            WiFi.reconnect();
+            reconnectCount++;
+            if (reconnectCount > reconnectLimit) {
+                Serial.println("Failed to reconnect WLAN, about to reset");
+                for (int i = 0; i < 20; i++) {
+                    digitalWrite(HEALTH_LED_PIN, (i & 1) ? HEALTH_LED_ON : HEALTH_LED_OFF);
+                    delay(100);
+                }
+                ESP.restart();
+                while (true)
+                    ;
+            }
+            reconnectPrev = now;
+        }
+    }
+
+    prevRssi = currRssi;
+    prevConnected = currConnected;
+}
+
+
+// Record and replay: while recording, every struct read from charger and BMS is appended to a
+// compact binary log in RAM (download /record.bin). A replayed log feeds its records to the same
+// handlers instead of bus reads, faster than recorded, to profile change detection, serialization
+// and sinks with real data (see replay driver).
+// Log: 'L','I','R','1', STATE_ITEMS, struct size of each item, unix time of the start (uint32).
+// Then per read: item (| RECORD_UNCHANGED: same struct as before, no data), ms since the
+// previous read as varint (7 bit groups, low first), struct bytes.
+// A replay stops bus polls, rules and the extra devices, so only bench builds (REPLAY 1) accept one.
+#ifndef REPLAY
+    #define REPLAY 0
+#endif
+#define RECORD_SIZE 32768
+#define RECORD_STRUCT_MAX 128
+#define RECORD_UNCHANGED 0x80
+#define RECORD_HEADER (5 + STATE_ITEMS + 4)
+
+constexpr uint8_t record_sizes[STATE_ITEMS] = {
+    0,  // Load is not a struct
+    sizeof(ESmart3::Information_t), sizeof(ESmart3::ChgSts_t), sizeof(ESmart3::BatParam_t), sizeof(ESmart3::Log_t),
+    sizeof(ESmart3::Parameters_t), sizeof(ESmart3::LoadParam_t), sizeof(ESmart3::ProParam_t),
+    sizeof(JbdBms::Hardware_t), sizeof(JbdBms::Status_t), sizeof(JbdBms::Cells_t)
+};
+
+constexpr bool record_sizes_fit() {
+    for (auto size: record_sizes) {
+        if (size > RECORD_STRUCT_MAX) return false;
+    }
+    return true;
+}
+static_assert(record_sizes_fit(), "raise RECORD_STRUCT_MAX");
+
+uint8_t *record_log = 0;    // allocated on first use, holds the recorded or uploaded log
+size_t record_len = 0;
+bool record_on = false;
+uint32_t record_prev_ms;    // millis() of the previous read
+uint32_t record_known = 0;  // items with a struct in record_prev
+uint8_t record_prev[STATE_ITEMS][RECORD_STRUCT_MAX];
+
+uint8_t replay_slot[STATE_ITEMS][RECORD_STRUCT_MAX];
+
+// Append a read to the log, recording stops when the log is full
+void record_write( state_item_t item, const void *data ) {
+    if (!record_on) return;
+
+    uint8_t size = record_sizes[item];
+    bool same = (record_known & (1 << item)) && !memcmp(record_prev[item], data, size);
+    uint8_t entry[1 + 5 + RECORD_STRUCT_MAX];
+    size_t len = 0;
+    entry[len++] = item | (same ? RECORD_UNCHANGED : 0);
+    uint32_t now = millis();
+    uint32_t dt = now - record_prev_ms;
+    do {
+        entry[len++] = (dt & 0x7f) | (dt > 0x7f ? 0x80 : 0);
+        dt >>= 7;
+    } while (dt);
+    if (!same) {
+        memcpy(&entry[len], data, size);
+        len += size;
+    }
+    if (record_len + len > RECORD_SIZE) {
+        record_on = false;
+        slog("Record log full", LOG_NOTICE);
+        return;
+    }
+    if (!same) {
+        memcpy(record_prev[item], data, size);
+        record_known |= 1 << item;
+    }
+    memcpy(&record_log[record_len], entry, len);
+    record_len += len;
+    record_prev_ms = now;
+}
+
+// Read a struct from the device and record it, or take it from the replay while replaying
+template<typename D, typename T> bool device_read( state_item_t item, D &device, bool (D::*get)(T &), T &data ) {
+    if (replay_active) {
+        if (!(replay_ready & (1 << item))) {
+            return false;
+        }
+        memcpy(&data, replay_slot[item], sizeof(data));
+        replay_ready &= ~(1 << item);
+        return true;
+    }
+    if (!(device.*get)(data)) {
+        return false;
+    }
+    record_write(item, &data);
+    return true;
+}
+
+
+bool json_Information(char *json, size_t maxlen, ESmart3::Information_t data) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"Information\":{"
+        "\"Model\":\"%16.16s\","
+        "\"Date\":\"%8.8s\","
+        "\"FirmWare\":\"%4.4s\"}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, (char *)data.wSerial, 
+        (char *)data.wModel, (char *)data.wDate, (char *)data.wFirmWare);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_Information[] = { "Serial", "Model", "Date", "FirmWare" };
+
+bool cbor_Information(cbor_t &c, const ESmart3::Information_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_Information));
+    cbor_uint(c, k++); cbor_text(c, (char *)data.wSerial, 8);
+    cbor_uint(c, k++); cbor_text(c, (char *)data.wModel, 16);
+    cbor_uint(c, k++); cbor_text(c, (char *)data.wDate, 8);
+    cbor_uint(c, k++); cbor_text(c, (char *)data.wFirmWare, 4);
+    return c.len <= c.size;
+}
+
+
+ESmart3::Information_t es3Information = {0};
+
+// get device info once every minute
+void handle_es3Information() {
+    static const uint32_t interval = 60000;
+    static uint32_t prev = 0 - interval + 0;  // check at start first
+
+    uint32_t now = millis();
+    bool due = now - prev >= interval;
+    if (due) {
+        prev += interval;
+    }
+    if( (due && !replay_active) || poll_forced(STATE_INFORMATION) ) {
+        ESmart3::Information_t data = {0};
+        if (device_read(STATE_INFORMATION, esmart3, &ESmart3::getInformation, data)) {
+            state_touch(STATE_INFORMATION);
+            if (strncmp((const char *)data.wSerialID, (const char *)es3Information.wSerialID, sizeof(data.wSerialID))) {
+                // found a new/different eSmart3
+                static const char lineFmt[] =
+                    "Information,Serial=%8.8s,Version=" VERSION " "
+                    "Host=\"%s\","
+                    "Model=\"%16.16s\","
+                    "Date=\"%8.8s\","
+                    "FirmWare=\"%4.4s\"";
+
+                es3Information = data;
+                Lease msg(POOL_ES3);
+                if (msg.ok()) {
+                    json_Information(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                    publish(MQTT_TOPIC "/json/Information", msg);
+                    publish_cbor("Information", cbor_Information, data);
+
+                    snprintf(msg, msg.size(), lineFmt, (char *)data.wSerial,
+                        WiFi.getHostname(), (char *)data.wModel,
+                        (char *)data.wDate, (char *)data.wFirmWare);
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_INFORMATION].errors++;
+            slog("getInformation error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+// Fault bit descriptions of eSmart3 ChgSts.wFault and JbdBms Status.fault, index is the bit number
+// Web page, mqtt, json and influx all decode faults with these tables
+constexpr const char *es3_fault_texts[] = {
+    "Battery over voltage", "PV over voltage", "Charge over current", "Discharge over current", 
+    "Battery temperature alarm", "Internal temperature alarm", "PV low voltage", "Battery low voltage", 
+    "Trip zero protection trigger", "In the control of manual switchgear"
+};
+
+constexpr const char *jbd_fault_texts[] = {
+    "Cell block over voltage", "Cell block under voltage", "Battery over voltage", "Battery under voltage", 
+    "Charging over temperature", "Charging low temperature", "Discharging over temperature", 
+    "Discharging low temperature", "Charging over current", "Discharging over current", "Short circuit", 
+    "Frontend IC error", "MOS software lockout"
+};
+
+typedef struct fault_table {
+    const char *prefix;        // device for text outputs
+    const char *const *texts;  // description per bit
+    uint8_t count;             // number of defined bits
+} fault_table_t;
+
+constexpr fault_table_t es3_fault_table = { "CHG", es3_fault_texts, sizeof(es3_fault_texts)/sizeof(*es3_fault_texts) };
+constexpr fault_table_t jbd_fault_table = { "BMS", jbd_fault_texts, sizeof(jbd_fault_texts)/sizeof(*jbd_fault_texts) };
+
+static_assert(es3_fault_table.count == 10, "eSmart3 ChgSts has 10 fault bits");
+static_assert(jbd_fault_table.count == 13, "JbdBms Status has 13 fault bits");
+
+// Call fn(bit, text) for each set bit of faults that the table describes
+// No shared state, so it is safe to use from any task
+template<typename F> void each_fault( const fault_table_t &table, uint16_t faults, F fn ) {
+    faults &= (1u << table.count) - 1;
+    while (faults) {
+        uint8_t bit = __builtin_ctz(faults);
+        faults &= faults - 1;  // clear lowest set bit
+        fn(bit, table.texts[bit]);
+    }
+}
+
+// Fault bits as '0' and '1' characters, highest bit first
+typedef struct fault_str { char str[17]; } fault_str_t;
+
+fault_str_t fault_bits( const fault_table_t &table, uint16_t faults ) {
+    fault_str_t result;
+    for (uint8_t bit = 0; bit < table.count; bit++) {
+        result.str[table.count - 1 - bit] = (faults & (1u << bit)) ? '1' : '0';
+    }
+    result.str[table.count] = '\0';
+    return result;
+}
+
+// Json array of fault descriptions
+void write_faults_json( ChunkWriter &out, const fault_table_t &table, uint16_t faults ) {
+    bool first = true;
+    out.print("[");
+    each_fault(table, faults, [&](uint8_t bit, const char *text) {
+        out.printf(first ? "\"%s\"" : ",\"%s\"", text);
+        first = false;
+    });
+    out.print("]");
+}
+
+// One html line per fault description
+void write_faults_html( ChunkWriter &out, const fault_table_t &table, uint16_t faults ) {
+    each_fault(table, faults, [&](uint8_t bit, const char *text) {
+        out.printf("%s: %s<br/>\n", table.prefix, text);
+    });
+}
+
+// Comma separated fault descriptions for an influx string field
+void write_faults_line( ChunkWriter &out, const fault_table_t &table, uint16_t faults ) {
+    bool first = true;
+    each_fault(table, faults, [&](uint8_t bit, const char *text) {
+        out.printf(first ? "%s" : ",%s", text);
+        first = false;
+    });
+}
+
+
+bool json_ChgSts(char *json, size_t maxlen, ESmart3::ChgSts_t data, const uint16_t *serial) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"ChgSts\":{"
+        "\"ChgMode\":%u,"
+        "\"PvVolt\":%u,"
+        "\"BatVolt\":%u,"
+        "\"ChgCurr\":%u,"
+        "\"OutVolt\":%u,"
+        "\"LoadVolt\":%u,"
+        "\"LoadCurr\":%u,"
+        "\"ChgPower\":%u,"
+        "\"LoadPower\":%u,"
+        "\"BatTemp\":%d,"
+        "\"InnerTemp\":%d,"
+        "\"BatCap\":%u,"
+        "\"CO2\":%u,"
+        "\"Fault\":\"%s\","
+        "\"SystemReminder\":%u}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, (const char *)serial,
+        data.wChgMode, data.wPvVolt, data.wBatVolt, data.wChgCurr, data.wOutVolt,
+        data.wLoadVolt, data.wLoadCurr, data.wChgPower, data.wLoadPower, data.wBatTemp, 
+        data.wInnerTemp, data.wBatCap, data.dwCO2, fault_bits(es3_fault_table, data.wFault).str, data.wSystemReminder);
+
+    return len < maxlen;
+}
+
+bool json_ChgSts(char *json, size_t maxlen, ESmart3::ChgSts_t data) {
+    return json_ChgSts(json, maxlen, data, es3Information.wSerial);
+}
+
+
+// ChgSts as influx line
+bool line_ChgSts(char *line, size_t maxlen, const ESmart3::ChgSts_t &data, const uint16_t *serial = es3Information.wSerial) {
+    static const char lineFmt[] =
+        "ChgSts,Serial=%8.8s,Version=" VERSION " "
+        "Host=\"%s\","
+        "ChgMode=%u,"
+        "PvVolt=%u,"
+        "BatVolt=%u,"
+        "ChgCurr=%u,"
+        "OutVolt=%u,"
+        "LoadVolt=%u,"
+        "LoadCurr=%u,"
+        "ChgPower=%u,"
+        "LoadPower=%u,"
+        "BatTemp=%d,"
+        "InnerTemp=%d,"
+        "BatCap=%u,"
+        "CO2=%u,"
+        "Fault=\"%s\","
+        "SystemReminder=%u";
+
+    int len = snprintf(line, maxlen, lineFmt, (const char *)serial, WiFi.getHostname(), 
+        data.wChgMode, data.wPvVolt, data.wBatVolt, data.wChgCurr, data.wOutVolt,
+        data.wLoadVolt, data.wLoadCurr, data.wChgPower, data.wLoadPower, data.wBatTemp, 
+        data.wInnerTemp, data.wBatCap, data.dwCO2, fault_bits(es3_fault_table, data.wFault).str, data.wSystemReminder);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_ChgSts[] = { "Serial", "ChgMode", "PvVolt", "BatVolt", "ChgCurr", "OutVolt", 
+    "LoadVolt", "LoadCurr", "ChgPower", "LoadPower", "BatTemp", "InnerTemp", "BatCap", "CO2", "Fault", "SystemReminder" };
+
+bool cbor_ChgSts(cbor_t &c, const ESmart3::ChgSts_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_ChgSts));
+    cbor_uint(c, k++); cbor_text(c, (char *)es3Information.wSerial, 8);
+    cbor_uint(c, k++); cbor_uint(c, data.wChgMode);
+    cbor_uint(c, k++); cbor_uint(c, data.wPvVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wChgCurr);
+    cbor_uint(c, k++); cbor_uint(c, data.wOutVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadCurr);
+    cbor_uint(c, k++); cbor_uint(c, data.wChgPower);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadPower);
+    cbor_uint(c, k++); cbor_int(c, data.wBatTemp);
+    cbor_uint(c, k++); cbor_int(c, data.wInnerTemp);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatCap);
+    cbor_uint(c, k++); cbor_uint(c, data.dwCO2);
+    cbor_uint(c, k++); cbor_uint(c, data.wFault);  // bit mask instead of bit string
+    cbor_uint(c, k++); cbor_uint(c, data.wSystemReminder);
+    return c.len <= c.size;
+}
+
+
+// Publish changed ChgSts values to their field topics (all, if prev is 0)
+void fields_ChgSts( const ESmart3::ChgSts_t &data, const ESmart3::ChgSts_t *prev ) {
+    #define FIELD(name, member) if (!prev || prev->member != data.member) publish_field("ChgSts", name, (long)data.member)
+    FIELD("ChgMode", wChgMode);
+    FIELD("PvVolt", wPvVolt);
+    FIELD("BatVolt", wBatVolt);
+    FIELD("ChgCurr", wChgCurr);
+    FIELD("OutVolt", wOutVolt);
+    FIELD("LoadVolt", wLoadVolt);
+    FIELD("LoadCurr", wLoadCurr);
+    FIELD("ChgPower", wChgPower);
+    FIELD("LoadPower", wLoadPower);
+    FIELD("BatTemp", wBatTemp);
+    FIELD("InnerTemp", wInnerTemp);
+    FIELD("BatCap", wBatCap);
+    FIELD("CO2", dwCO2);
+    FIELD("SystemReminder", wSystemReminder);
+    #undef FIELD
+    if (!prev || prev->wFault != data.wFault) {
+        publish_field("ChgSts", "Fault", fault_bits(es3_fault_table, data.wFault).str);
+    }
+}
+
+
+ESmart3::ChgSts_t es3ChgSts = {0};
+
+// get device status, interval adapts to changes and operating state (see poll_state)
+void handle_es3ChgSts() {
+    static uint32_t prev = 0 - poll_state[STATE_CHGSTS].base_ms;  // check at start + delay
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_CHGSTS);  // fault path wants fresh values
+    if( poll_due(STATE_CHGSTS, prev, now) || forced ) {
+        ESmart3::ChgSts_t data = {0};
+        uint32_t start = micros();
+        if( device_read(STATE_CHGSTS, esmart3, &ESmart3::getChgSts, data) ) {
+            bool first = !device_state[STATE_CHGSTS].valid;  // publish all fields once, even the ones still 0
+            state_touch(STATE_CHGSTS);
+            poll_adapt(STATE_CHGSTS, start, poll_changed(data, es3ChgSts));
+            op_night = data.wPvVolt < data.wBatVolt;
+            op_charging = data.wChgCurr > 0;
+            if( first || memcmp(&data, &es3ChgSts, sizeof(data) ) ) {
+                // values have changed: publish
+                
+                
+                Lease msg(POOL_ES3);
+                if (msg.ok()) {
+                    json_ChgSts(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                    publish(MQTT_TOPIC "/json/ChgSts", msg);
+                }
+                publish_cbor("ChgSts", cbor_ChgSts, data);
+
+                if (mqtt_fields) {
+                    fields_ChgSts(data, first ? 0 : &es3ChgSts);
+                }
+
+                fault_str_t faults = fault_bits(es3_fault_table, data.wFault);
+                if (es3ChgSts.wFault != data.wFault) {
+                    publish(MQTT_TOPIC "/status/Charger", faults.str);        
+                    fault_detected(FAULT_CHARGER, es3ChgSts.wFault, data.wFault);
+                }
+
+                es3ChgSts = data;
+
+                if (msg.ok()) {
+                    line_ChgSts(msg, msg.size(), data);
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_CHGSTS].errors++;
+            slog("getChgSts error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+bool json_BatParam(char *json, size_t maxlen, ESmart3::BatParam_t data) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"BatParam\":{"
+        "\"BatType\":%u,"
+        "\"BatSysType\":%u,"
+        "\"BulkVolt\":%u,"
+        "\"FloatVolt\":%u,"
+        "\"MaxChgCurr\":%u,"
+        "\"MaxDisChgCurr\":%u,"
+        "\"EqualizeChgVolt\":%u,"
+        "\"EqualizeChgTime\":%u,"
+        "\"LoadUseSel\":%u}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
+        data.wBatType, data.wBatSysType, data.wBulkVolt, data.wFloatVolt, data.wMaxChgCurr,
+        data.wMaxDisChgCurr, data.wEqualizeChgVolt, data.wEqualizeChgTime, data.bLoadUseSel);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_BatParam[] = { "Serial", "BatType", "BatSysType", "BulkVolt", "FloatVolt", 
+    "MaxChgCurr", "MaxDisChgCurr", "EqualizeChgVolt", "EqualizeChgTime", "LoadUseSel" };
+
+bool cbor_BatParam(cbor_t &c, const ESmart3::BatParam_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_BatParam));
+    cbor_uint(c, k++); cbor_text(c, (char *)es3Information.wSerial, 8);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatType);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatSysType);
+    cbor_uint(c, k++); cbor_uint(c, data.wBulkVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wFloatVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wMaxChgCurr);
+    cbor_uint(c, k++); cbor_uint(c, data.wMaxDisChgCurr);
+    cbor_uint(c, k++); cbor_uint(c, data.wEqualizeChgVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wEqualizeChgTime);
+    cbor_uint(c, k++); cbor_uint(c, data.bLoadUseSel);
+    return c.len <= c.size;
+}
+
+
+ESmart3::BatParam_t es3BatParam = {0};
+
+// get battery parameters, interval adapts to changes (see poll_state)
+void handle_es3BatParam() {
+    static uint32_t prev = 0 - poll_state[STATE_BATPARAM].base_ms + 100;  // check at start + delay
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_BATPARAM);  // replay
+    if( poll_due(STATE_BATPARAM, prev, now) || forced ) {
+        ESmart3::BatParam_t data = {0};
+        uint32_t start = micros();
+        if( device_read(STATE_BATPARAM, esmart3, &ESmart3::getBatParam, data) ) {
+            state_touch(STATE_BATPARAM);
+            poll_adapt(STATE_BATPARAM, start, memcmp(&data, &es3BatParam, sizeof(data)));
+            if( memcmp(&data, &es3BatParam, sizeof(data) ) ) {
+                // values have changed: publish
+                static const char lineFmt[] =
+                    "BatParam,Serial=%8.8s,Version=" VERSION " "
+                    "Host=\"%s\","
+                    "BatType=%u,"
+                    "BatSysType=%u,"
+                    "BulkVolt=%u,"
+                    "FloatVolt=%u,"
+                    "MaxChgCurr=%u,"
+                    "MaxDisChgCurr=%u,"
+                    "EqualizeChgVolt=%u,"
+                    "EqualizeChgTime=%u,"
+                    "LoadUseSel=%u";
+                
+                es3BatParam = data;
+                Lease msg(POOL_ES3);
+                if (msg.ok()) {
+                    json_BatParam(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                    publish(MQTT_TOPIC "/json/BatParam", msg);
+                    publish_cbor("BatParam", cbor_BatParam, data);
+
+                    snprintf(msg, msg.size(), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
+                        data.wBatType, data.wBatSysType, data.wBulkVolt, data.wFloatVolt, data.wMaxChgCurr,
+                        data.wMaxDisChgCurr, data.wEqualizeChgVolt, data.wEqualizeChgTime, data.bLoadUseSel);
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_BATPARAM].errors++;
+            slog("getBatParam error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+bool json_Log(char *json, size_t maxlen, ESmart3::Log_t data) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"Log\":{"
+        "\"RunTime\":%u,"
+        "\"StartCnt\":%u,"
+        "\"LastFaultInfo\":%u,"
+        "\"FaultCnt\":%u,"
+        "\"TodayEng\":%u,"
+        "\"TodayEngDate\":\"%d:%d\","
+        "\"MonthEng\":%u,"
+        "\"MonthEngDate\":\"%d:%d\","
+        "\"TotalEng\":%u,"
+        "\"LoadTodayEng\":%u,"
+        "\"LoadMonthEng\":%u,"
+        "\"LoadTotalEng\":%u,"
+        "\"BacklightTime\":%u,"
+        "\"SwitchEnable\":%u}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
+        data.dwRunTime, data.wStartCnt, data.wLastFaultInfo, data.wFaultCnt, 
+        data.dwTodayEng, data.wTodayEngDate.month, data.wTodayEngDate.day, data.dwMonthEng, 
+        data.wMonthEngDate.month, data.wMonthEngDate.day, data.dwTotalEng, data.dwLoadTodayEng, 
+        data.dwLoadMonthEng, data.dwLoadTotalEng, data.wBacklightTime, data.bSwitchEnable);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_Log[] = { "Serial", "RunTime", "StartCnt", "LastFaultInfo", "FaultCnt", 
+    "TodayEng", "TodayEngDate", "MonthEng", "MonthEngDate", "TotalEng", "LoadTodayEng", "LoadMonthEng", 
+    "LoadTotalEng", "BacklightTime", "SwitchEnable" };
+
+bool cbor_Log(cbor_t &c, const ESmart3::Log_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_Log));
+    cbor_uint(c, k++); cbor_text(c, (char *)es3Information.wSerial, 8);
+    cbor_uint(c, k++); cbor_uint(c, data.dwRunTime);
+    cbor_uint(c, k++); cbor_uint(c, data.wStartCnt);
+    cbor_uint(c, k++); cbor_uint(c, data.wLastFaultInfo);
+    cbor_uint(c, k++); cbor_uint(c, data.wFaultCnt);
+    cbor_uint(c, k++); cbor_uint(c, data.dwTodayEng);
+    cbor_uint(c, k++); cbor_array(c, 2); cbor_uint(c, data.wTodayEngDate.month); cbor_uint(c, data.wTodayEngDate.day);
+    cbor_uint(c, k++); cbor_uint(c, data.dwMonthEng);
+    cbor_uint(c, k++); cbor_array(c, 2); cbor_uint(c, data.wMonthEngDate.month); cbor_uint(c, data.wMonthEngDate.day);
+    cbor_uint(c, k++); cbor_uint(c, data.dwTotalEng);
+    cbor_uint(c, k++); cbor_uint(c, data.dwLoadTodayEng);
+    cbor_uint(c, k++); cbor_uint(c, data.dwLoadMonthEng);
+    cbor_uint(c, k++); cbor_uint(c, data.dwLoadTotalEng);
+    cbor_uint(c, k++); cbor_uint(c, data.wBacklightTime);
+    cbor_uint(c, k++); cbor_uint(c, data.bSwitchEnable);
+    return c.len <= c.size;
+}
+
+
+ESmart3::Log_t es3Log = {0};
+
+// get status log, interval adapts to changes (see poll_state)
+void handle_es3Log() {
+    static uint32_t prev = 0 - poll_state[STATE_LOG].base_ms + 150;  // check at start + delay
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_LOG);  // replay
+    if( poll_due(STATE_LOG, prev, now) || forced ) {
+        ESmart3::Log_t data = {0};
+        uint32_t start = micros();
+        if( device_read(STATE_LOG, esmart3, &ESmart3::getLog, data) ) {
+            state_touch(STATE_LOG);
+            poll_adapt(STATE_LOG, start, memcmp(&data.wStartCnt, &es3Log.wStartCnt, sizeof(data) - offsetof(ESmart3::Log_t, wStartCnt)));
+            if( memcmp(&data.wStartCnt, &es3Log.wStartCnt, sizeof(data) - offsetof(ESmart3::Log_t, wStartCnt) ) ) {
+                // values have changed: publish
+                static const char lineFmt[] =
+                    "Log,Serial=%8.8s,Version=" VERSION " "
+                    "Host=\"%s\","
+                    "RunTime=%u,"
+                    "StartCnt=%u,"
+                    "LastFaultInfo=%u,"
+                    "FaultCnt=%u,"
+                    "TodayEng=%u,"
+                    "TodayEngDate=\"%d:%d\","
+                    "MonthEng=%u,"
+                    "MonthEngDate=\"%d:%d\","
+                    "TotalEng=%u,"
+                    "LoadTodayEng=%u,"
+                    "LoadMonthEng=%u,"
+                    "LoadTotalEng=%u,"
+                    "BacklightTime=%u,"
+                    "SwitchEnable=%u";
+                
+                es3Log = data;
+                Lease msg(POOL_ES3);
+                if (msg.ok()) {
+                    json_Log(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                    publish(MQTT_TOPIC "/json/Log", msg);
+                    publish_cbor("Log", cbor_Log, data);
+
+                    snprintf(msg, msg.size(), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
+                        data.dwRunTime, data.wStartCnt, data.wLastFaultInfo, data.wFaultCnt, 
+                        data.dwTodayEng, data.wTodayEngDate.month, data.wTodayEngDate.day, data.dwMonthEng, 
+                        data.wMonthEngDate.month, data.wMonthEngDate.day, data.dwTotalEng, data.dwLoadTodayEng, 
+                        data.dwLoadMonthEng, data.dwLoadTotalEng, data.wBacklightTime, data.bSwitchEnable);
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_LOG].errors++;
+            slog("getLog error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+bool json_Parameters(char *json, size_t maxlen, ESmart3::Parameters_t data) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"Parameters\":{"
+        "\"PvVoltRatio\":%u,"
+        "\"PvVoltOffset\":%u,"
+        "\"BatVoltRatio\":%u,"
+        "\"BatVoltOffset\":%u,"
+        "\"ChgCurrRatio\":%u,"
+        "\"ChgCurrOffset\":%u,"
+        "\"LoadCurrRatio\":%u,"
+        "\"LoadCurrOffset\":%u,"
+        "\"LoadVoltRatio\":%u,"
+        "\"LoadVoltOffset\":%u,"
+        "\"OutVoltRatio\":%u,"
+        "\"OutVoltOffset\":%u}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
+        data.wPvVoltRatio, data.wPvVoltOffset, data.wBatVoltRatio, data.wBatVoltOffset, 
+        data.wChgCurrRatio, data.wChgCurrOffset, data.wLoadCurrRatio, data.wLoadCurrOffset, 
+        data.wLoadVoltRatio, data.wLoadVoltOffset, data.wOutVoltRatio, data.wOutVoltOffset);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_Parameters[] = { "Serial", "PvVoltRatio", "PvVoltOffset", "BatVoltRatio", 
+    "BatVoltOffset", "ChgCurrRatio", "ChgCurrOffset", "LoadCurrRatio", "LoadCurrOffset", "LoadVoltRatio", 
+    "LoadVoltOffset", "OutVoltRatio", "OutVoltOffset" };
+
+bool cbor_Parameters(cbor_t &c, const ESmart3::Parameters_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_Parameters));
+    cbor_uint(c, k++); cbor_text(c, (char *)es3Information.wSerial, 8);
+    cbor_uint(c, k++); cbor_uint(c, data.wPvVoltRatio);
+    cbor_uint(c, k++); cbor_uint(c, data.wPvVoltOffset);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatVoltRatio);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatVoltOffset);
+    cbor_uint(c, k++); cbor_uint(c, data.wChgCurrRatio);
+    cbor_uint(c, k++); cbor_uint(c, data.wChgCurrOffset);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadCurrRatio);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadCurrOffset);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadVoltRatio);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadVoltOffset);
+    cbor_uint(c, k++); cbor_uint(c, data.wOutVoltRatio);
+    cbor_uint(c, k++); cbor_uint(c, data.wOutVoltOffset);
+    return c.len <= c.size;
+}
+
+
+ESmart3::Parameters_t es3Parameters = {0};
+
+// get calibration parameters, interval adapts to changes (see poll_state)
+void handle_es3Parameters() {
+    static uint32_t prev = 0 - poll_state[STATE_PARAMETERS].base_ms + 200;  // check at start + delay
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_PARAMETERS);  // replay
+    if( poll_due(STATE_PARAMETERS, prev, now) || forced ) {
+        ESmart3::Parameters_t data = {0};
+        uint32_t start = micros();
+        if( device_read(STATE_PARAMETERS, esmart3, &ESmart3::getParameters, data) ) {
+            state_touch(STATE_PARAMETERS);
+            poll_adapt(STATE_PARAMETERS, start, memcmp(&data, &es3Parameters, sizeof(data)));
+            if( memcmp(&data, &es3Parameters, sizeof(data)) ) {
+                // values have changed: publish
+                static const char lineFmt[] =
+                    "Parameters,Serial=%8.8s,Version=" VERSION " "
+                    "Host=\"%s\","
+                    "PvVoltRatio=%u,"
+                    "PvVoltOffset=%u,"
+                    "BatVoltRatio=%u,"
+                    "BatVoltOffset=%u,"
+                    "ChgCurrRatio=%u,"
+                    "ChgCurrOffset=%u,"
+                    "LoadCurrRatio=%u,"
+                    "LoadCurrOffset=%u,"
+                    "LoadVoltRatio=%u,"
+                    "LoadVoltOffset=%u,"
+                    "OutVoltRatio=%u,"
+                    "OutVoltOffset=%u";
+                
+                es3Parameters = data;
+                Lease msg(POOL_ES3);
+                if (msg.ok()) {
+                    json_Parameters(msg, msg.size(), data);
+                    // slog(msg);
+                    publish(MQTT_TOPIC "/json/Parameters", msg);
+                    publish_cbor("Parameters", cbor_Parameters, data);
+
+                    snprintf(msg, msg.size(), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
+                        data.wPvVoltRatio, data.wPvVoltOffset, data.wBatVoltRatio, data.wBatVoltOffset, 
+                        data.wChgCurrRatio, data.wChgCurrOffset, data.wLoadCurrRatio, data.wLoadCurrOffset, 
+                        data.wLoadVoltRatio, data.wLoadVoltOffset, data.wOutVoltRatio, data.wOutVoltOffset);
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_PARAMETERS].errors++;
+            slog("getParameters error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+bool json_LoadParam(char *json, size_t maxlen, ESmart3::LoadParam_t data) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"LoadParam\":{"
+        "\"LoadModuleSelect1\":%u,"
+        "\"LoadModuleSelect2\":%u,"
+        "\"LoadOnPvVolt\":%u,"
+        "\"LoadOffPvVolt\":%u,"
+        "\"PvContrlTurnOnDelay\":%u,"
+        "\"PvContrlTurnOffDelay\":%u,"
+        "\"AftLoadOnTime\":\"%d:%d\","
+        "\"AftLoadOffTime\":\"%d:%d\","
+        "\"MonLoadOnTime\":\"%d:%d\","
+        "\"MonLoadOffTime\":\"%d:%d\","
+        "\"LoadSts\":%u,"
+        "\"Time2Enable\":%u}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
+        data.wLoadModuleSelect1, data.wLoadModuleSelect2, data.wLoadOnPvVolt, data.wLoadOffPvVolt, 
+        data.wPvContrlTurnOnDelay, data.wPvContrlTurnOffDelay, data.AftLoadOnTime.hour, data.AftLoadOnTime.minute, 
+        data.AftLoadOffTime.hour, data.AftLoadOffTime.minute, data.MonLoadOnTime.hour, data.MonLoadOnTime.minute, 
+        data.MonLoadOffTime.hour, data.MonLoadOffTime.minute, data.wLoadSts, data.wTime2Enable);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_LoadParam[] = { "Serial", "LoadModuleSelect1", "LoadModuleSelect2", "LoadOnPvVolt", 
+    "LoadOffPvVolt", "PvContrlTurnOnDelay", "PvContrlTurnOffDelay", "AftLoadOnTime", "AftLoadOffTime", 
+    "MonLoadOnTime", "MonLoadOffTime", "LoadSts", "Time2Enable" };
+
+bool cbor_LoadParam(cbor_t &c, const ESmart3::LoadParam_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_LoadParam));
+    cbor_uint(c, k++); cbor_text(c, (char *)es3Information.wSerial, 8);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadModuleSelect1);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadModuleSelect2);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadOnPvVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadOffPvVolt);
+    cbor_uint(c, k++); cbor_uint(c, data.wPvContrlTurnOnDelay);
+    cbor_uint(c, k++); cbor_uint(c, data.wPvContrlTurnOffDelay);
+    cbor_uint(c, k++); cbor_array(c, 2); cbor_uint(c, data.AftLoadOnTime.hour); cbor_uint(c, data.AftLoadOnTime.minute);
+    cbor_uint(c, k++); cbor_array(c, 2); cbor_uint(c, data.AftLoadOffTime.hour); cbor_uint(c, data.AftLoadOffTime.minute);
+    cbor_uint(c, k++); cbor_array(c, 2); cbor_uint(c, data.MonLoadOnTime.hour); cbor_uint(c, data.MonLoadOnTime.minute);
+    cbor_uint(c, k++); cbor_array(c, 2); cbor_uint(c, data.MonLoadOffTime.hour); cbor_uint(c, data.MonLoadOffTime.minute);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadSts);
+    cbor_uint(c, k++); cbor_uint(c, data.wTime2Enable);
+    return c.len <= c.size;
+}
+
+
+ESmart3::LoadParam_t es3LoadParam = {0};
+
+// get load parameters, interval adapts to changes (see poll_state)
+void handle_es3LoadParam() {
+    static uint32_t prev = 0 - poll_state[STATE_LOADPARAM].base_ms + 250;  // check at start + delay
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_LOADPARAM);  // replay
+    if( poll_due(STATE_LOADPARAM, prev, now) || forced ) {
+        ESmart3::LoadParam_t data = {0};
+        uint32_t start = micros();
+        if( device_read(STATE_LOADPARAM, esmart3, &ESmart3::getLoadParam, data) ) {
+            state_touch(STATE_LOADPARAM);
+            poll_adapt(STATE_LOADPARAM, start, memcmp(&data, &es3LoadParam, sizeof(data)));
+            if( memcmp(&data, &es3LoadParam, sizeof(data) ) ) {
+                // values have changed: publish
+                static const char lineFmt[] =
+                    "LoadParam,Serial=%8.8s,Version=" VERSION " "
+                    "Host=\"%s\","
+                    "LoadModuleSelect1=%u,"
+                    "LoadModuleSelect2=%u,"
+                    "LoadOnPvVolt=%u,"
+                    "LoadOffPvVolt=%u,"
+                    "PvContrlTurnOnDelay=%u,"
+                    "PvContrlTurnOffDelay=%u,"
+                    "AftLoadOnTime=\"%d:%d\","
+                    "AftLoadOffTime=\"%d:%d\","
+                    "MonLoadOnTime=\"%d:%d\","
+                    "MonLoadOffTime=\"%d:%d\","
+                    "LoadSts=%u,"
+                    "Time2Enable=%u";
+                
+                es3LoadParam = data;
+                Lease msg(POOL_ES3);
+                if (msg.ok()) {
+                    json_LoadParam(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                    publish(MQTT_TOPIC "/json/LoadParam", msg);
+                    publish_cbor("LoadParam", cbor_LoadParam, data);
+
+                    snprintf(msg, msg.size(), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
+                        data.wLoadModuleSelect1, data.wLoadModuleSelect2, data.wLoadOnPvVolt, data.wLoadOffPvVolt, 
+                        data.wPvContrlTurnOnDelay, data.wPvContrlTurnOffDelay, data.AftLoadOnTime.hour, data.AftLoadOnTime.minute, 
+                        data.AftLoadOffTime.hour, data.AftLoadOffTime.minute, data.MonLoadOnTime.hour, data.MonLoadOnTime.minute, 
+                        data.MonLoadOffTime.hour, data.MonLoadOffTime.minute, data.wLoadSts, data.wTime2Enable);
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_LOADPARAM].errors++;
+            slog("getLoadParam error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+bool json_ProParam(char *json, size_t maxlen, ESmart3::ProParam_t data) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"ProParam\":{"
+        "\"LoadOvp\":%u,"
+        "\"LoadUvp\":%u,"
+        "\"BatOvp\":%u,"
+        "\"BatOvB\":%u,"
+        "\"BatUvp\":%u,"
+        "\"BatUvB\":%u}}";
+
+    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
+        data.wLoadOvp, data.wLoadUvp, data.wBatOvp, data.wBatOvB, data.wBatUvp, data.wBatUvB);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_ProParam[] = { "Serial", "LoadOvp", "LoadUvp", "BatOvp", "BatOvB", "BatUvp", "BatUvB" };
+
+bool cbor_ProParam(cbor_t &c, const ESmart3::ProParam_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_ProParam));
+    cbor_uint(c, k++); cbor_text(c, (char *)es3Information.wSerial, 8);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadOvp);
+    cbor_uint(c, k++); cbor_uint(c, data.wLoadUvp);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatOvp);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatOvB);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatUvp);
+    cbor_uint(c, k++); cbor_uint(c, data.wBatUvB);
+    return c.len <= c.size;
+}
+
+
+ESmart3::ProParam_t es3ProParam = {0};
+
+// get protection parameters, interval adapts to changes (see poll_state)
+void handle_es3ProParam() {
+    static uint32_t prev = 0 - poll_state[STATE_PROPARAM].base_ms + 300;  // check at start + delay
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_PROPARAM);  // replay
+    if( poll_due(STATE_PROPARAM, prev, now) || forced ) {
+        ESmart3::ProParam_t data = {0};
+        uint32_t start = micros();
+        if( device_read(STATE_PROPARAM, esmart3, &ESmart3::getProParam, data) ) {
+            state_touch(STATE_PROPARAM);
+            poll_adapt(STATE_PROPARAM, start, memcmp(&data, &es3ProParam, sizeof(data)));
+            if( memcmp(&data, &es3ProParam, sizeof(data) ) ) {
+                // values have changed: publish
+                static const char lineFmt[] =
+                    "ProParam,Serial=%8.8s,Version=" VERSION " "
+                    "Host=\"%s\","
+                    "LoadOvp=%u,"
+                    "LoadUvp=%u,"
+                    "BatOvp=%u,"
+                    "BatOvB=%u,"
+                    "BatUvp=%u,"
+                    "BatUvB=%u";
+                
+                es3ProParam = data;
+                Lease msg(POOL_ES3);
+                if (msg.ok()) {
+                    json_ProParam(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                    publish(MQTT_TOPIC "/json/ProParam", msg);
+                    publish_cbor("ProParam", cbor_ProParam, data);
+
+                    snprintf(msg, msg.size(), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
+                        data.wLoadOvp, data.wLoadUvp, data.wBatOvp, data.wBatOvB, data.wBatUvp, data.wBatUvB);
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_PROPARAM].errors++;
+            slog("getProParam error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+JbdBms::Hardware_t jbdHardware = {0};
+
+bool json_Hardware(char *json, size_t maxlen, JbdBms::Hardware_t data) {
+    static const char jsonFmt[] = "{\"Version\":" VERSION ",\"Id\":\"%.32s\"}";
+    int len = snprintf(json, maxlen, jsonFmt, data.id);
+
+    return len < maxlen;
+}
+
+
+const char *const cborKeys_Hardware[] = { "Id" };
+
+bool cbor_Hardware(cbor_t &c, const JbdBms::Hardware_t &data) {
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_Hardware));
+    cbor_uint(c, k++); cbor_text(c, (char *)data.id, sizeof(data.id));
+    return c.len <= c.size;
+}
+
+
+void handle_jbdHardware() {
+    static const uint32_t interval = 60000;
+    static uint32_t prev = 0 - interval + 0;  // check at start first
+
+    uint32_t now = millis();
+    bool due = now - prev >= interval;
+    if (due) {
+        prev += interval;
+    }
+    if( (due && !replay_active) || poll_forced(STATE_HARDWARE) ) {
+        JbdBms::Hardware_t data = {0};
+        if (device_read(STATE_HARDWARE, jbdbms, &JbdBms::getHardware, data)) {
+            state_touch(STATE_HARDWARE);
+            if (strncmp((const char *)data.id, (const char *)jbdHardware.id, sizeof(data.id))) {
+                // found a new/different JBD BMS
+                static const char lineFmt[] =
+                    "Hardware,Id=%.32s,Version=" VERSION " "
+                    "Host=\"%s\"";
+
+                jbdHardware = data;
+                Lease msg(POOL_JBD);
+                if (msg.ok()) {
+                    json_Hardware(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                    publish(MQTT_TOPIC "/json/Hardware", msg);
+                    publish_cbor("Hardware", cbor_Hardware, data);
+
+                    snprintf(msg, msg.size(), lineFmt, (char *)data.id, WiFi.getHostname());
+                    postInflux(msg);
+                }
+            }
+        }
+        else {
+            poll_state[STATE_HARDWARE].errors++;
+            slog("getHardware error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+JbdBms::Status_t jbdStatus = {0};
+
+// Status as JSON, streamed so all temperatures fit
+void write_Status(ChunkWriter &out, const JbdBms::Status_t &data, const uint8_t *id = jbdHardware.id) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"Status\":{"
+        "\"voltage\":%u,"
+        "\"current\":%d,"
+        "\"remainingCapacity\":%u,"
+        "\"nominalCapacity\":%u,"
+        "\"cycles\":%u,"
+        "\"productionDate\":\"%04u-%02u-%02u\","
+        "\"balance\":\"%s\","
+        "\"fault\":%u,"
+        "\"version\":%u,"
+        "\"currentCapacity\":%u,"
+        "\"mosfetStatus\":%u,"
+        "\"cells\":%u,"
+        "\"ntcs\":%u,"
+        "\"temperatures\":[";
+
+    out.printf(jsonFmt, id,
+        data.voltage, data.current, data.remainingCapacity, data.nominalCapacity, data.cycles, 
+        JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate), 
+        JbdBms::balance(data), data.fault, data.version, 
+        data.currentCapacity, data.mosfetStatus, data.cells, data.ntcs);
+    for (size_t i = 0; i < data.ntcs && i < sizeof(data.temperatures)/sizeof(*data.temperatures); i++) {
+        out.printf(i ? ",%d" : "%d", JbdBms::deciCelsius(data.temperatures[i]));
+    }
+    out.print("]}}");
+}
+
+
+bool json_Status(char *json, size_t maxlen, JbdBms::Status_t data) {
+    BufferWriter out(json, maxlen);
+    write_Status(out, data);
+    return out.finish();
+}
+
+
+// Status as influx line
+void line_Status(ChunkWriter &out, const JbdBms::Status_t &data, const uint8_t *id = jbdHardware.id) {
+    static const char lineFmt[] =
+        "Status,Id=%.32s,Version=" VERSION " "
+        "Host=\"%s\","
+        "voltage=%u,"
+        "current=%d,"
+        "remainingCapacity=%u,"
+        "nominalCapacity=%u,"
+        "cycles=%u,"
+        "productionDate=\"%04u-%02u-%02u\","
+        "balance=\"%s\","
+        "fault=%u,"
+        "version=%u,"
+        "currentCapacity=%u,"
+        "mosfetStatus=%u,"
+        "cells=%u,"
+        "ntcs=%u";
+
+    out.printf(lineFmt, id, WiFi.getHostname(), 
+        data.voltage, data.current, data.remainingCapacity, data.nominalCapacity, data.cycles,
+        JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate), 
+        JbdBms::balance(data), data.fault, data.version,
+        data.currentCapacity, data.mosfetStatus, data.cells, data.ntcs);
+    for (size_t i = 0; i < sizeof(data.temperatures)/sizeof(*data.temperatures) && i < data.ntcs; i++) {
+        out.printf(",temperature%u=%d", (unsigned)(i+1), JbdBms::deciCelsius(data.temperatures[i]));
+    }
+}
+
+
+// Streams the current status, e.g. from the outbox
+void stream_Status(ChunkWriter &out) {
+    write_Status(out, jbdStatus);
+}
+
+
+const char *const cborKeys_Status[] = { "Id", "voltage", "current", "remainingCapacity", "nominalCapacity", 
+    "cycles", "productionDate", "balance", "fault", "version", "currentCapacity", "mosfetStatus", "cells", "ntcs", 
+    "temperatures" };
+
+bool cbor_Status(cbor_t &c, const JbdBms::Status_t &data) {
+    size_t ntcs = min((size_t)data.ntcs, sizeof(data.temperatures)/sizeof(*data.temperatures));
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_Status));
+    cbor_uint(c, k++); cbor_text(c, (char *)jbdHardware.id, sizeof(jbdHardware.id));
+    cbor_uint(c, k++); cbor_uint(c, data.voltage);
+    cbor_uint(c, k++); cbor_int(c, data.current);
+    cbor_uint(c, k++); cbor_uint(c, data.remainingCapacity);
+    cbor_uint(c, k++); cbor_uint(c, data.nominalCapacity);
+    cbor_uint(c, k++); cbor_uint(c, data.cycles);
+    cbor_uint(c, k++); cbor_array(c, 3); cbor_uint(c, JbdBms::year(data.productionDate)); 
+        cbor_uint(c, JbdBms::month(data.productionDate)); cbor_uint(c, JbdBms::day(data.productionDate));
+    cbor_uint(c, k++); cbor_text(c, JbdBms::balance(data), 64);
+    cbor_uint(c, k++); cbor_uint(c, data.fault);
+    cbor_uint(c, k++); cbor_uint(c, data.version);
+    cbor_uint(c, k++); cbor_uint(c, data.currentCapacity);
+    cbor_uint(c, k++); cbor_uint(c, data.mosfetStatus);
+    cbor_uint(c, k++); cbor_uint(c, data.cells);
+    cbor_uint(c, k++); cbor_uint(c, data.ntcs);
+    cbor_uint(c, k++); cbor_array(c, ntcs);
+    for (size_t i = 0; i < ntcs; i++) {
+        cbor_int(c, JbdBms::deciCelsius(data.temperatures[i]));
+    }
+    return c.len <= c.size;
+}
+
+
+// Publish changed Status values to their field topics (all, if prev is 0)
+void fields_Status( const JbdBms::Status_t &data, const JbdBms::Status_t *prev ) {
+    #define FIELD(name, member) if (!prev || prev->member != data.member) publish_field("Status", name, (long)data.member)
+    FIELD("voltage", voltage);
+    FIELD("current", current);
+    FIELD("remainingCapacity", remainingCapacity);
+    FIELD("nominalCapacity", nominalCapacity);
+    FIELD("cycles", cycles);
+    FIELD("fault", fault);
+    FIELD("version", version);
+    FIELD("currentCapacity", currentCapacity);
+    FIELD("mosfetStatus", mosfetStatus);
+    FIELD("cells", cells);
+    FIELD("ntcs", ntcs);
+    #undef FIELD
+    if (!prev || prev->productionDate != data.productionDate) {
+        char date[11];
+        snprintf(date, sizeof(date), "%04u-%02u-%02u", JbdBms::year(data.productionDate), 
+            JbdBms::month(data.productionDate), JbdBms::day(data.productionDate));
+        publish_field("Status", "productionDate", date);
+    }
+    static char balance[40] = "";  // JbdBms::balance() might reuse its buffer
+    const char *curr = JbdBms::balance(data);
+    if (!prev || strcmp(balance, curr)) {
+        snprintf(balance, sizeof(balance), "%s", curr);
+        publish_field("Status", "balance", balance);
+    }
+    for (size_t i = 0; i < data.ntcs && i < sizeof(data.temperatures)/sizeof(*data.temperatures); i++) {
+        if (!prev || prev->temperatures[i] != data.temperatures[i]) {
+            char field[16];
+            snprintf(field, sizeof(field), "temperature%u", (unsigned)(i+1));
+            publish_field("Status", field, (long)JbdBms::deciCelsius(data.temperatures[i]));
+        }
+    }
+}
+
+
+void handle_jbdStatus() {
+    static uint32_t prev = 0 - poll_state[STATE_STATUS].base_ms + 600;
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_STATUS);  // fault path wants fresh values
+    if( poll_due(STATE_STATUS, prev, now) || forced ) {
+        JbdBms::Status_t data = {0};
+        uint32_t start = micros();
+        if (device_read(STATE_STATUS, jbdbms, &JbdBms::getStatus, data)) {
+            bool first = !device_state[STATE_STATUS].valid;  // publish all fields once, even the ones still 0
+            state_touch(STATE_STATUS);
+            poll_adapt(STATE_STATUS, start, poll_changed(data, jbdStatus));
+            op_battery_idle = abs(data.current) < 50;
+            if (first || memcmp(&data, &jbdStatus, sizeof(data))) {
+                // some voltage has changed
+                Lease msg(POOL_JBD);
+                if (msg.ok()) {
+                    json_Status(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                }
+                publish(MQTT_TOPIC "/json/Status", stream_Status);  // streamed from jbdStatus when sent
+                publish_cbor("Status", cbor_Status, data);
+                
+                if (mqtt_fields) {
+                    fields_Status(data, first ? 0 : &jbdStatus);
+                }
+
+                if (jbdStatus.fault != data.fault) {
+                    publish(MQTT_TOPIC "/status/BMS", fault_bits(jbd_fault_table, data.fault).str);        
+                    fault_detected(FAULT_BMS, jbdStatus.fault, data.fault);
+                }
+
+                if (jbdStatus.mosfetStatus != data.mosfetStatus) {
+                    journal_write(JOURNAL_MOSFETS, 0, data.mosfetStatus | jbdStatus.mosfetStatus << 8);  // arg 0: seen by poll
+                }
+
+                jbdStatus = data;
+
+                postInfluxStreamed([&data](ChunkWriter &out) { line_Status(out, data); });
+            }
+        }
         else {
-            slog("getChgSts error", LOG_ERR);
+            poll_state[STATE_STATUS].errors++;
+            slog("getStatus error", LOG_ERR, LOG_CLASS_BUS);
         }
     }
 }
 
 
-bool json_BatParam(char *json, size_t maxlen, ESmart3::BatParam_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"BatParam\":{"
-        "\"BatType\":%u,"
-        "\"BatSysType\":%u,"
-        "\"BulkVolt\":%u,"
-        "\"FloatVolt\":%u,"
-        "\"MaxChgCurr\":%u,"
-        "\"MaxDisChgCurr\":%u,"
-        "\"EqualizeChgVolt\":%u,"
-        "\"EqualizeChgTime\":%u,"
-        "\"LoadUseSel\":%u}}";
+JbdBms::Cells_t jbdCells = {0};
 
-    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
-        data.wBatType, data.wBatSysType, data.wBulkVolt, data.wFloatVolt, data.wMaxChgCurr,
-        data.wMaxDisChgCurr, data.wEqualizeChgVolt, data.wEqualizeChgTime, data.bLoadUseSel);
+// Cells as JSON, streamed so all cells fit
+void write_Cells(ChunkWriter &out, const JbdBms::Cells_t &data, const uint8_t *id = jbdHardware.id, uint8_t cells = jbdStatus.cells) {
+    out.printf("{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"Cells\":[", id);
+    for (size_t i = 0; i < cells && i < sizeof(data.voltages)/sizeof(*data.voltages); i++) {
+        out.printf(i ? ",%u" : "%u", data.voltages[i]);
+    }
+    out.print("]}");
+}
 
-    return len < maxlen;
+
+bool json_Cells(char *json, size_t maxlen, JbdBms::Cells_t data) {
+    BufferWriter out(json, maxlen);
+    write_Cells(out, data);
+    return out.finish();
 }
 
 
-ESmart3::BatParam_t es3BatParam = {0};
+// Cells as influx line
+void line_Cells(ChunkWriter &out, const JbdBms::Cells_t &data, const uint8_t *id = jbdHardware.id, uint8_t cells = jbdStatus.cells) {
+    static const char lineFmt[] =
+        "Cells,Id=%.32s,Version=" VERSION " "
+        "Host=\"%s\"";
 
-// get battery parameters once every 10s
-void handle_es3BatParam() {
+    out.printf(lineFmt, id, WiFi.getHostname());
+    for (size_t i=0; i < sizeof(data.voltages)/sizeof(*data.voltages) && i < cells; i++) {
+        out.printf(",voltage%u=%u", (unsigned)(i+1), data.voltages[i]);
+    }
+}
+
+
+// Streams the current cells, e.g. from the outbox
+void stream_Cells(ChunkWriter &out) {
+    write_Cells(out, jbdCells);
+}
+
+
+const char *const cborKeys_Cells[] = { "Id", "Cells" };
+
+bool cbor_Cells(cbor_t &c, const JbdBms::Cells_t &data) {
+    size_t cells = min((size_t)jbdStatus.cells, sizeof(data.voltages)/sizeof(*data.voltages));
+    uint8_t k = 0;
+    cbor_map(c, CBOR_COUNT(cborKeys_Cells));
+    cbor_uint(c, k++); cbor_text(c, (char *)jbdHardware.id, sizeof(jbdHardware.id));
+    cbor_uint(c, k++); cbor_array(c, cells);
+    for (size_t i = 0; i < cells; i++) {
+        cbor_uint(c, data.voltages[i]);
+    }
+    return c.len <= c.size;
+}
+
+
+// Publish changed cell voltages to their field topics (all, if prev is 0)
+void fields_Cells( const JbdBms::Cells_t &data, const JbdBms::Cells_t *prev ) {
+    for (size_t i = 0; i < jbdStatus.cells && i < sizeof(data.voltages)/sizeof(*data.voltages); i++) {
+        if (!prev || prev->voltages[i] != data.voltages[i]) {
+            char field[16];
+            snprintf(field, sizeof(field), "voltage%u", (unsigned)(i+1));
+            publish_field("Cells", field, (long)data.voltages[i]);
+        }
+    }
+}
+
+
+// Cell analytics, updated on every Cells sample with the latest Status in O(cells) integer math
+// - min, max, delta and mean cell voltage in mV
+// - per cell deviation from the mean, EWMA smoothed (alpha 1/16) in 1/256 mV
+// - outliers: cells whose smoothed deviation is above 5mV and twice the mean absolute deviation
+// - per cell internal resistance from dV/dI between two samples with a current step of at least 2A,
+//   EWMA smoothed (alpha 1/4) in 1/256 of 0.1 mOhm
+#define CELLS_MAX (sizeof(JbdBms::Cells_t::voltages)/sizeof(*JbdBms::Cells_t::voltages))
+
+typedef struct cell_stats {
+    uint8_t cells;              // number of cells in the statistics
+    uint16_t min, max, mean;    // mV
+    uint8_t min_cell, max_cell; // 1-based cell numbers
+    int32_t dev[CELLS_MAX];     // smoothed deviation from mean, mV << 8
+    int32_t ir[CELLS_MAX];      // smoothed internal resistance, 0.1 mOhm << 8, 0: not yet known
+    uint32_t outliers;          // bit n: cell n+1 is an outlier
+    uint32_t samples;           // number of samples in the statistics
+    uint32_t ir_steps;          // number of current steps used for ir
+    uint16_t prev_voltages[CELLS_MAX];
+    int16_t prev_current;       // 10mA
+    bool prev_valid;            // previous sample can be used for a current step
+} cell_stats_t;
+
+cell_stats_t cell_stats = {0};
+
+void update_cell_stats( const JbdBms::Cells_t &data ) {
+    static const int16_t min_step = 200;  // 10mA: current step for ir estimation
+    static const uint32_t max_status_age = 2000;
+
+    uint8_t cells = min((size_t)jbdStatus.cells, CELLS_MAX);
+    if (!cells) {
+        return;
+    }
+    cell_stats_t &s = cell_stats;
+    if (cells != s.cells) {
+        s = {};  // new pack layout: start over
+        s.cells = cells;
+    }
+
+    uint32_t sum = 0;
+    s.min = s.max = data.voltages[0];
+    s.min_cell = s.max_cell = 1;
+    for (uint8_t i = 0; i < cells; i++) {
+        uint16_t v = data.voltages[i];
+        sum += v;
+        if (v < s.min) {
+            s.min = v;
+            s.min_cell = i + 1;
+        }
+        if (v > s.max) {
+            s.max = v;
+            s.max_cell = i + 1;
+        }
+    }
+    s.mean = sum / cells;
+
+    bool current_valid = state_fresh(STATE_STATUS, max_status_age);
+    int16_t current = jbdStatus.current;
+    int32_t di = current - s.prev_current;
+    bool step = current_valid && s.prev_valid && (di >= min_step || di <= -min_step);
+
+    uint32_t abs_sum = 0;
+    for (uint8_t i = 0; i < cells; i++) {
+        int32_t dev = ((int32_t)data.voltages[i] - s.mean) << 8;
+        s.dev[i] = s.samples ? s.dev[i] + ((dev - s.dev[i]) >> 4) : dev;
+        abs_sum += abs(s.dev[i]);
+
+        if (step) {
+            // mV / 10mA = 100 mOhm = 1000 * 0.1 mOhm
+            int32_t ir = ((int32_t)data.voltages[i] - s.prev_voltages[i]) * 1000 * 256 / di;
+            if (ir > 0) {  // voltage follows current, else noise or a concurrent charge change
+                s.ir[i] = s.ir[i] ? s.ir[i] + ((ir - s.ir[i]) >> 2) : ir;
+            }
+        }
+        s.prev_voltages[i] = data.voltages[i];
+    }
+    if (step) {
+        s.ir_steps++;
+    }
+
+    int32_t threshold = max((int32_t)(2 * abs_sum / cells), (int32_t)(5 << 8));
+    s.outliers = 0;
+    for (uint8_t i = 0; i < cells; i++) {
+        if (abs(s.dev[i]) > threshold) {
+            s.outliers |= 1u << i;
+        }
+    }
+
+    s.prev_current = current;
+    s.prev_valid = current_valid;
+    s.samples++;
+}
+
+void write_CellStats( ChunkWriter &out ) {
+    const cell_stats_t &s = cell_stats;
+    out.printf("{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"CellStats\":{"
+        "\"Min\":%u,\"MinCell\":%u,\"Max\":%u,\"MaxCell\":%u,\"Delta\":%u,\"Mean\":%u,\"Outliers\":%u,"
+        "\"Samples\":%u,\"IrSteps\":%u,\"Deviation\":[",
+        jbdHardware.id, s.min, s.min_cell, s.max, s.max_cell, s.max - s.min, s.mean, (unsigned)s.outliers,
+        (unsigned)s.samples, (unsigned)s.ir_steps);
+    for (uint8_t i = 0; i < s.cells; i++) {
+        out.printf(i ? ",%.1f" : "%.1f", s.dev[i] / 256.0);  // mV
+    }
+    out.print("],\"Resistance\":[");
+    for (uint8_t i = 0; i < s.cells; i++) {
+        out.printf(i ? ",%.1f" : "%.1f", s.ir[i] / 2560.0);  // mOhm
+    }
+    out.print("]}}");
+}
+
+// Publish cell analytics at most once a minute
+void publish_cell_stats() {
+    static const char lineFmt[] =
+        "CellStats,Id=%.32s,Version=" VERSION " "
+        "Host=\"%s\","
+        "Min=%u,"
+        "Max=%u,"
+        "Delta=%u,"
+        "Mean=%u,"
+        "Outliers=%u";
+    static const uint32_t interval = 60000;
+    static uint32_t prev = 0 - interval;
+
+    uint32_t now = millis();
+    if (!cell_stats.samples || now - prev < interval) {
+        return;
+    }
+    prev = now;
+
+    publish(MQTT_TOPIC "/json/CellStats", write_CellStats);  // streamed when sent
+    if (mqtt_fields) {
+        publish_field("CellStats", "Delta", (long)(cell_stats.max - cell_stats.min));
+        publish_field("CellStats", "Outliers", (long)cell_stats.outliers);
+    }
+
+    const cell_stats_t &s = cell_stats;
+    postInfluxStreamed([&s](ChunkWriter &out) {
+        out.printf(lineFmt, jbdHardware.id, WiFi.getHostname(), s.min, s.max, s.max - s.min, s.mean, (unsigned)s.outliers);
+        for (uint8_t i = 0; i < s.cells; i++) {
+            out.printf(",dev%u=%.1f", (unsigned)(i + 1), s.dev[i] / 256.0);
+            if (s.ir[i]) {
+                out.printf(",ir%u=%.1f", (unsigned)(i + 1), s.ir[i] / 2560.0);
+            }
+        }
+    });
+}
+
+
+void handle_jbdCells() {
+    static uint32_t prev = 0 - poll_state[STATE_CELLS].base_ms + 700;  // after handle_jbdStatus() so we have valid jbdStatus.cells
+    static uint32_t status_ms = 0;  // Status read the last Cells poll followed
+
+    uint32_t now = millis();
+    bool forced = poll_forced(STATE_CELLS);  // fault path wants fresh values
+    bool paired = device_state[STATE_STATUS].read_ms != status_ms;  // right after a Status read for the cell statistics
+    if( (paired && poll_due(STATE_CELLS, prev, now)) || forced ) {
+        status_ms = device_state[STATE_STATUS].read_ms;
+        JbdBms::Cells_t data = {0};
+        uint32_t start = micros();
+        if (device_read(STATE_CELLS, jbdbms, &JbdBms::getCells, data)) {
+            bool first = !device_state[STATE_CELLS].valid;  // publish all fields once, even the ones still 0
+            state_touch(STATE_CELLS);
+            poll_adapt(STATE_CELLS, start, poll_changed(data, jbdCells));
+            update_cell_stats(data);
+            publish_cell_stats();
+            if (first || memcmp(&data, &jbdCells, sizeof(data))) {
+                // some voltage has changed
+                if (mqtt_fields) {
+                    fields_Cells(data, first ? 0 : &jbdCells);
+                }
+
+                jbdCells = data;
+                Lease msg(POOL_JBD);
+                if (msg.ok()) {
+                    json_Cells(msg, msg.size(), data);
+                    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+                }
+                publish(MQTT_TOPIC "/json/Cells", stream_Cells);  // streamed from jbdCells when sent
+                publish_cbor("Cells", cbor_Cells, data);
+
+                postInfluxStreamed([&data](ChunkWriter &out) { line_Cells(out, data); });
+            }
+        }
+        else {
+            poll_state[STATE_CELLS].errors++;
+            slog("getCells error", LOG_ERR, LOG_CLASS_BUS);
+        }
+    }
+}
+
+
+// Device registry: the primary charger and BMS are esmart3 and jbdbms, polled by the handlers above.
+// Extra chargers share the rs485 bus with their own address (CHARGER_ADDRESSES).
+// The JBD protocol has no address, so an extra BMS needs its own serial port (BMS_PORTS).
+// handle_devices() reads one record of one extra device per run, round robin, so the extras
+// interleave fairly with each other and with the primary polls.
+// Extras publish to MQTT_TOPIC/device/<tag>/json/<record> and influx with their Serial or Id tag.
+#define DEVICE_MAX 6
+
+typedef enum { DEVICE_CHARGER, DEVICE_BMS } device_type_t;
+typedef enum { RECORD_IDENT, RECORD_STATUS, RECORD_CELLS, RECORD_ITEMS } device_record_t;  // ident: Information or Hardware
+
+typedef struct device_entry {
+    device_type_t type;
+    uint8_t address;   // charger: bus address, bms: serial port
+    bool primary;      // esmart3 or jbdbms with the es3* and jbd* records
+    char tag[12];      // e.g. charger2 or bms2
+    ESmart3 *charger;  // extra devices only
+    JbdBms *bms;
+    ESmart3::Information_t information;
+    ESmart3::ChgSts_t chgSts;
+    JbdBms::Hardware_t hardware;
+    JbdBms::Status_t status;
+    JbdBms::Cells_t cells;
+    uint32_t read_ms[RECORD_ITEMS];  // millis() of last successful read
+    uint32_t due_ms[RECORD_ITEMS];   // millis() of next read
+    bool cells_pending;  // status was read, cells are next
+    uint32_t polls, errors;
+    uint64_t bus_us;     // time spent in reads
+} device_entry_t;
+
+device_entry_t devices[DEVICE_MAX];
+size_t device_count = 0;
+uint32_t devices_start_ms = 0;  // for throughput
+uint32_t bms1_access_ms = 0;    // access timestamp of the serial port for extra BMSes on port 1
+#if defined(BMS1_RX_PIN)
+SniffStream bms1_bus(Serial1, 1);
+#endif
+
+const char *const device_records[2][RECORD_ITEMS] = {
+    { "Information", "ChgSts", 0 },
+    { "Hardware", "Status", "Cells" }
+};
+
+// Register the configured devices, the first of each type is the primary
+void setup_devices() {
+    bool port1 = false;  // one BMS per port
+    for (size_t i = 0; i < sizeof(charger_addresses) + sizeof(bms_ports) && device_count < DEVICE_MAX; i++) {
+        bool bms = i >= sizeof(charger_addresses);
+        size_t n = bms ? i - sizeof(charger_addresses) : i;
+        device_entry_t &d = devices[device_count];
+        memset(&d, 0, sizeof(d));
+        d.type = bms ? DEVICE_BMS : DEVICE_CHARGER;
+        d.address = bms ? bms_ports[n] : charger_addresses[n];
+        d.primary = n == 0;
+        snprintf(d.tag, sizeof(d.tag), "%s%u", bms ? "bms" : "charger", (unsigned)(n + 1));
+        if (!d.primary) {
+            if (!bms) {
+                d.charger = new ESmart3(rs485_bus, &rs485_access_ms, d.address);
+            }
+            else if (d.address == 0 || (d.address == 1 && port1)) {
+                char msg[80];
+                snprintf(msg, sizeof(msg), "%s on port %u would answer with another BMS", d.tag, (unsigned)d.address);
+                slog(msg, LOG_ERR);
+                continue;
+            }
+#if defined(BMS1_RX_PIN)
+            else if (d.address == 1) {
+                Serial1.begin(9600, SERIAL_8N1, BMS1_RX_PIN, BMS1_TX_PIN, false, 1000);
+                d.bms = new JbdBms(bms1_bus, &bms1_access_ms);
+                port1 = true;
+            }
+#endif
+            else {
+                char msg[60];
+                snprintf(msg, sizeof(msg), "No serial port %u for %s", (unsigned)d.address, d.tag);
+                slog(msg, LOG_ERR);
+                continue;
+            }
+            // start with the ident records, then spread the first reads
+            d.due_ms[RECORD_STATUS] = millis() + 1000 * device_count;
+        }
+        device_count++;
+    }
+    devices_start_ms = millis();
+}
+
+
+// Extras poll at the base interval of the primary records
+uint32_t device_interval( const device_entry_t &d, device_record_t record ) {
+    if (record == RECORD_IDENT) return 60000;  // like the primary Information and Hardware
+    return poll_state[d.type == DEVICE_CHARGER ? STATE_CHGSTS : STATE_STATUS].base_ms;
+}
+
+
+// Publish a changed record of an extra device
+void publish_device( const device_entry_t &d, device_record_t record ) {
+    char topic[OUTBOX_TOPIC_SIZE];
+    snprintf(topic, sizeof(topic), MQTT_TOPIC "/device/%s/json/%s", d.tag, device_records[d.type][record]);
+    Lease msg(d.type == DEVICE_CHARGER ? POOL_ES3 : POOL_JBD);
+    if (!msg.ok()) return;
+    if (d.type == DEVICE_CHARGER && record == RECORD_IDENT) {
+        json_Information(msg, msg.size(), d.information);
+    }
+    else if (d.type == DEVICE_CHARGER) {
+        json_ChgSts(msg, msg.size(), d.chgSts, d.information.wSerial);
+    }
+    else if (record == RECORD_IDENT) {
+        json_Hardware(msg, msg.size(), d.hardware);
+    }
+    else {
+        BufferWriter json(msg, msg.size());
+        if (record == RECORD_STATUS) {
+            write_Status(json, d.status, d.hardware.id);
+        }
+        else {
+            write_Cells(json, d.cells, d.hardware.id, d.status.cells);
+        }
+        json.finish();
+    }
+    slog(msg, LOG_DEBUG, LOG_CLASS_DATA);
+    publish(topic, msg);
+
+    if (d.type == DEVICE_CHARGER && record == RECORD_STATUS) {
+        line_ChgSts(msg, msg.size(), d.chgSts, d.information.wSerial);
+        postInflux(msg);
+    }
+    else if (record == RECORD_STATUS) {
+        postInfluxStreamed([&d](ChunkWriter &out) { line_Status(out, d.status, d.hardware.id); });
+    }
+    else if (record == RECORD_CELLS) {
+        postInfluxStreamed([&d](ChunkWriter &out) { line_Cells(out, d.cells, d.hardware.id, d.status.cells); });
+    }
+}
+
+
+// Read one record of an extra device, return true if the values changed
+bool poll_device( device_entry_t &d, device_record_t record ) {
+    bool ok = false;
+    bool changed = false;
+    uint32_t start = micros();
+    if (d.type == DEVICE_CHARGER) {
+        if (record == RECORD_IDENT) {
+            ESmart3::Information_t data = {0};
+            if ((ok = d.charger->getInformation(data)) && (changed = memcmp(&data, &d.information, sizeof(data)))) d.information = data;
+        }
+        else {
+            ESmart3::ChgSts_t data = {0};
+            if ((ok = d.charger->getChgSts(data)) && (changed = memcmp(&data, &d.chgSts, sizeof(data)))) d.chgSts = data;
+        }
+    }
+    else {
+        if (record == RECORD_IDENT) {
+            JbdBms::Hardware_t data = {0};
+            if ((ok = d.bms->getHardware(data)) && (changed = memcmp(&data, &d.hardware, sizeof(data)))) d.hardware = data;
+        }
+        else if (record == RECORD_STATUS) {
+            JbdBms::Status_t data = {0};
+            if ((ok = d.bms->getStatus(data)) && (changed = memcmp(&data, &d.status, sizeof(data)))) d.status = data;
+        }
+        else {
+            JbdBms::Cells_t data = {0};
+            if ((ok = d.bms->getCells(data)) && (changed = memcmp(&data, &d.cells, sizeof(data)))) d.cells = data;
+        }
+    }
+    uint32_t now = millis();
+    d.bus_us += micros() - start;
+    d.due_ms[record] = now + device_interval(d, record);
+    if (record == RECORD_CELLS) {
+        d.cells_pending = false;
+    }
+    if (ok) {
+        d.polls++;
+        d.read_ms[record] = now;
+        samples_pending = true;  // e.g. for the bank
+        if (record == RECORD_STATUS && d.type == DEVICE_BMS) {
+            d.cells_pending = true;  // cells right after status, like the primary
+        }
+    }
+    else {
+        d.errors++;
+        char msg[60];
+        snprintf(msg, sizeof(msg), "%s get%s error", d.tag, device_records[d.type][record]);
+        slog(msg, LOG_ERR, LOG_CLASS_BUS);
+    }
+    return changed;
+}
+
+
+// Poll the next due record of the extra devices, round robin
+void handle_devices() {
+    static size_t next = 0;
+
+    if (replay_active) return;  // the replay only feeds the primary devices
+
+    uint32_t now = millis();
+    int32_t wait = INT32_MAX;
+    for (size_t n = 0; n < device_count; n++) {
+        size_t i = (next + n) % device_count;
+        device_entry_t &d = devices[i];
+        if (d.primary) continue;
+        for (int r = 0; r < RECORD_ITEMS; r++) {
+            device_record_t record = (device_record_t)r;
+            if (!device_records[d.type][record]) continue;
+            if (record != RECORD_IDENT && !d.read_ms[RECORD_IDENT]) continue;  // need Serial or Id first
+            if (record == RECORD_CELLS && !d.cells_pending) continue;  // only after status
+            int32_t due = record == RECORD_CELLS ? 0 : d.due_ms[record] - now;
+            if (due <= 0) {
+                if (poll_device(d, record)) {
+                    publish_device(d, record);
+                }
+                next = i + 1;  // next device gets the next turn
+                idle_within(0);
+                return;
+            }
+            wait = min(wait, due);
+        }
+    }
+    if (wait != INT32_MAX) {
+        idle_within(wait);
+    }
+}
+
+
+size_t bms_count() {
+    size_t count = 0;
+    for (size_t i = 0; i < device_count; i++) {
+        if (devices[i].type == DEVICE_BMS) count++;
+    }
+    return count;
+}
+
+
+// Records of a BMS, the primary from the jbd* globals
+const JbdBms::Status_t &device_status( const device_entry_t &d ) { return d.primary ? jbdStatus : d.status; }
+const JbdBms::Cells_t &device_cells( const device_entry_t &d ) { return d.primary ? jbdCells : d.cells; }
+uint32_t device_status_ms( const device_entry_t &d ) { return d.primary ? device_state[STATE_STATUS].read_ms : d.read_ms[RECORD_STATUS]; }
+
+
+// Per device throughput and the share of time the bus was busy
+void write_Devices( ChunkWriter &out, uint32_t now ) {
+    uint32_t minutes = max((now - devices_start_ms) / 60000, (uint32_t)1);
+    uint64_t bus_us = 0;
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Devices\":{", WiFi.getHostname());
+    for (size_t i = 0; i < device_count; i++) {
+        const device_entry_t &d = devices[i];
+        uint32_t polls = d.polls, errors = d.errors;
+        uint64_t us = d.bus_us;
+        if (d.primary) {
+            // the primary devices are counted in poll_state
+            size_t first = d.type == DEVICE_CHARGER ? STATE_INFORMATION : STATE_HARDWARE;
+            size_t last = d.type == DEVICE_CHARGER ? STATE_PROPARAM : STATE_CELLS;
+            for (size_t item = first; item <= last; item++) {
+                polls += poll_state[item].polls;
+                errors += poll_state[item].errors;
+                us += poll_state[item].bus_us;
+            }
+        }
+        bus_us += us;
+        out.printf("%s\"%s\":{\"Address\":%u,\"Primary\":%s,\"Polls\":%u,\"Errors\":%u,\"PollsPerMin\":%u,\"BusMs\":%u,\"BusMsPerMin\":%u}",
+            i ? "," : "", d.tag, d.address, d.primary ? "true" : "false", (unsigned)polls, (unsigned)errors,
+            (unsigned)(polls / minutes), (unsigned)(us / 1000), (unsigned)(us / 1000 / minutes));
+    }
+    out.printf("},\"BusUsage\":%u}", (unsigned)(bus_us * 10 / max(now - devices_start_ms, (uint32_t)1)));  // in 0.01% of uptime
+}
+
+
+// Bank of parallel strings: merges the latest Status and Cells of all BMSes.
+// handle_bank() replaces the contribution of each BMS with a new sample in the sums,
+// strings without a Status for BANK_MAX_AGE_MS drop out until they answer again.
+#define BANK_MAX_AGE_MS 60000
+
+typedef struct bank_member {
+    bool valid;
+    uint32_t status_ms, cells_ms;  // read times of the samples in the sums
+    uint16_t voltage;              // 10mV
+    int16_t current;               // 10mA
+    uint16_t remaining, nominal;   // 10mAh
+    uint16_t min_mv, max_mv;
+    uint8_t min_cell, max_cell;
+} bank_member_t;
+
+typedef struct bank {
+    bank_member_t members[DEVICE_MAX];  // by device index
+    uint8_t strings;                    // valid members
+    int32_t current;                    // 10mA, sum of strings
+    uint32_t voltage_sum;               // 10mV, for the mean
+    uint32_t remaining, nominal;        // 10mAh
+    uint16_t min_mv, max_mv;            // over all cells
+    uint8_t min_string, min_cell, max_string, max_cell;
+    uint16_t imbalance;                 // permille: largest deviation of a string current from the mean
+    uint32_t samples;
+} bank_t;
+
+bank_t bank = {};
+
+uint32_t device_cells_ms( const device_entry_t &d ) { return d.primary ? device_state[STATE_CELLS].read_ms : d.read_ms[RECORD_CELLS]; }
+
+uint16_t bank_soc() { return bank.nominal ? (uint16_t)((uint64_t)bank.remaining * 1000 / bank.nominal) : 0; }  // permille
+
+
+void bank_remove( bank_member_t &m ) {
+    if (m.valid) {
+        bank.strings--;
+        bank.current -= m.current;
+        bank.voltage_sum -= m.voltage;
+        bank.remaining -= m.remaining;
+        bank.nominal -= m.nominal;
+        m.valid = false;
+    }
+}
+
+
+// Global cell extremes and current imbalance need all strings, but only a handful of them
+void bank_extremes() {
+    bank.min_mv = bank.max_mv = 0;
+    bank.imbalance = 0;
+    int32_t mean = bank.strings ? bank.current / bank.strings : 0;
+    int32_t deviation = 0;
+    for (size_t i = 0; i < device_count; i++) {
+        const bank_member_t &m = bank.members[i];
+        if (!m.valid) continue;
+        deviation = max(deviation, abs(m.current - mean));
+        if (!m.cells_ms) continue;
+        if (!bank.min_mv || m.min_mv < bank.min_mv) {
+            bank.min_mv = m.min_mv;
+            bank.min_string = i;
+            bank.min_cell = m.min_cell;
+        }
+        if (m.max_mv > bank.max_mv) {
+            bank.max_mv = m.max_mv;
+            bank.max_string = i;
+            bank.max_cell = m.max_cell;
+        }
+    }
+    if (abs(mean) >= 50) {  // below 0.5A per string the share is noise
+        bank.imbalance = min(deviation * 1000 / abs(mean), (int32_t)UINT16_MAX);
+    }
+}
+
+
+// Merge new BMS samples into the bank, return true if something changed
+bool update_bank() {
+    uint32_t now = millis();
+    bool changed = false;
+    for (size_t i = 0; i < device_count; i++) {
+        const device_entry_t &d = devices[i];
+        if (d.type != DEVICE_BMS) continue;
+        bank_member_t &m = bank.members[i];
+        uint32_t status_ms = device_status_ms(d);
+        if (!status_ms || now - status_ms > BANK_MAX_AGE_MS) {
+            if (m.valid) {
+                bank_remove(m);
+                changed = true;
+            }
+            continue;
+        }
+        if (m.valid && status_ms == m.status_ms && device_cells_ms(d) == m.cells_ms) continue;
+
+        const JbdBms::Status_t &status = device_status(d);
+        bank_remove(m);
+        m.status_ms = status_ms;
+        m.voltage = status.voltage;
+        m.current = status.current;
+        m.remaining = status.remainingCapacity;
+        m.nominal = status.nominalCapacity;
+        m.cells_ms = 0;
+        uint8_t cells = min(status.cells, (uint8_t)(sizeof(JbdBms::Cells_t::voltages)/sizeof(uint16_t)));
+        if (cells && device_cells_ms(d)) {
+            const JbdBms::Cells_t &data = device_cells(d);
+            m.cells_ms = device_cells_ms(d);
+            m.min_mv = m.max_mv = data.voltages[0];
+            m.min_cell = m.max_cell = 1;
+            for (uint8_t c = 1; c < cells; c++) {
+                if (data.voltages[c] < m.min_mv) {
+                    m.min_mv = data.voltages[c];
+                    m.min_cell = c + 1;
+                }
+                if (data.voltages[c] > m.max_mv) {
+                    m.max_mv = data.voltages[c];
+                    m.max_cell = c + 1;
+                }
+            }
+        }
+        m.valid = true;
+        bank.strings++;
+        bank.current += m.current;
+        bank.voltage_sum += m.voltage;
+        bank.remaining += m.remaining;
+        bank.nominal += m.nominal;
+        changed = true;
+    }
+    if (changed) {
+        bank_extremes();
+        bank.samples++;
+    }
+    return changed;
+}
+
+
+void write_Bank( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Bank\":{"
+        "\"Strings\":%u,\"Voltage\":%u,\"Current\":%d,\"Remaining\":%u,\"Nominal\":%u,\"SoC\":%u,"
+        "\"MinCell\":{\"String\":\"%s\",\"Cell\":%u,\"mV\":%u},\"MaxCell\":{\"String\":\"%s\",\"Cell\":%u,\"mV\":%u},"
+        "\"Imbalance\":%u,\"Samples\":%u,\"Currents\":{",
+        WiFi.getHostname(), bank.strings, (unsigned)(bank.strings ? bank.voltage_sum / bank.strings : 0), (int)bank.current,
+        (unsigned)bank.remaining, (unsigned)bank.nominal, bank_soc(),
+        bank.min_mv ? devices[bank.min_string].tag : "", bank.min_cell, bank.min_mv,
+        bank.max_mv ? devices[bank.max_string].tag : "", bank.max_cell, bank.max_mv,
+        bank.imbalance, (unsigned)bank.samples);
+    bool first = true;
+    for (size_t i = 0; i < device_count; i++) {
+        if (bank.members[i].valid) {
+            out.printf("%s\"%s\":%d", first ? "" : ",", devices[i].tag, bank.members[i].current);
+            first = false;
+        }
+    }
+    out.print("}}}");
+}
+
+
+// Merge new samples and publish the bank at most every 10s, if there is more than one string
+void handle_bank() {
+    static const char lineFmt[] =
+        "Bank,Host=%s,Version=" VERSION " "
+        "Strings=%u,"
+        "Voltage=%u,"
+        "Current=%d,"
+        "Remaining=%u,"
+        "Nominal=%u,"
+        "SoC=%u,"
+        "MinCell=%u,"
+        "MaxCell=%u,"
+        "Delta=%u,"
+        "Imbalance=%u";
     static const uint32_t interval = 10000;
-    static uint32_t prev = 0 - interval + 100;  // check at start + delay
+    static uint32_t prev = 0 - interval;
+    static bool pending = false;  // changes not yet published
 
+    pending |= update_bank();
     uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        ESmart3::BatParam_t data = {0};
-        if( esmart3.getBatParam(data) ) {
-            if( memcmp(&data, &es3BatParam, sizeof(data) ) ) {
-                // values have changed: publish
-                static const char lineFmt[] =
-                    "BatParam,Serial=%8.8s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "BatType=%u,"
-                    "BatSysType=%u,"
-                    "BulkVolt=%u,"
-                    "FloatVolt=%u,"
-                    "MaxChgCurr=%u,"
-                    "MaxDisChgCurr=%u,"
-                    "EqualizeChgVolt=%u,"
-                    "EqualizeChgTime=%u,"
-                    "LoadUseSel=%u";
-                
-                es3BatParam = data;
-                json_BatParam(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/BatParam", msg);
+    if (!pending || bms_count() < 2 || now - prev < interval) {
+        return;
+    }
+    prev = now;
+    pending = false;
+
+    publish(MQTT_TOPIC "/json/Bank", write_Bank);  // streamed when sent
+    postInfluxStreamed([](ChunkWriter &out) {
+        out.printf(lineFmt, WiFi.getHostname(), bank.strings, (unsigned)(bank.strings ? bank.voltage_sum / bank.strings : 0),
+            (int)bank.current, (unsigned)bank.remaining, (unsigned)bank.nominal, bank_soc(),
+            bank.min_mv, bank.max_mv, bank.max_mv - bank.min_mv, bank.imbalance);
+    });
+}
+
+
+// RS485 proxy: external tools send raw eSmart3 (0xAA ...) or JBD (0xDD ...) request frames
+// to tcp port PROXY_PORT and get the raw response frame back. The Proxy task forwards one
+// request per run between the polls of this firmware, so the ESP stays the only bus master.
+// A read request equal to one forwarded within PROXY_FRESH_MS is answered from the cache,
+// so several tools polling the same data cost one bus transfer.
+// The proxy has no authentication, so it is off by default and only forwards reads unless PROXY_WRITES is set.
+// A client whose request timed out on the bus backs off, so a dead address does not eat the poll windows.
+#ifndef PROXY_PORT
+    #define PROXY_PORT 0  // 0: no proxy
+#endif
+#ifndef PROXY_FRESH_MS
+    #define PROXY_FRESH_MS 1000
+#endif
+#ifndef PROXY_WRITES
+    #define PROXY_WRITES 0  // 1: also forward requests that change device settings
+#endif
+#define PROXY_CLIENTS 2
+#define PROXY_CACHE_SIZE 8
+#define PROXY_REQUEST_MAX 32   // longer requests are forwarded, but not cached
+#define PROXY_FRAME_MAX 264    // header, 255 data bytes and trailer
+#define PROXY_GAP_MS 50        // bus silence before a request, like between the polls
+#define PROXY_TIMEOUT_MS 500
+#define PROXY_BACKOFF_MS 1000  // after a bus timeout, doubled for each further one
+#define PROXY_BACKOFF_MAX_MS 32000
+
+typedef struct proxy_client {
+    WiFiClient client;
+    uint8_t request[PROXY_FRAME_MAX];
+    size_t len;
+    uint32_t start_ms;  // millis() of the first byte
+    uint32_t backoff_ms;  // current backoff after bus timeouts, 0: none
+    uint32_t timeout_ms;  // millis() of the last bus timeout
+} proxy_client_t;
+
+typedef struct proxy_cache_entry {
+    uint8_t request[PROXY_REQUEST_MAX];
+    uint8_t request_len;
+    uint8_t response[PROXY_FRAME_MAX];
+    uint16_t response_len;
+    uint32_t read_ms;
+} proxy_cache_entry_t;
+
+typedef struct proxy_stats {
+    uint32_t clients, rejected;  // accepted and refused connections
+    uint32_t requests, hits, forwarded, timeouts, errors;
+    uint32_t denied, throttled;  // write requests and requests during a backoff, both dropped
+    uint64_t bus_us;
+} proxy_stats_t;
+
+WiFiServer proxy_server(PROXY_PORT);
+proxy_client_t proxy_clients[PROXY_CLIENTS];
+proxy_cache_entry_t proxy_cache[PROXY_CACHE_SIZE];
+proxy_stats_t proxy_stats = {};
+
+// Expected length of the frame in buf, 0: not known yet, -1: no frame start
+int proxy_frame_len( const uint8_t *buf, size_t len ) {
+    if (!len) return 0;
+    if (buf[0] == 0xAA) return len < 6 ? 0 : 6 + buf[5] + 1;  // start, device, address, command, item, length, data, checksum
+    if (buf[0] == 0xDD) return len < 4 ? 0 : 4 + buf[3] + 3;  // start, read/write, register, length, data, checksum, end
+    return -1;
+}
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
-                    data.wBatType, data.wBatSysType, data.wBulkVolt, data.wFloatVolt, data.wMaxChgCurr,
-                    data.wMaxDisChgCurr, data.wEqualizeChgVolt, data.wEqualizeChgTime, data.bLoadUseSel);
-                postInflux(msg);
-            }
+// Complete request frame that does not change device state
+bool proxy_is_read( const uint8_t *request ) {
+    if (request[0] == 0xAA) return request[3] == 1;  // eSmart3 command GET
+    return request[1] == 0xA5;                       // JBD read
+}
+
+// Only reads may be answered from the cache
+bool proxy_cacheable( const uint8_t *request, size_t len ) {
+    return len <= PROXY_REQUEST_MAX && proxy_is_read(request);
+}
+
+proxy_cache_entry_t *proxy_cached( const uint8_t *request, size_t len ) {
+    uint32_t now = millis();
+    for (auto &entry: proxy_cache) {
+        if (entry.request_len == len && now - entry.read_ms <= PROXY_FRESH_MS && !memcmp(entry.request, request, len)) {
+            return &entry;
         }
-        else {
-            slog("getBatParam error", LOG_ERR);
+    }
+    return 0;
+}
+
+// Store a response in the oldest cache entry
+void proxy_remember( const uint8_t *request, size_t len, const uint8_t *response, size_t response_len ) {
+    uint32_t now = millis();
+    proxy_cache_entry_t *oldest = proxy_cache;
+    for (auto &entry: proxy_cache) {
+        if (now - entry.read_ms > now - oldest->read_ms) {
+            oldest = &entry;
         }
     }
+    memcpy(oldest->request, request, len);
+    oldest->request_len = len;
+    memcpy(oldest->response, response, response_len);
+    oldest->response_len = response_len;
+    oldest->read_ms = now;
 }
 
+// Send a request frame on the bus and return the length of the response frame, 0 on timeout or garbage
+size_t proxy_transfer( const uint8_t *request, size_t len, uint8_t *response ) {
+    uint32_t start_us = micros();
+    while (rs485_bus.available()) {
+        rs485_bus.read();  // drop noise of earlier transfers
+    }
+    if (RS485_DIR_PIN != -1) {
+        digitalWrite(RS485_DIR_PIN, HIGH);  // DE/!RE: drive the bus like the device libraries do
+    }
+    rs485_bus.write(request, len);
+    rs485_bus.flush();
+    if (RS485_DIR_PIN != -1) {
+        digitalWrite(RS485_DIR_PIN, LOW);
+    }
 
-bool json_Log(char *json, size_t maxlen, ESmart3::Log_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"Log\":{"
-        "\"RunTime\":%u,"
-        "\"StartCnt\":%u,"
-        "\"LastFaultInfo\":%u,"
-        "\"FaultCnt\":%u,"
-        "\"TodayEng\":%u,"
-        "\"TodayEngDate\":\"%d:%d\","
-        "\"MonthEng\":%u,"
-        "\"MonthEngDate\":\"%d:%d\","
-        "\"TotalEng\":%u,"
-        "\"LoadTodayEng\":%u,"
-        "\"LoadMonthEng\":%u,"
-        "\"LoadTotalEng\":%u,"
-        "\"BacklightTime\":%u,"
-        "\"SwitchEnable\":%u}}";
+    size_t got = 0;
+    int expected = 0;
+    uint32_t start = millis();
+    while (millis() - start < PROXY_TIMEOUT_MS && !(expected > 0 && got == (size_t)expected)) {
+        if (!rs485_bus.available()) {
+            delay(1);
+            continue;
+        }
+        uint8_t b = rs485_bus.read();
+        if (!got && b != request[0]) continue;  // wait for the start byte of the answer
+        response[got++] = b;
+        expected = proxy_frame_len(response, got);
+        if (expected > PROXY_FRAME_MAX) break;
+    }
+    rs485_access_ms = millis();
+    proxy_stats.bus_us += micros() - start_us;
+    return (expected > 0 && got == (size_t)expected) ? got : 0;
+}
 
-    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
-        data.dwRunTime, data.wStartCnt, data.wLastFaultInfo, data.wFaultCnt, 
-        data.dwTodayEng, data.wTodayEngDate.month, data.wTodayEngDate.day, data.dwMonthEng, 
-        data.wMonthEngDate.month, data.wMonthEngDate.day, data.dwTotalEng, data.dwLoadTodayEng, 
-        data.dwLoadMonthEng, data.dwLoadTotalEng, data.wBacklightTime, data.bSwitchEnable);
 
-    return len < maxlen;
-}
+// Accept proxy clients, collect their requests and answer them from cache or bus
+void handle_proxy() {
+    if (!PROXY_PORT) return;
 
+    if (proxy_server.hasClient()) {
+        WiFiClient client = proxy_server.accept();
+        proxy_client_t *slot = 0;
+        for (auto &c: proxy_clients) {
+            if (!c.client.connected()) {
+                slot = &c;
+                break;
+            }
+        }
+        if (slot) {
+            slot->client = client;
+            slot->client.setNoDelay(true);
+            slot->len = 0;
+            slot->backoff_ms = 0;
+            proxy_stats.clients++;
+        }
+        else {
+            client.stop();
+            proxy_stats.rejected++;
+        }
+    }
 
-ESmart3::Log_t es3Log = {0};
+    static size_t next = 0;  // client that goes first, for fair bus access
+    bool forwarded = false;
+    for (size_t n = 0; n < PROXY_CLIENTS; n++) {
+        size_t i = (next + n) % PROXY_CLIENTS;
+        proxy_client_t &c = proxy_clients[i];
+        if (!c.client.connected()) continue;
+
+        int expected = proxy_frame_len(c.request, c.len);
+        while (c.client.available() && (expected == 0 || c.len < (size_t)expected) && c.len < PROXY_FRAME_MAX) {
+            if (!c.len) c.start_ms = millis();
+            c.request[c.len++] = c.client.read();
+            expected = proxy_frame_len(c.request, c.len);
+            if (expected < 0) break;
+        }
+        bool partial = !expected || c.len < (size_t)expected;
+        if (expected < 0 || expected > PROXY_FRAME_MAX || (partial && c.len && millis() - c.start_ms > PROXY_TIMEOUT_MS)) {
+            proxy_stats.errors++;  // garbage or incomplete frame: resync
+            c.len = 0;
+            continue;
+        }
+        if (partial) continue;  // complete requests wait for their bus turn without timeout
 
-// get status log once every 10s
-void handle_es3Log() {
-    static const uint32_t interval = 10000;
-    static uint32_t prev = 0 - interval + 150;  // check at start + delay
+        if (!PROXY_WRITES && !proxy_is_read(c.request)) {
+            proxy_stats.denied++;
+            slog("Proxy write request denied", LOG_WARNING, LOG_CLASS_BUS);
+            c.len = 0;
+            continue;
+        }
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        ESmart3::Log_t data = {0};
-        if( esmart3.getLog(data) ) {
-            if( memcmp(&data.wStartCnt, &es3Log.wStartCnt, sizeof(data) - offsetof(ESmart3::Log_t, wStartCnt) ) ) {
-                // values have changed: publish
-                static const char lineFmt[] =
-                    "Log,Serial=%8.8s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "RunTime=%u,"
-                    "StartCnt=%u,"
-                    "LastFaultInfo=%u,"
-                    "FaultCnt=%u,"
-                    "TodayEng=%u,"
-                    "TodayEngDate=\"%d:%d\","
-                    "MonthEng=%u,"
-                    "MonthEngDate=\"%d:%d\","
-                    "TotalEng=%u,"
-                    "LoadTodayEng=%u,"
-                    "LoadMonthEng=%u,"
-                    "LoadTotalEng=%u,"
-                    "BacklightTime=%u,"
-                    "SwitchEnable=%u";
-                
-                es3Log = data;
-                json_Log(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/Log", msg);
+        proxy_cache_entry_t *entry = proxy_cached(c.request, c.len);
+        if (entry) {
+            proxy_stats.requests++;
+            proxy_stats.hits++;
+            c.client.write(entry->response, entry->response_len);
+            c.len = 0;
+            continue;
+        }
+
+        if (c.backoff_ms && millis() - c.timeout_ms < c.backoff_ms) {
+            proxy_stats.throttled++;  // client sees its own timeout
+            c.len = 0;
+            continue;
+        }
+
+        uint32_t quiet = millis() - rs485_access_ms;
+        if (forwarded || quiet < PROXY_GAP_MS) {
+            idle_within(forwarded ? 0 : PROXY_GAP_MS - quiet);  // request waits for the next run
+            continue;
+        }
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
-                    data.dwRunTime, data.wStartCnt, data.wLastFaultInfo, data.wFaultCnt, 
-                    data.dwTodayEng, data.wTodayEngDate.month, data.wTodayEngDate.day, data.dwMonthEng, 
-                    data.wMonthEngDate.month, data.wMonthEngDate.day, data.dwTotalEng, data.dwLoadTodayEng, 
-                    data.dwLoadMonthEng, data.dwLoadTotalEng, data.wBacklightTime, data.bSwitchEnable);
-                postInflux(msg);
+        proxy_stats.requests++;
+
+        uint8_t response[PROXY_FRAME_MAX];
+        size_t len = proxy_transfer(c.request, c.len, response);
+        forwarded = true;
+        next = i + 1;
+        if (len) {
+            c.backoff_ms = 0;
+            proxy_stats.forwarded++;
+            if (proxy_cacheable(c.request, c.len)) {
+                proxy_remember(c.request, c.len, response, len);
             }
+            c.client.write(response, len);
         }
         else {
-            slog("getLog error", LOG_ERR);
+            proxy_stats.timeouts++;  // client sees its own timeout
+            c.backoff_ms = c.backoff_ms ? min(2 * c.backoff_ms, (uint32_t)PROXY_BACKOFF_MAX_MS) : PROXY_BACKOFF_MS;
+            c.timeout_ms = millis();
+            slog("Proxy request timeout", LOG_WARNING, LOG_CLASS_BUS);
         }
+        c.len = 0;
     }
 }
 
 
-bool json_Parameters(char *json, size_t maxlen, ESmart3::Parameters_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"Parameters\":{"
-        "\"PvVoltRatio\":%u,"
-        "\"PvVoltOffset\":%u,"
-        "\"BatVoltRatio\":%u,"
-        "\"BatVoltOffset\":%u,"
-        "\"ChgCurrRatio\":%u,"
-        "\"ChgCurrOffset\":%u,"
-        "\"LoadCurrRatio\":%u,"
-        "\"LoadCurrOffset\":%u,"
-        "\"LoadVoltRatio\":%u,"
-        "\"LoadVoltOffset\":%u,"
-        "\"OutVoltRatio\":%u,"
-        "\"OutVoltOffset\":%u}}";
+void write_Proxy( ChunkWriter &out ) {
+    const proxy_stats_t &s = proxy_stats;
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Proxy\":{\"Port\":%u,\"FreshMs\":%u,\"Writes\":%s,"
+        "\"Clients\":%u,\"Rejected\":%u,\"Requests\":%u,\"CacheHits\":%u,\"Forwarded\":%u,\"Timeouts\":%u,\"Errors\":%u,"
+        "\"Denied\":%u,\"Throttled\":%u,\"BusMs\":%u}}",
+        WiFi.getHostname(), (unsigned)PROXY_PORT, (unsigned)PROXY_FRESH_MS, PROXY_WRITES ? "true" : "false",
+        (unsigned)s.clients, (unsigned)s.rejected, (unsigned)s.requests, (unsigned)s.hits, (unsigned)s.forwarded,
+        (unsigned)s.timeouts, (unsigned)s.errors, (unsigned)s.denied, (unsigned)s.throttled, (unsigned)(s.bus_us / 1000));
+}
 
-    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
-        data.wPvVoltRatio, data.wPvVoltOffset, data.wBatVoltRatio, data.wBatVoltOffset, 
-        data.wChgCurrRatio, data.wChgCurrOffset, data.wLoadCurrRatio, data.wLoadCurrOffset, 
-        data.wLoadVoltRatio, data.wLoadVoltOffset, data.wOutVoltRatio, data.wOutVoltOffset);
 
-    return len < maxlen;
+void setup_proxy() {
+    if (PROXY_PORT) {
+        proxy_server.begin();
+        proxy_server.setNoDelay(true);
+    }
 }
 
 
-ESmart3::Parameters_t es3Parameters = {0};
+// RS485 sniffer: SniffStream hands every byte of the bus ports to sniff_byte(), which cuts them
+// into request and response frames by the protocol length bytes and checks the answers.
+// Per device counters (requests, retries, result types, round trip times) are always kept,
+// frames with µs timestamps go into a RAM ring only while capture is on (mqtt "capture on|off").
+// /capture.pcap downloads the ring as pcap with link type USER0 and a 4 byte pseudo header
+// (port, tx, result, 0) in front of each frame.
+#include <esp_timer.h>
+
+#define SNIFF_PORTS 2
+#define SNIFF_FRAMES 64            // frames in the capture ring
+#define SNIFF_CAPLEN 80            // bytes kept per frame, the rest is only counted
+#define SNIFF_DEVICES 8
+#define SNIFF_GAP_US 100000        // silence that ends an incomplete frame
+#define SNIFF_TIMEOUT_US 1000000   // request without answer
+#define SNIFF_RETRY_US 3000000     // same request after a failure within this time is a retry
+
+typedef enum { SNIFF_OK, SNIFF_TIMEOUT, SNIFF_SHORT, SNIFF_CRC, SNIFF_GARBAGE, SNIFF_RESULTS } sniff_result_t;
+const char *const sniff_results[] = { "Ok", "Timeout", "Short", "Crc", "Garbage" };
+
+typedef struct sniff_frame {
+    int64_t us;        // first byte, since boot
+    uint16_t len;      // bytes on the bus
+    uint8_t port, tx;
+    uint8_t result;    // of response frames
+    uint8_t data[SNIFF_CAPLEN];
+} sniff_frame_t;
+
+typedef struct sniff_device {
+    uint8_t port, start, address;  // start 0xAA: eSmart3 with bus address, 0xDD: JBD
+    uint32_t requests, retries, stray;  // stray: response without request
+    uint32_t results[SNIFF_RESULTS];
+    uint32_t rtt_min_us, rtt_max_us;    // of good answers
+    uint64_t rtt_sum_us;
+} sniff_device_t;
+
+typedef struct sniff_port {
+    sniff_frame_t frame;      // being sent or received
+    bool active;              // frame has bytes
+    int64_t last_us;          // last byte
+    sniff_frame_t request;    // last request
+    bool pending;             // request waits for its answer
+    bool failed;              // last exchange failed, for retry detection
+    sniff_device_t *device;   // of the last request
+} sniff_port_t;
+
+sniff_port_t sniff_ports[SNIFF_PORTS];
+sniff_device_t sniff_devices[SNIFF_DEVICES];
+sniff_frame_t sniff_ring[SNIFF_FRAMES];
+uint32_t sniff_captured = 0;  // frames since capture on, the ring keeps the last SNIFF_FRAMES
+bool sniff_capture = false;
+
+// Counters of the device a request frame is for, the last entry collects the rest
+sniff_device_t &sniff_device( uint8_t port, const sniff_frame_t &f ) {
+    uint8_t address = (f.data[0] == 0xAA && f.len > 2) ? f.data[2] : 0;
+    for (auto &d: sniff_devices) {
+        if (!d.start) {
+            d.port = port;
+            d.start = f.data[0];
+            d.address = address;
+            return d;
+        }
+        if (d.port == port && d.start == f.data[0] && d.address == address) {
+            return d;
+        }
+    }
+    return sniff_devices[SNIFF_DEVICES - 1];
+}
 
-// get calibration parameters once every 10s
-void handle_es3Parameters() {
-    static const uint32_t interval = 10000;
-    static uint32_t prev = 0 - interval + 200;  // check at start + delay
+// Check length and checksum of a response frame
+sniff_result_t sniff_check( const sniff_frame_t &f ) {
+    int expected = proxy_frame_len(f.data, min((size_t)f.len, (size_t)SNIFF_CAPLEN));
+    if (expected < 0 || f.len > expected) return SNIFF_GARBAGE;
+    if (expected == 0 || f.len < expected) return SNIFF_SHORT;
+    if (expected > SNIFF_CAPLEN) return SNIFF_OK;  // cut, cannot check
+    if (f.data[0] == 0xAA) {
+        uint8_t sum = 0;  // over all bytes including the checksum
+        for (int i = 0; i < expected; i++) {
+            sum += f.data[i];
+        }
+        return sum ? SNIFF_CRC : SNIFF_OK;
+    }
+    uint16_t sum = (f.data[expected - 3] << 8) | f.data[expected - 2];  // over status, length and data plus checksum
+    for (int i = 2; i < expected - 3; i++) {
+        sum += f.data[i];
+    }
+    return (sum || f.data[expected - 1] != 0x77) ? SNIFF_CRC : SNIFF_OK;
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        ESmart3::Parameters_t data = {0};
-        if( esmart3.getParameters(data) ) {
-            if( memcmp(&data, &es3Parameters, sizeof(data)) ) {
-                // values have changed: publish
-                static const char lineFmt[] =
-                    "Parameters,Serial=%8.8s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "PvVoltRatio=%u,"
-                    "PvVoltOffset=%u,"
-                    "BatVoltRatio=%u,"
-                    "BatVoltOffset=%u,"
-                    "ChgCurrRatio=%u,"
-                    "ChgCurrOffset=%u,"
-                    "LoadCurrRatio=%u,"
-                    "LoadCurrOffset=%u,"
-                    "LoadVoltRatio=%u,"
-                    "LoadVoltOffset=%u,"
-                    "OutVoltRatio=%u,"
-                    "OutVoltOffset=%u";
-                
-                es3Parameters = data;
-                json_Parameters(msg, sizeof(msg), data);
-                // slog(msg);
-                publish(MQTT_TOPIC "/json/Parameters", msg);
+void sniff_result( sniff_port_t &p, sniff_result_t result, uint32_t rtt_us ) {
+    sniff_device_t &d = *p.device;
+    d.results[result]++;
+    if (result == SNIFF_OK) {
+        d.rtt_sum_us += rtt_us;
+        if (!d.rtt_min_us || rtt_us < d.rtt_min_us) d.rtt_min_us = rtt_us;
+        if (rtt_us > d.rtt_max_us) d.rtt_max_us = rtt_us;
+    }
+    p.failed = result != SNIFF_OK;
+    p.pending = false;
+}
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
-                    data.wPvVoltRatio, data.wPvVoltOffset, data.wBatVoltRatio, data.wBatVoltOffset, 
-                    data.wChgCurrRatio, data.wChgCurrOffset, data.wLoadCurrRatio, data.wLoadCurrOffset, 
-                    data.wLoadVoltRatio, data.wLoadVoltOffset, data.wOutVoltRatio, data.wOutVoltOffset);
-                postInflux(msg);
-            }
+// A frame is complete: count it and keep it if capture is on
+void sniff_close( uint8_t port ) {
+    sniff_port_t &p = sniff_ports[port];
+    sniff_frame_t &f = p.frame;
+    p.active = false;
+    if (f.tx) {
+        if (p.pending) {
+            sniff_result(p, SNIFF_TIMEOUT, 0);  // new request before an answer
         }
-        else {
-            slog("getParameters error", LOG_ERR);
+        sniff_device_t &d = sniff_device(port, f);
+        d.requests++;
+        if (p.failed && p.device == &d && p.request.len == f.len && f.us - p.request.us < SNIFF_RETRY_US
+                && !memcmp(p.request.data, f.data, min((size_t)f.len, (size_t)SNIFF_CAPLEN))) {
+            d.retries++;
+        }
+        p.request = f;
+        p.device = &d;
+        p.pending = true;
+    }
+    else {
+        f.result = sniff_check(f);
+        if (p.pending) {
+            sniff_result(p, (sniff_result_t)f.result, p.last_us - p.request.us);
+        }
+        else if (p.device) {
+            p.device->stray++;  // e.g. late answer or noise
         }
     }
+    if (sniff_capture) {
+        sniff_ring[sniff_captured++ % SNIFF_FRAMES] = f;
+    }
 }
 
+void sniff_byte( uint8_t port, bool tx, uint8_t b ) {
+    if (port >= SNIFF_PORTS) return;
 
-bool json_LoadParam(char *json, size_t maxlen, ESmart3::LoadParam_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"LoadParam\":{"
-        "\"LoadModuleSelect1\":%u,"
-        "\"LoadModuleSelect2\":%u,"
-        "\"LoadOnPvVolt\":%u,"
-        "\"LoadOffPvVolt\":%u,"
-        "\"PvContrlTurnOnDelay\":%u,"
-        "\"PvContrlTurnOffDelay\":%u,"
-        "\"AftLoadOnTime\":\"%d:%d\","
-        "\"AftLoadOffTime\":\"%d:%d\","
-        "\"MonLoadOnTime\":\"%d:%d\","
-        "\"MonLoadOffTime\":\"%d:%d\","
-        "\"LoadSts\":%u,"
-        "\"Time2Enable\":%u}}";
-
-    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
-        data.wLoadModuleSelect1, data.wLoadModuleSelect2, data.wLoadOnPvVolt, data.wLoadOffPvVolt, 
-        data.wPvContrlTurnOnDelay, data.wPvContrlTurnOffDelay, data.AftLoadOnTime.hour, data.AftLoadOnTime.minute, 
-        data.AftLoadOffTime.hour, data.AftLoadOffTime.minute, data.MonLoadOnTime.hour, data.MonLoadOnTime.minute, 
-        data.MonLoadOffTime.hour, data.MonLoadOffTime.minute, data.wLoadSts, data.wTime2Enable);
+    sniff_port_t &p = sniff_ports[port];
+    sniff_frame_t &f = p.frame;
+    int64_t now = esp_timer_get_time();
+    if (p.active && (f.tx != tx || now - p.last_us > SNIFF_GAP_US)) {
+        sniff_close(port);
+    }
+    if (!p.active) {
+        f.us = now;
+        f.len = 0;
+        f.port = port;
+        f.tx = tx;
+        f.result = SNIFF_OK;
+        p.active = true;
+    }
+    if (f.len < SNIFF_CAPLEN) {
+        f.data[f.len] = b;
+    }
+    f.len++;
+    p.last_us = now;
+    int expected = proxy_frame_len(f.data, min((size_t)f.len, (size_t)SNIFF_CAPLEN));
+    if (expected < 0 || (expected > 0 && f.len >= expected)) {
+        sniff_close(port);  // complete or no frame start: one byte garbage frames resync fast
+    }
+}
 
-    return len < maxlen;
+// Close frames and requests the bus left hanging
+void handle_sniffer() {
+    int64_t now = esp_timer_get_time();
+    for (uint8_t port = 0; port < SNIFF_PORTS; port++) {
+        sniff_port_t &p = sniff_ports[port];
+        if (p.active && now - p.last_us > SNIFF_GAP_US) {
+            sniff_close(port);
+        }
+        if (p.pending && !p.active && now - p.request.us > SNIFF_TIMEOUT_US) {
+            sniff_result(p, SNIFF_TIMEOUT, 0);
+        }
+    }
 }
 
+void set_capture( bool on ) {
+    if (on && !sniff_capture) {
+        sniff_captured = 0;  // fresh ring
+    }
+    sniff_capture = on;
+}
 
-ESmart3::LoadParam_t es3LoadParam = {0};
 
-// get load parameters once every 10s
-void handle_es3LoadParam() {
-    static const uint32_t interval = 10000;
-    static uint32_t prev = 0 - interval + 250;  // check at start + delay
+void write_Sniffer( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Sniffer\":{\"Capture\":%s,\"Frames\":%u,\"Devices\":{",
+        WiFi.getHostname(), sniff_capture ? "true" : "false", (unsigned)sniff_captured);
+    for (size_t i = 0; i < SNIFF_DEVICES && sniff_devices[i].start; i++) {
+        const sniff_device_t &d = sniff_devices[i];
+        out.printf("%s\"%u-%s-%u\":{\"Requests\":%u,\"Retries\":%u,\"Stray\":%u", i ? "," : "", d.port,
+            d.start == 0xAA ? "eSmart3" : d.start == 0xDD ? "JBD" : "unknown", d.address,
+            (unsigned)d.requests, (unsigned)d.retries, (unsigned)d.stray);
+        for (size_t r = 0; r < SNIFF_RESULTS; r++) {
+            out.printf(",\"%s\":%u", sniff_results[r], (unsigned)d.results[r]);
+        }
+        uint32_t ok = d.results[SNIFF_OK];
+        out.printf(",\"RttUs\":{\"Min\":%u,\"Avg\":%u,\"Max\":%u}}", (unsigned)d.rtt_min_us,
+            (unsigned)(ok ? d.rtt_sum_us / ok : 0), (unsigned)d.rtt_max_us);
+    }
+    out.print("}}}");
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        ESmart3::LoadParam_t data = {0};
-        if( esmart3.getLoadParam(data) ) {
-            if( memcmp(&data, &es3LoadParam, sizeof(data) ) ) {
-                // values have changed: publish
-                static const char lineFmt[] =
-                    "LoadParam,Serial=%8.8s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "LoadModuleSelect1=%u,"
-                    "LoadModuleSelect2=%u,"
-                    "LoadOnPvVolt=%u,"
-                    "LoadOffPvVolt=%u,"
-                    "PvContrlTurnOnDelay=%u,"
-                    "PvContrlTurnOffDelay=%u,"
-                    "AftLoadOnTime=\"%d:%d\","
-                    "AftLoadOffTime=\"%d:%d\","
-                    "MonLoadOnTime=\"%d:%d\","
-                    "MonLoadOffTime=\"%d:%d\","
-                    "LoadSts=%u,"
-                    "Time2Enable=%u";
-                
-                es3LoadParam = data;
-                json_LoadParam(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/LoadParam", msg);
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
-                    data.wLoadModuleSelect1, data.wLoadModuleSelect2, data.wLoadOnPvVolt, data.wLoadOffPvVolt, 
-                    data.wPvContrlTurnOnDelay, data.wPvContrlTurnOffDelay, data.AftLoadOnTime.hour, data.AftLoadOnTime.minute, 
-                    data.AftLoadOffTime.hour, data.AftLoadOffTime.minute, data.MonLoadOnTime.hour, data.MonLoadOnTime.minute, 
-                    data.MonLoadOffTime.hour, data.MonLoadOffTime.minute, data.wLoadSts, data.wTime2Enable);
-                postInflux(msg);
-            }
-        }
-        else {
-            slog("getLoadParam error", LOG_ERR);
-        }
+// Capture ring as pcap (timestamps since boot unless time is known)
+void write_Capture( ChunkWriter &out, int64_t boot_us ) {
+    const struct { uint32_t magic; uint16_t major, minor; int32_t zone; uint32_t sigfigs, snaplen, linktype; } header = {
+        0xa1b2c3d4, 2, 4, 0, 0, SNIFF_CAPLEN + 4, 147  // LINKTYPE_USER0
+    };
+    out.write((const uint8_t *)&header, sizeof(header));
+    uint32_t count = min(sniff_captured, (uint32_t)SNIFF_FRAMES);
+    for (uint32_t n = sniff_captured - count; n < sniff_captured; n++) {
+        const sniff_frame_t &f = sniff_ring[n % SNIFF_FRAMES];
+        int64_t us = boot_us + f.us;
+        uint32_t caplen = min((size_t)f.len, (size_t)SNIFF_CAPLEN);
+        const uint32_t record[] = { (uint32_t)(us / 1000000), (uint32_t)(us % 1000000), caplen + 4, (uint32_t)f.len + 4 };
+        const uint8_t pseudo[] = { f.port, f.tx, f.result, 0 };
+        out.write((const uint8_t *)record, sizeof(record));
+        out.write(pseudo, sizeof(pseudo));
+        out.write(f.data, caplen);
     }
 }
 
 
-bool json_ProParam(char *json, size_t maxlen, ESmart3::ProParam_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Serial\":\"%8.8s\",\"ProParam\":{"
-        "\"LoadOvp\":%u,"
-        "\"LoadUvp\":%u,"
-        "\"BatOvp\":%u,"
-        "\"BatOvB\":%u,"
-        "\"BatUvp\":%u,"
-        "\"BatUvB\":%u}}";
+#include <Preferences.h>
+
+// Coulomb counter for the state of charge, more precise than remainingCapacity of the BMS
+// - integrates each new BMS current sample (or charger minus load current while the BMS is silent)
+//   trapezoidal over the exact sample interval into 64 bit fixed point, so weeks of counting lose nothing
+// - full (max cell >= 3.45V at less than 2A charge current) and empty (min cell <= 2.9V) correct the drift
+// - the state is stored in nvs every 10 minutes and on corrections, so it survives resets
+#define SOC_MAGIC 0x534f4301          // "SOC" and layout version
+#define SOC_UNITS_PER_10MAH 3600000LL // charge unit is 10mA * ms
+#define SOC_FULL_MV 3450
+#define SOC_FULL_TAIL 200             // 10mA
+#define SOC_EMPTY_MV 2900
+
+typedef struct soc_store {
+    uint32_t magic;
+    uint32_t capacity;             // 10mAh
+    int64_t charge;                // in the battery, 10mA * ms
+    int64_t charge_in, charge_out; // counted, 10mA * ms
+    int64_t energy_in, energy_out; // counted, 10mV * 10mA * ms
+    int64_t drift;                 // charge correction at the last full or empty
+    uint32_t corrections;          // number of full or empty events
+} soc_store_t;
+
+soc_store_t soc = {0};
+int32_t soc_current = 0;     // 10mA, of the last sample
+int32_t soc_voltage = 0;     // 10mV, of the last sample
+int32_t soc_avg_current = 0; // 10mA << 4, smoothed for the time estimates
+uint32_t soc_sample_ms = 0;  // time of the last sample, 0: none yet
+const char *soc_source = "none";
+
+// State of charge in 0.1%, clamped to 0..1000
+int32_t soc_permille() {
+    if (!soc.capacity) {
+        return 0;
+    }
+    int64_t permille = soc.charge * 1000 / (soc.capacity * SOC_UNITS_PER_10MAH);
+    return permille < 0 ? 0 : permille > 1000 ? 1000 : permille;
+}
 
-    int len = snprintf(json, maxlen, jsonFmt, (char *)es3Information.wSerial,
-        data.wLoadOvp, data.wLoadUvp, data.wBatOvp, data.wBatOvB, data.wBatUvp, data.wBatUvB);
+// Seconds until full (charging) or empty (discharging) at the smoothed current, -1 if not applicable
+int32_t soc_seconds( bool to_full ) {
+    int32_t current = soc_avg_current >> 4;
+    if (!soc.capacity || (to_full ? current < 10 : current > -10)) {
+        return -1;
+    }
+    int64_t charge = to_full ? soc.capacity * SOC_UNITS_PER_10MAH - soc.charge : soc.charge;
+    return charge < 0 ? 0 : charge / (to_full ? current : -current) / 1000;
+}
 
-    return len < maxlen;
+void save_soc() {
+    if (replay_active) return;  // replayed samples, restored after the replay
+    Preferences prefs;
+    if (prefs.begin("soc")) {
+        prefs.putBytes("state", &soc, sizeof(soc));
+        prefs.end();
+    }
 }
 
+void setup_soc() {
+    Preferences prefs;
+    if (prefs.begin("soc", true)) {
+        soc_store_t stored;
+        if (prefs.getBytes("state", &stored, sizeof(stored)) == sizeof(stored) && stored.magic == SOC_MAGIC) {
+            soc = stored;
+        }
+        prefs.end();
+    }
+}
 
-ESmart3::ProParam_t es3ProParam = {0};
+// Set charge to full or empty if the cells say so, once per event
+void correct_soc( int32_t current ) {
+    static bool at_full = false;
+    static bool at_empty = false;
 
-// get protection parameters once every 10s
-void handle_es3ProParam() {
-    static const uint32_t interval = 10000;
-    static uint32_t prev = 0 - interval + 300;  // check at start + delay
+    if (!cell_stats.samples || !soc.capacity) {
+        return;
+    }
+    bool full = cell_stats.max >= SOC_FULL_MV && current >= 0 && current < SOC_FULL_TAIL;
+    bool empty = cell_stats.min <= SOC_EMPTY_MV && current <= 0;
+    if ((full && !at_full) || (empty && !at_empty)) {
+        int64_t target = full ? soc.capacity * SOC_UNITS_PER_10MAH : 0;
+        int32_t before = soc_permille();
+        soc.drift = target - soc.charge;
+        soc.charge = target;
+        soc.corrections++;
+        journal_write(JOURNAL_SOC, full, before);  // arg 1: full, 0: empty
+        save_soc();
+
+        char msg[80];
+        snprintf(msg, sizeof(msg), "SoC corrected to %s from %d.%d%%", full ? "full" : "empty", before / 10, before % 10);
+        slog(msg, LOG_NOTICE, LOG_CLASS_DATA);
+    }
+    at_full = full;
+    at_empty = empty;
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        ESmart3::ProParam_t data = {0};
-        if( esmart3.getProParam(data) ) {
-            if( memcmp(&data, &es3ProParam, sizeof(data) ) ) {
-                // values have changed: publish
-                static const char lineFmt[] =
-                    "ProParam,Serial=%8.8s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "LoadOvp=%u,"
-                    "LoadUvp=%u,"
-                    "BatOvp=%u,"
-                    "BatOvB=%u,"
-                    "BatUvp=%u,"
-                    "BatUvB=%u";
-                
-                es3ProParam = data;
-                json_ProParam(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/ProParam", msg);
+// Add charge and energy to the counters
+void add_soc( int64_t charge, int64_t energy ) {
+    soc.charge += charge;
+    if (charge >= 0) {
+        soc.charge_in += charge;
+    }
+    else {
+        soc.charge_out -= charge;
+    }
+    if (energy >= 0) {
+        soc.energy_in += energy;
+    }
+    else {
+        soc.energy_out -= energy;
+    }
+}
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)es3Information.wSerial, WiFi.getHostname(), 
-                    data.wLoadOvp, data.wLoadUvp, data.wBatOvp, data.wBatOvB, data.wBatUvp, data.wBatUvB);
-                postInflux(msg);
+// Count charge and energy since the previous sample
+void count_soc( const char *source, int32_t current, int32_t voltage, uint32_t now ) {
+    if (soc_sample_ms) {
+        int64_t dt = (int32_t)(now - soc_sample_ms);
+        if (dt > 0) {
+            if (strcmp(source, soc_source)) {
+                // BMS and charger measure differently: count the gap with the last current
+                // instead of mixing both sources in one trapezoid
+                add_soc((int64_t)soc_current * dt, (int64_t)soc_current * soc_voltage * dt);
+            }
+            else {
+                add_soc((int64_t)(soc_current + current) * dt / 2,
+                    ((int64_t)soc_current * soc_voltage + (int64_t)current * voltage) * dt / 2);
             }
         }
-        else {
-            slog("getProParam error", LOG_ERR);
-        }
+        soc_avg_current += current - (soc_avg_current >> 4);  // alpha 1/16
+    }
+    else {
+        soc_avg_current = current << 4;
     }
+    soc_source = source;
+    soc_current = current;
+    soc_voltage = voltage;
+    soc_sample_ms = now;
 }
 
+// Feed new BMS or charger samples into the coulomb counter
+void handle_soc() {
+    uint32_t bms_max_age = 5 * poll_state[STATE_STATUS].interval_ms / 2;  // prefer the BMS unless it missed two polls
+    static const uint32_t save_interval = 600000;
+    static uint32_t seen_status_ms = 0;
+    static uint32_t seen_chgsts_ms = 0;
+    static uint32_t saved_ms = 0;
 
-JbdBms::Hardware_t jbdHardware = {0};
+    const state_entry_t &status = device_state[STATE_STATUS];
+    const state_entry_t &chgsts = device_state[STATE_CHGSTS];
+    uint32_t now = millis();
 
-bool json_Hardware(char *json, size_t maxlen, JbdBms::Hardware_t data) {
-    static const char jsonFmt[] = "{\"Version\":" VERSION ",\"Id\":\"%.32s\"}";
-    int len = snprintf(json, maxlen, jsonFmt, data.id);
+    if (status.valid && status.read_ms != seen_status_ms) {
+        seen_status_ms = status.read_ms;
+        if (soc.magic != SOC_MAGIC) {
+            // nothing stored yet: start with the BMS estimate
+            soc = {};
+            soc.magic = SOC_MAGIC;
+            soc.charge = jbdStatus.remainingCapacity * SOC_UNITS_PER_10MAH;
+        }
+        if (jbdStatus.nominalCapacity) {
+            soc.capacity = jbdStatus.nominalCapacity;  // else keep the previous one
+        }
+        count_soc("BMS", jbdStatus.current, jbdStatus.voltage, status.read_ms);
+        correct_soc(jbdStatus.current);
+    }
+    else if (chgsts.valid && chgsts.read_ms != seen_chgsts_ms) {
+        seen_chgsts_ms = chgsts.read_ms;
+        if (soc.magic == SOC_MAGIC && !state_fresh(STATE_STATUS, bms_max_age)) {
+            // charger currents and voltage are in 100mA and 100mV
+            count_soc("Charger", ((int32_t)es3ChgSts.wChgCurr - es3ChgSts.wLoadCurr) * 10, es3ChgSts.wBatVolt * 10, chgsts.read_ms);
+        }
+    }
 
-    return len < maxlen;
+    if (soc.magic == SOC_MAGIC && now - saved_ms >= save_interval) {
+        saved_ms = now;
+        save_soc();
+    }
 }
 
+void write_SoC( ChunkWriter &out ) {
+    static const double ah = SOC_UNITS_PER_10MAH * 100.0;  // charge units per Ah
+    static const double wh = ah * 100.0;                   // energy units per Wh
+
+    int32_t permille = soc_permille();
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"SoC\":{"
+        "\"Source\":\"%s\",\"SoC\":%d.%d,\"Charge\":%.3f,\"Capacity\":%.2f,\"Current\":%.2f,"
+        "\"AhIn\":%.3f,\"AhOut\":%.3f,\"WhIn\":%.1f,\"WhOut\":%.1f,"
+        "\"TimeToFull\":%d,\"TimeToEmpty\":%d,\"Drift\":%.3f,\"Corrections\":%u}}",
+        WiFi.getHostname(), soc_source, permille / 10, permille % 10, soc.charge / ah, soc.capacity / 100.0,
+        soc_current / 100.0, soc.charge_in / ah, soc.charge_out / ah, soc.energy_in / wh, soc.energy_out / wh,
+        soc_seconds(true), soc_seconds(false), soc.drift / ah, (unsigned)soc.corrections);
+}
 
-void handle_jbdHardware() {
+// Publish the state of charge at most once a minute
+void publish_soc() {
+    static const char lineFmt[] =
+        "SoC,Host=%s,Version=" VERSION " "
+        "SoC=%d.%d,"
+        "Charge=%.3f,"
+        "AhIn=%.3f,"
+        "AhOut=%.3f,"
+        "WhIn=%.1f,"
+        "WhOut=%.1f,"
+        "TimeToFull=%d,"
+        "TimeToEmpty=%d";
+    static const double ah = SOC_UNITS_PER_10MAH * 100.0;
+    static const double wh = ah * 100.0;
     static const uint32_t interval = 60000;
-    static uint32_t prev = 0 - interval + 0;  // check at start first
+    static uint32_t prev = 0 - interval;
 
     uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        JbdBms::Hardware_t data = {0};
-        if (jbdbms.getHardware(data)) {
-            if (strncmp((const char *)data.id, (const char *)jbdHardware.id, sizeof(data.id))) {
-                // found a new/different JBD BMS
-                static const char lineFmt[] =
-                    "Hardware,Id=%.32s,Version=" VERSION " "
-                    "Host=\"%s\"";
+    if (!soc_sample_ms || now - prev < interval) {
+        return;
+    }
+    prev = now;
 
-                jbdHardware = data;
-                json_Hardware(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/Hardware", msg);
+    publish(MQTT_TOPIC "/json/SoC", write_SoC);  // streamed when sent
+    int32_t permille = soc_permille();
+    if (mqtt_fields) {
+        publish_field("SoC", "SoC", (long)permille);
+    }
+    postInfluxStreamed([permille](ChunkWriter &out) {
+        out.printf(lineFmt, WiFi.getHostname(), permille / 10, permille % 10, soc.charge / ah,
+            soc.charge_in / ah, soc.charge_out / ah, soc.energy_in / wh, soc.energy_out / wh,
+            soc_seconds(true), soc_seconds(false));
+    });
+}
 
-                snprintf(msg, sizeof(msg), lineFmt, (char *)data.id, WiFi.getHostname());
-                postInflux(msg);
-            }
+
+// Derived metrics correlating charger and BMS samples. A BMS sample is paired with the charger values
+// interpolated to its read time as soon as the next charger sample after it was read. Powers in mW, voltages in mV:
+// - Net: battery power measured by the BMS, positive when charging
+// - ChgIn: charger power as reported (ChgPower), ChgOut: charger output current at BMS voltage,
+//   Efficiency: ChgOut / ChgIn in 0.1% (-1 if the charger is idle)
+// - Load: load output current at BMS voltage
+// - Drop: charger minus BMS battery voltage, i.e. the drop on wires, fuses and shunt
+// - Self: current neither going to the loads nor into the battery (ESP, BMS and the charger itself) at BMS voltage
+#define DERIVED_MAX_GAP 2000   // ms, interpolate only between charger samples this close
+#define DERIVED_MAX_SKEW 1000  // ms, else use the nearest charger sample if it is this close
+// Both grow with the adaptive ChgSts interval, a sample per interval is as close as it gets
+uint32_t derived_max_gap() {
+    return max((uint32_t)DERIVED_MAX_GAP, 2 * poll_state[STATE_CHGSTS].interval_ms);  // interval may just have halved
+}
+
+uint32_t derived_max_skew() {
+    return max((uint32_t)DERIVED_MAX_SKEW, poll_state[STATE_CHGSTS].interval_ms);
+}
+
+typedef struct charger_sample {
+    uint32_t ms;
+    int32_t volt;             // 100mV
+    int32_t chg_curr;         // 100mA
+    int32_t load_curr;        // 100mA
+    int32_t chg_power;        // W
+} charger_sample_t;
+
+typedef struct derived {
+    int32_t net, chg_in, chg_out, load, self;  // mW
+    int32_t drop;                              // mV
+    int32_t efficiency;                        // 0.1%, -1: charger idle
+    uint32_t skew;                             // ms between BMS sample and the farther charger sample used
+} derived_t;
+
+derived_t derived = {0};      // last aligned sample
+derived_t derived_avg = {0};  // mean of the last publish interval
+uint32_t derived_samples = 0, derived_unaligned = 0;
+
+// Sums of the current publish interval
+int64_t derived_sum[6] = {0};  // net, chg_in, chg_out, load, self, drop
+int64_t derived_eff_sum = 0;
+uint32_t derived_count = 0, derived_eff_count = 0;
+
+int32_t interpolate( int32_t a, int32_t b, uint32_t ta, uint32_t tb, uint32_t t ) {
+    return tb == ta ? b : a + (int64_t)(b - a) * (int32_t)(t - ta) / (int32_t)(tb - ta);
+}
+
+// Combine BMS voltage (10mV) and current (10mA) with the aligned charger values
+void derive( int32_t bms_volt, int32_t bms_curr, const charger_sample_t &chg, uint32_t skew ) {
+    derived_t &d = derived;
+    d.net = bms_volt * bms_curr / 10;
+    d.chg_in = chg.chg_power * 1000;
+    d.chg_out = bms_volt * chg.chg_curr;
+    d.load = bms_volt * chg.load_curr;
+    d.self = bms_volt * ((chg.chg_curr - chg.load_curr) * 10 - bms_curr) / 10;
+    d.drop = chg.volt * 100 - bms_volt * 10;
+    d.efficiency = d.chg_in >= 1000 ? (int64_t)d.chg_out * 1000 / d.chg_in : -1;
+    d.skew = skew;
+    derived_samples++;
+
+    int32_t values[6] = { d.net, d.chg_in, d.chg_out, d.load, d.self, d.drop };
+    for (size_t i = 0; i < 6; i++) {
+        derived_sum[i] += values[i];
+    }
+    derived_count++;
+    if (d.efficiency >= 0) {
+        derived_eff_sum += d.efficiency;
+        derived_eff_count++;
+    }
+}
+
+// Align new BMS samples with the charger samples around them
+void handle_derived() {
+    static charger_sample_t chg[2] = {0};  // previous and last charger sample
+    static uint8_t chg_count = 0;
+    static uint32_t seen_status_ms = 0;
+    static uint32_t seen_chgsts_ms = 0;
+    static bool pending = false;           // BMS sample waits for the next charger sample
+    static uint32_t bms_ms = 0;
+    static int32_t bms_volt = 0, bms_curr = 0;
+
+    const state_entry_t &status = device_state[STATE_STATUS];
+    const state_entry_t &chgsts = device_state[STATE_CHGSTS];
+
+    if (status.valid && status.read_ms != seen_status_ms) {
+        seen_status_ms = status.read_ms;
+        if (pending) {
+            derived_unaligned++;  // previous one never saw a charger sample
+        }
+        pending = true;
+        bms_ms = status.read_ms;
+        bms_volt = jbdStatus.voltage;
+        bms_curr = jbdStatus.current;
+    }
+
+    if (chgsts.valid && chgsts.read_ms != seen_chgsts_ms) {
+        seen_chgsts_ms = chgsts.read_ms;
+        chg[0] = chg[1];
+        chg[1] = { chgsts.read_ms, es3ChgSts.wBatVolt, es3ChgSts.wChgCurr, es3ChgSts.wLoadCurr, es3ChgSts.wChgPower };
+        if (chg_count < 2) {
+            chg_count++;
+        }
+    }
+
+    if (!pending) {
+        return;
+    }
+    if (chg_count && (int32_t)(chg[1].ms - bms_ms) >= 0) {
+        pending = false;
+        uint32_t after = chg[1].ms - bms_ms;
+        uint32_t before = bms_ms - chg[0].ms;
+        if (chg_count == 2 && (int32_t)before >= 0 && chg[1].ms - chg[0].ms <= derived_max_gap()) {
+            const charger_sample_t &a = chg[0], &b = chg[1];
+            charger_sample_t at = { bms_ms,
+                interpolate(a.volt, b.volt, a.ms, b.ms, bms_ms),
+                interpolate(a.chg_curr, b.chg_curr, a.ms, b.ms, bms_ms),
+                interpolate(a.load_curr, b.load_curr, a.ms, b.ms, bms_ms),
+                interpolate(a.chg_power, b.chg_power, a.ms, b.ms, bms_ms) };
+            derive(bms_volt, bms_curr, at, max(before, after));
+        }
+        else if (after <= derived_max_skew()) {
+            derive(bms_volt, bms_curr, chg[1], after);
         }
         else {
-            slog("getHardware error", LOG_ERR);
+            derived_unaligned++;
         }
     }
+    else if (millis() - bms_ms > derived_max_gap()) {
+        pending = false;  // charger does not answer
+        derived_unaligned++;
+    }
 }
 
+void write_derived( ChunkWriter &out, const derived_t &d ) {
+    out.printf("{\"Net\":%d,\"ChgIn\":%d,\"ChgOut\":%d,\"Load\":%d,\"Self\":%d,\"Drop\":%d,\"Efficiency\":%d,\"Skew\":%u}",
+        d.net, d.chg_in, d.chg_out, d.load, d.self, d.drop, d.efficiency, (unsigned)d.skew);
+}
 
-JbdBms::Status_t jbdStatus = {0};
+void write_Derived( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Derived\":{\"Samples\":%u,\"Unaligned\":%u,\"Last\":",
+        WiFi.getHostname(), (unsigned)derived_samples, (unsigned)derived_unaligned);
+    write_derived(out, derived);
+    out.print(",\"Average\":");
+    write_derived(out, derived_avg);
+    out.print("}}");
+}
 
-bool json_Status(char *json, size_t maxlen, JbdBms::Status_t data) {
-    static const char jsonFmt[] =
-        "{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"Status\":{"
-        "\"voltage\":%u,"
-        "\"current\":%d,"
-        "\"remainingCapacity\":%u,"
-        "\"nominalCapacity\":%u,"
-        "\"cycles\":%u,"
-        "\"productionDate\":\"%04u-%02u-%02u\","
-        "\"balance\":\"%s\","
-        "\"fault\":%u,"
-        "\"version\":%u,"
-        "\"currentCapacity\":%u,"
-        "\"mosfetStatus\":%u,"
-        "\"cells\":%u,"
-        "\"ntcs\":%u,"
-        "\"temperatures\":%s]}}";
-    char temps[sizeof(data.temperatures)/sizeof(*data.temperatures) * 6 + 1] = "[";
-    int len = 0;
+// Publish the means of the derived metrics at most once a minute
+void publish_derived() {
+    static const char lineFmt[] =
+        "Derived,Host=%s,Version=" VERSION " "
+        "Net=%d,"
+        "ChgIn=%d,"
+        "ChgOut=%d,"
+        "Load=%d,"
+        "Self=%d,"
+        "Drop=%d,"
+        "Efficiency=%d,"
+        "Unaligned=%u";
+    static const uint32_t interval = 60000;
+    static uint32_t prev = 0 - interval;
 
-    for (size_t i = 0; i < data.ntcs && i < sizeof(data.temperatures)/sizeof(*data.temperatures) && len < sizeof(temps); i++) {
-        char *str = &temps[len];
-        len += snprintf(str, sizeof(temps) - len, ",%d", JbdBms::deciCelsius(data.temperatures[i]));
+    uint32_t now = millis();
+    if (!derived_count || now - prev < interval) {
+        return;
     }
-    temps[0] = '[';  // replace first comma
+    prev = now;
+
+    derived_t &a = derived_avg;
+    a.net = derived_sum[0] / derived_count;
+    a.chg_in = derived_sum[1] / derived_count;
+    a.chg_out = derived_sum[2] / derived_count;
+    a.load = derived_sum[3] / derived_count;
+    a.self = derived_sum[4] / derived_count;
+    a.drop = derived_sum[5] / derived_count;
+    a.efficiency = derived_eff_count ? derived_eff_sum / derived_eff_count : -1;
+    a.skew = 0;
+    memset(derived_sum, 0, sizeof(derived_sum));
+    derived_eff_sum = 0;
+    derived_count = derived_eff_count = 0;
+
+    publish(MQTT_TOPIC "/json/Derived", write_Derived);  // streamed when sent
+    if (mqtt_fields) {
+        publish_field("Derived", "Net", (long)a.net);
+        publish_field("Derived", "Self", (long)a.self);
+    }
+    postInfluxStreamed([&a](ChunkWriter &out) {
+        out.printf(lineFmt, WiFi.getHostname(), a.net, a.chg_in, a.chg_out, a.load, a.self, a.drop, a.efficiency,
+            (unsigned)derived_unaligned);
+    });
+}
 
-    if (len < sizeof(temps)) {
-        len = snprintf(json, maxlen, jsonFmt, jbdHardware.id,
-            data.voltage, data.current, data.remainingCapacity, data.nominalCapacity, data.cycles, 
-            JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate), 
-            JbdBms::balance(data), data.fault, data.version, 
-            data.currentCapacity, data.mosfetStatus, data.cells, data.ntcs, temps);
 
-        return len < maxlen;
+// Energy accounting independent of the charger log counters. Every charger sample integrates PV (ChgPower)
+// and Load (LoadPower), every BMS sample the battery energy in and out (V * I). Full hours are rolled up
+// into the hour, day and month rings, which are kept in nvs with the running hour every 10 minutes.
+#define ENERGY_MAGIC 0x454e4701          // "ENG" and layout version
+#define ENERGY_UNITS_PER_MWH 3600000LL   // accumulator unit is mW * ms
+#define ENERGY_HOURS 24
+#define ENERGY_DAYS 31
+#define ENERGY_MONTHS 12
+
+typedef enum { ENERGY_PV, ENERGY_LOAD, ENERGY_BAT_IN, ENERGY_BAT_OUT, ENERGY_CHANNELS } energy_channel_t;
+const char *const energy_channels[] = { "Pv", "Load", "BatIn", "BatOut" };
+
+typedef struct energy_bucket {
+    uint32_t start;                  // unix time of the period start, 0: unused
+    uint32_t mwh[ENERGY_CHANNELS];
+} energy_bucket_t;
+
+typedef struct energy_store {
+    uint32_t magic;
+    int64_t acc[ENERGY_CHANNELS];    // running hour, mW * ms
+    uint64_t total[ENERGY_CHANNELS]; // mWh of all closed hours
+    energy_bucket_t hour, day, month; // running periods, day and month sum up closed hours
+    energy_bucket_t hours[ENERGY_HOURS], days[ENERGY_DAYS], months[ENERGY_MONTHS];
+} energy_store_t;
+
+energy_store_t energy = {0};
+
+void save_energy() {
+    if (replay_active) return;  // replayed samples, restored after the replay
+    Preferences prefs;
+    if (prefs.begin("energy")) {
+        prefs.putBytes("state", &energy, sizeof(energy));
+        prefs.end();
     }
-    return false;
 }
 
+void setup_energy() {
+    Preferences prefs;
+    if (prefs.begin("energy", true)) {
+        if (prefs.getBytes("state", &energy, sizeof(energy)) != sizeof(energy) || energy.magic != ENERGY_MAGIC) {
+            energy = {};
+        }
+        prefs.end();
+    }
+    energy.magic = ENERGY_MAGIC;
+}
 
-void handle_jbdStatus() {
-    static const uint32_t interval = 6000;
-    static uint32_t prev = 0 - interval + 600;
+// Add power (mW) held between two samples, trapezoidal
+void energy_add( energy_channel_t channel, int32_t prev, int32_t curr, uint32_t dt ) {
+    energy.acc[channel] += ((int64_t)prev + curr) * dt / 2;
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        JbdBms::Status_t data = {0};
-        if (jbdbms.getStatus(data)) {
-            if (memcmp(&data, &jbdStatus, sizeof(data))) {
-                // some voltage has changed
-                static const char lineFmt[] =
-                    "Status,Id=%.32s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "voltage=%u,"
-                    "current=%d,"
-                    "remainingCapacity=%u,"
-                    "nominalCapacity=%u,"
-                    "cycles=%u,"
-                    "productionDate=\"%04u-%02u-%02u\","
-                    "balance=\"%s\","
-                    "fault=%u,"
-                    "version=%u,"
-                    "currentCapacity=%u,"
-                    "mosfetStatus=%u,"
-                    "cells=%u,"
-                    "ntcs=%u";
-
-                json_Status(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/Status", msg);
-                
-                if (jbdStatus.fault != data.fault) {
-                    publish(MQTT_TOPIC "/status/BMS", bits(data.fault, 13));        
-                }
+// Local start of the hour, day or month of t
+uint32_t energy_period( time_t t, char period ) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_sec = tm.tm_min = 0;
+    if (period != 'h') {
+        tm.tm_hour = 0;
+        if (period == 'm') {
+            tm.tm_mday = 1;
+        }
+    }
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
 
-                jbdStatus = data;
+// Close the running hour: add it to day, month and totals and move closed periods into their rings
+void energy_rollup( time_t now ) {
+    energy_bucket_t hour = { energy.hour.start };
+    for (size_t i = 0; i < ENERGY_CHANNELS; i++) {
+        int64_t mwh = energy.acc[i] / ENERGY_UNITS_PER_MWH;
+        energy.acc[i] -= mwh * ENERGY_UNITS_PER_MWH;  // keep the remainder for the next hour
+        hour.mwh[i] = mwh;
+        energy.day.mwh[i] += mwh;
+        energy.month.mwh[i] += mwh;
+        energy.total[i] += mwh;
+    }
+    energy.hours[(hour.start / 3600) % ENERGY_HOURS] = hour;
+
+    uint32_t day = energy_period(now, 'd');
+    if (energy.day.start != day) {
+        struct tm tm;
+        time_t start = energy.day.start;
+        localtime_r(&start, &tm);
+        energy.days[tm.tm_mday - 1] = energy.day;
+        energy.day = { day };
+    }
+    uint32_t month = energy_period(now, 'm');
+    if (energy.month.start != month) {
+        struct tm tm;
+        time_t start = energy.month.start;
+        localtime_r(&start, &tm);
+        energy.months[tm.tm_mon] = energy.month;
+        energy.month = { month };
+    }
 
-                size_t len = snprintf(msg, sizeof(msg), lineFmt, jbdHardware.id, WiFi.getHostname(), 
-                    data.voltage, data.current, data.remainingCapacity, data.nominalCapacity, data.cycles,
-                    JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate), 
-                    JbdBms::balance(data), data.fault, data.version,
-                    data.currentCapacity, data.mosfetStatus, data.cells, data.ntcs);
+    static const char lineFmt[] =
+        "Energy,Host=%s,Version=" VERSION ",Period=hour "
+        "Pv=%u,"
+        "Load=%u,"
+        "BatIn=%u,"
+        "BatOut=%u";
+    postInfluxStreamed([&hour](ChunkWriter &out) {
+        out.printf(lineFmt, WiFi.getHostname(), (unsigned)hour.mwh[ENERGY_PV], (unsigned)hour.mwh[ENERGY_LOAD],
+            (unsigned)hour.mwh[ENERGY_BAT_IN], (unsigned)hour.mwh[ENERGY_BAT_OUT]);
+    });
+}
 
-                for (size_t i = 0; i < sizeof(data.temperatures)/sizeof(*data.temperatures) && i < data.ntcs && len < sizeof(msg); i++) {
-                    char *str = &msg[len];
-                    len += snprintf(str, sizeof(msg) - len, ",temperature%u=%d", i+1, JbdBms::deciCelsius(data.temperatures[i]));
-                }
+// Integrate new samples and roll up the periods once the time is known
+void handle_energy( bool have_time ) {
+    static const uint32_t save_interval = 600000;
+    static uint32_t seen_status_ms = 0;
+    static uint32_t seen_chgsts_ms = 0;
+    static int32_t pv = 0, load = 0, bat = 0;  // mW of the previous samples
+    static uint32_t saved_ms = 0;
+
+    const state_entry_t &status = device_state[STATE_STATUS];
+    const state_entry_t &chgsts = device_state[STATE_CHGSTS];
+
+    if (chgsts.valid && chgsts.read_ms != seen_chgsts_ms) {
+        int32_t pv_now = es3ChgSts.wChgPower * 1000;
+        int32_t load_now = es3ChgSts.wLoadPower * 1000;
+        if (seen_chgsts_ms) {
+            uint32_t dt = chgsts.read_ms - seen_chgsts_ms;
+            energy_add(ENERGY_PV, pv, pv_now, dt);
+            energy_add(ENERGY_LOAD, load, load_now, dt);
+        }
+        seen_chgsts_ms = chgsts.read_ms;
+        pv = pv_now;
+        load = load_now;
+    }
+
+    if (status.valid && status.read_ms != seen_status_ms) {
+        int32_t bat_now = (int32_t)jbdStatus.voltage * jbdStatus.current / 10;  // 10mV * 10mA / 10 = mW
+        if (seen_status_ms) {
+            // split at the zero crossing would be exact, sign of each half is close enough
+            uint32_t dt = status.read_ms - seen_status_ms;
+            energy_add(ENERGY_BAT_IN, max(bat, 0), max(bat_now, 0), dt);
+            energy_add(ENERGY_BAT_OUT, max(-bat, 0), max(-bat_now, 0), dt);
+        }
+        seen_status_ms = status.read_ms;
+        bat = bat_now;
+    }
 
-                postInflux(msg);
+    uint32_t now_ms = millis();
+    if (have_time) {
+        time_t now = time(NULL);
+        uint32_t hour = now - now % 3600;
+        if (!energy.hour.start) {
+            // first known time: running energy belongs to this hour
+            energy.hour.start = hour;
+            if (!energy.day.start) {
+                energy.day.start = energy_period(now, 'd');
+                energy.month.start = energy_period(now, 'm');
             }
         }
-        else {
-            slog("getStatus error", LOG_ERR);
+        else if (energy.hour.start != hour) {
+            energy_rollup(now);
+            energy.hour.start = hour;
+            saved_ms = now_ms;
+            save_energy();
         }
     }
+
+    if (now_ms - saved_ms >= save_interval) {
+        saved_ms = now_ms;
+        save_energy();
+    }
 }
 
+void write_energy_bucket( ChunkWriter &out, const energy_bucket_t &bucket, const int64_t *acc, bool first ) {
+    out.printf("%s{\"Start\":%u", first ? "" : ",", (unsigned)bucket.start);
+    for (size_t i = 0; i < ENERGY_CHANNELS; i++) {
+        int64_t mwh = bucket.mwh[i] + (acc ? acc[i] / ENERGY_UNITS_PER_MWH : 0);
+        out.printf(",\"%s\":%.3f", energy_channels[i], mwh / 1000.0);
+    }
+    out.print("}");
+}
 
-JbdBms::Cells_t jbdCells = {0};
+// Write the used buckets of a ring, newest first
+void write_energy_ring( ChunkWriter &out, const char *name, const energy_bucket_t *ring, size_t count ) {
+    out.printf(",\"%s\":[", name);
+    uint32_t newer = UINT32_MAX;
+    bool first = true;
+    for (size_t n = 0; n < count; n++) {
+        // selection of the next older bucket keeps the ring order independent of the index scheme
+        const energy_bucket_t *next = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (ring[i].start && ring[i].start < newer && (!next || ring[i].start > next->start)) {
+                next = &ring[i];
+            }
+        }
+        if (!next) {
+            break;
+        }
+        write_energy_bucket(out, *next, 0, first);
+        newer = next->start;
+        first = false;
+    }
+    out.print("]");
+}
+
+// Energy in Wh: totals, running periods and the closed hours, days and months
+void write_Energy( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Energy\":{\"Total\":{", WiFi.getHostname());
+    for (size_t i = 0; i < ENERGY_CHANNELS; i++) {
+        uint64_t mwh = energy.total[i] + energy.acc[i] / ENERGY_UNITS_PER_MWH;
+        out.printf("%s\"%s\":%.3f", i ? "," : "", energy_channels[i], mwh / 1000.0);
+    }
+    out.print("},\"Hour\":");
+    write_energy_bucket(out, energy.hour, energy.acc, true);
+    out.print(",\"Day\":");
+    write_energy_bucket(out, energy.day, energy.acc, true);
+    out.print(",\"Month\":");
+    write_energy_bucket(out, energy.month, energy.acc, true);
+    write_energy_ring(out, "Hours", energy.hours, ENERGY_HOURS);
+    write_energy_ring(out, "Days", energy.days, ENERGY_DAYS);
+    write_energy_ring(out, "Months", energy.months, ENERGY_MONTHS);
+    out.print("}}");
+}
 
-bool json_Cells(char *json, size_t maxlen, JbdBms::Cells_t data) {
-    static const char jsonFmt[] = "{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"Cells\":%s]}";
-    char voltages[sizeof(data.voltages)/sizeof(*data.voltages) * 6 + 1] = "[";
-    int len = 0;
 
-    for (size_t i = 0; i < jbdStatus.cells && i < sizeof(data.voltages)/sizeof(*data.voltages) && len < sizeof(voltages); i++) {
-        char *str = &voltages[len];
-        len += snprintf(str, sizeof(voltages) - len, ",%u", data.voltages[i]);
+// Publish all field topics of known records, e.g. for a new broker session
+void publish_all_fields() {
+    if (es3Information.wSerial[0]) {
+        fields_ChgSts(es3ChgSts, 0);
     }
-    voltages[0] = '[';  // replace first comma
+    if (jbdHardware.id[0]) {
+        fields_Status(jbdStatus, 0);
+        fields_Cells(jbdCells, 0);
+    }
+}
 
-    if (len < sizeof(voltages)) {
-        len = snprintf(json, maxlen, jsonFmt, jbdHardware.id, voltages);
 
-        return len < maxlen;
+// Key names of the cbor records, published retained as MQTT_TOPIC/cbor/schema/<record>
+typedef struct cbor_schema { const char *record; const char *const *keys; size_t count; } cbor_schema_t;
+
+const cbor_schema_t cbor_schemas[] = {
+    { "Information", cborKeys_Information, CBOR_COUNT(cborKeys_Information) },
+    { "ChgSts", cborKeys_ChgSts, CBOR_COUNT(cborKeys_ChgSts) },
+    { "BatParam", cborKeys_BatParam, CBOR_COUNT(cborKeys_BatParam) },
+    { "Log", cborKeys_Log, CBOR_COUNT(cborKeys_Log) },
+    { "Parameters", cborKeys_Parameters, CBOR_COUNT(cborKeys_Parameters) },
+    { "LoadParam", cborKeys_LoadParam, CBOR_COUNT(cborKeys_LoadParam) },
+    { "ProParam", cborKeys_ProParam, CBOR_COUNT(cborKeys_ProParam) },
+    { "Hardware", cborKeys_Hardware, CBOR_COUNT(cborKeys_Hardware) },
+    { "Status", cborKeys_Status, CBOR_COUNT(cborKeys_Status) },
+    { "Cells", cborKeys_Cells, CBOR_COUNT(cborKeys_Cells) }
+};
+
+
+// Schema as json: map key n of the cbor record is the n-th entry of Keys
+bool json_CborSchema(char *json, size_t maxlen, const cbor_schema_t &schema) {
+    int len = snprintf(json, maxlen, "{\"Version\":" VERSION ",\"Record\":\"%s\",\"Keys\":[", schema.record);
+    for (size_t i = 0; i < schema.count && len < maxlen; i++) {
+        len += snprintf(&json[len], maxlen - len, "%s\"%s\"", i ? "," : "", schema.keys[i]);
     }
-    return false;
+    if (len < maxlen) {
+        len += snprintf(&json[len], maxlen - len, "]}");
+    }
+
+    return len < maxlen;
 }
 
 
-void handle_jbdCells() {
-    static const uint32_t interval = 6000;
-    static uint32_t prev = 0 - interval + 700;  // after handle_jbdStatus() so we have valid jbdStatus.cells
+void publish_cbor_schemas() {
+    for (auto &schema: cbor_schemas) {
+        char topic[OUTBOX_TOPIC_SIZE];
+        snprintf(topic, sizeof(topic), MQTT_TOPIC "/cbor/schema/%s", schema.record);
+        Lease msg(POOL_MQTT);
+        if (json_CborSchema(msg, msg.size(), schema)) {
+            publish(topic, msg, true);
+        }
+    }
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        JbdBms::Cells_t data = {0};
-        if (jbdbms.getCells(data)) {
-            if (memcmp(&data, &jbdCells, sizeof(data))) {
-                // some voltage has changed
-                static const char lineFmt[] =
-                    "Cells,Id=%.32s,Version=" VERSION " "
-                    "Host=\"%s\"";
 
-                jbdCells = data;
-                json_Cells(msg, sizeof(msg), data);
-                slog(msg);
-                publish(MQTT_TOPIC "/json/Cells", msg);
-
-                size_t len = snprintf(msg, sizeof(msg), lineFmt, jbdHardware.id, WiFi.getHostname());
-                for (size_t i=0; i < sizeof(data.voltages)/sizeof(*data.voltages) && len < sizeof(msg) && i < jbdStatus.cells; i++) {
-                    char *str = &msg[len];
-                    len += snprintf(str, sizeof(msg) - len, ",voltage%u=%u", i+1, data.voltages[i]);
-                }
-                postInflux(msg);
+// Command queue for control writes on the rs485 bus.
+// Web, mqtt and button handlers only submit and return. The loop executes queued commands 
+// before the routine polls, highest priority first, verifies the result by reading it back
+// and publishes result and latency as json on MQTT_TOPIC/cmd/result.
+#define COMMAND_SLOTS 8
+
+typedef enum { CMD_LOAD, CMD_MOSFETS } command_type_t;
+typedef enum { CMD_PRIO_NORMAL, CMD_PRIO_HIGH } command_prio_t;
+
+typedef struct command {
+    uint32_t id;            // sequence number, reported with the result
+    command_type_t type;
+    uint8_t value;          // load on/off or JbdBms::mosfet_t
+    command_prio_t prio;
+    const char *source;     // who submitted, e.g. "web"
+    uint32_t submit_ms;     // millis() at submit for latency
+} command_t;
+
+command_t commands[COMMAND_SLOTS];
+uint8_t command_count = 0;
+uint32_t command_id = 0;
+uint32_t commands_done = 0;      // executed and verified
+uint32_t commands_failed = 0;    // write or read back failed
+uint32_t commands_rejected = 0;  // queue was full
+portMUX_TYPE command_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Queue a command for the bus. Return its id or 0 if queue is full
+uint32_t submit_command( command_type_t type, uint8_t value, const char *source, command_prio_t prio = CMD_PRIO_NORMAL ) {
+    uint32_t id = 0;
+    portENTER_CRITICAL(&command_mux);
+    if (command_count < COMMAND_SLOTS) {
+        id = ++command_id;
+        commands[command_count++] = { id, type, value, prio, source, (uint32_t)millis() };
+    }
+    else {
+        commands_rejected++;
+    }
+    portEXIT_CRITICAL(&command_mux);
+    return id;
+}
+
+// Remove the oldest command with the highest priority from the queue
+bool next_command( command_t &cmd ) {
+    bool found = false;
+    portENTER_CRITICAL(&command_mux);
+    if (command_count) {
+        uint8_t best = 0;
+        for (uint8_t i = 1; i < command_count; i++) {
+            if (commands[i].prio > commands[best].prio) {
+                best = i;  // equal priority keeps the older one
+            }
+        }
+        cmd = commands[best];
+        memmove(&commands[best], &commands[best + 1], (command_count - best - 1) * sizeof(commands[0]));
+        command_count--;
+        found = true;
+    }
+    portEXIT_CRITICAL(&command_mux);
+    return found;
+}
+
+// Write the command to the device and read it back
+const char *execute_command( const command_t &cmd ) {
+    switch (cmd.type) {
+        case CMD_LOAD: {
+            bool on;
+            if (!set_load(cmd.value)) {
+                return "write failed";
             }
+            if (!esmart3.getLoad(on)) {
+                return "read back failed";
+            }
+            es3Load = on;
+            state_touch(STATE_LOAD);
+            return on == (bool)cmd.value ? "done" : "not applied";
+        }
+        case CMD_MOSFETS: {
+            JbdBms::Status_t status;
+            if (!jbdbms.setMosfetStatus((JbdBms::mosfet_t)cmd.value)) {
+                return "write failed";
+            }
+            if (!jbdbms.getStatus(status)) {
+                return "read back failed";
+            }
+            if (status.mosfetStatus != jbdStatus.mosfetStatus) {
+                journal_write(JOURNAL_MOSFETS, 1, status.mosfetStatus | jbdStatus.mosfetStatus << 8);  // arg 1: by command
+            }
+            jbdStatus.mosfetStatus = status.mosfetStatus;
+            return status.mosfetStatus == cmd.value ? "done" : "not applied";
+        }
+    }
+    return "unknown command";
+}
+
+// Execute all queued commands, called before the routine polls
+void handle_commands() {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Command\":{"
+        "\"Id\":%u,"
+        "\"Type\":\"%s\","
+        "\"Value\":%u,"
+        "\"Source\":\"%s\","
+        "\"Result\":\"%s\","
+        "\"LatencyMs\":%u}}";
+    static const char *types[] = { "Load", "Mosfets" };
+
+    command_t cmd;
+    while (next_command(cmd)) {
+        const char *result = execute_command(cmd);
+        uint32_t latency = millis() - cmd.submit_ms;
+        bool ok = strcmp(result, "done") == 0;
+        if (ok) {
+            commands_done++;
         }
         else {
-            slog("getCells error", LOG_ERR);
+            commands_failed++;
+        }
+
+        Lease msg(POOL_SYSTEM);
+        if (msg.ok()) {
+            snprintf(msg, msg.size(), jsonFmt, WiFi.getHostname(), (unsigned)cmd.id, types[cmd.type], cmd.value, 
+                cmd.source, result, (unsigned)latency);
+            publish(MQTT_TOPIC "/cmd/result", msg);
+            slog(msg, ok ? LOG_INFO : LOG_ERR, LOG_CLASS_CMD);
         }
     }
 }
 
 
-// Copy verbose error status string into msg
-// Return length of message (ends in ' ...' if cut due to msg_size too small)
-size_t decode_error( char *msg, size_t msg_size ) {
-    char *endp = msg + msg_size;
-    char *cursor = msg;  // cursor position in msg
+// Rule engine for local load and mosfet control without a round trip through home automation.
+// Syntax: <var> <op> <value> [and <var> <op> <value>] [for <seconds>] [hyst <delta>] then <action>
+//   var: one of rule_vars in device units, op: < or > or & (any of the bits set)
+//   action: load on|off, charge on|off, discharge on|off
+//   e.g. "MinCell < 3000 for 30 hyst 100 then load off" or "BmsFault & 0x1ff then load off"
+// A rule is evaluated whenever a record it uses was read. Once all conditions held for the given time,
+// the action is queued with high priority. The rule rearms when a condition is missed by more than hyst.
+
+#define RULE_SLOTS 8
+#define RULE_CONDS 2
+#define RULE_TEXT_SIZE 96
+#define RULE_HITS 16
+
+// Lowest or highest cell voltage in mV
+uint16_t cell_voltage( bool highest ) {
+    size_t cells = min((size_t)jbdStatus.cells, sizeof(jbdCells.voltages)/sizeof(*jbdCells.voltages));
+    uint16_t result = cells ? jbdCells.voltages[0] : 0;
+    for (size_t i = 1; i < cells; i++) {
+        if (highest ? jbdCells.voltages[i] > result : jbdCells.voltages[i] < result) {
+            result = jbdCells.voltages[i];
+        }
+    }
+    return result;
+}
+
+typedef struct rule_var {
+    const char *name;
+    state_item_t item;  // record the value is taken from
+    int32_t (*get)();
+} rule_var_t;
+
+const rule_var_t rule_vars[] = {
+    { "PvVolt",          STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wPvVolt; } },
+    { "BatVolt",         STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wBatVolt; } },
+    { "ChgCurr",         STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wChgCurr; } },
+    { "ChgPower",        STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wChgPower; } },
+    { "LoadCurr",        STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wLoadCurr; } },
+    { "LoadPower",       STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wLoadPower; } },
+    { "BatTemp",         STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wBatTemp; } },
+    { "ChgFault",        STATE_CHGSTS, []() -> int32_t { return es3ChgSts.wFault; } },
+    { "voltage",         STATE_STATUS, []() -> int32_t { return jbdStatus.voltage; } },
+    { "current",         STATE_STATUS, []() -> int32_t { return jbdStatus.current; } },
+    { "currentCapacity", STATE_STATUS, []() -> int32_t { return jbdStatus.currentCapacity; } },  // SoC in %
+    { "BmsFault",        STATE_STATUS, []() -> int32_t { return jbdStatus.fault; } },
+    { "SoC",             STATE_STATUS, []() -> int32_t { return soc_permille(); } },  // coulomb counter in 0.1%
+    { "MinCell",         STATE_CELLS,  []() -> int32_t { return cell_voltage(false); } },
+    { "MaxCell",         STATE_CELLS,  []() -> int32_t { return cell_voltage(true); } },
+    { "CellSpread",      STATE_CELLS,  []() -> int32_t { return cell_voltage(true) - cell_voltage(false); } },
+};
+
+typedef enum { RULE_LOAD_ON, RULE_LOAD_OFF, RULE_CHARGE_ON, RULE_CHARGE_OFF, RULE_DISCHARGE_ON, RULE_DISCHARGE_OFF } rule_action_t;
+const char *const rule_actions[] = { "load on", "load off", "charge on", "charge off", "discharge on", "discharge off" };
+
+typedef struct rule_cond {
+    uint8_t var;    // index into rule_vars
+    char op;        // '<', '>' or '&'
+    int32_t value;  // threshold
+} rule_cond_t;
+
+typedef struct rule {
+    bool used;
+    uint8_t conds;                // number of conditions, all must hold
+    rule_cond_t cond[RULE_CONDS];
+    uint32_t hold_ms;             // conditions must hold this long
+    int32_t hyst;                 // release distance from threshold
+    rule_action_t action;
+    uint32_t items;               // bit mask of records used
+    bool holding;                 // conditions hold since since_ms
+    uint32_t since_ms;
+    bool fired;                   // action queued, waiting for release
+    uint32_t hits;
+    char text[RULE_TEXT_SIZE];
+} rule_t;
+
+typedef struct rule_hit {
+    time_t time;
+    uint8_t slot;
+    int32_t values[RULE_CONDS];
+} rule_hit_t;
+
+rule_t rules[RULE_SLOTS];
+rule_hit_t rule_hits[RULE_HITS];  // ring of recent hits
+uint32_t rule_hit_count = 0;
+uint32_t rules_eval_us = 0;       // duration of last evaluation
+uint32_t rules_eval_max_us = 0;   // longest evaluation
+const uint32_t rule_max_age = 60000;  // values older than this ms don't satisfy or release a rule
+
+// Parse rule text. Return false on syntax error
+bool parse_rule( const char *text, rule_t &rule ) {
+    char buf[RULE_TEXT_SIZE];
+    char *tok[16];
+    size_t n = 0;
+    char *save;
+    snprintf(buf, sizeof(buf), "%s", text);
+    for (char *t = strtok_r(buf, " ", &save); t && n < sizeof(tok)/sizeof(*tok); t = strtok_r(NULL, " ", &save)) {
+        tok[n++] = t;
+    }
 
-    if (es3ChgSts.wFault) {
-        if (es3ChgSts.wFault &0b0000000001 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "Battery over voltage");
+    rule = {};
+    size_t i = 0;
+    do {
+        if (i + 3 > n || rule.conds == RULE_CONDS) {
+            return false;
+        }
+        rule_cond_t &cond = rule.cond[rule.conds++];
+        size_t var = 0;
+        while (var < sizeof(rule_vars)/sizeof(*rule_vars) && strcasecmp(rule_vars[var].name, tok[i])) {
+            var++;
         }
-        if (es3ChgSts.wFault &0b0000000010 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "PV over voltage");
+        char *end;
+        cond.value = strtol(tok[i + 2], &end, strncasecmp(tok[i + 2], "0x", 2) ? 10 : 16);  // hex for bit masks
+        if (var == sizeof(rule_vars)/sizeof(*rule_vars) || !strchr("<>&", *tok[i + 1]) || tok[i + 1][1] || *end) {
+            return false;
         }
-        if (es3ChgSts.wFault &0b0000000100 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "Charge over current");
+        cond.var = var;
+        cond.op = *tok[i + 1];
+        rule.items |= 1 << rule_vars[var].item;
+        i += 3;
+    } while (i < n && strcasecmp(tok[i], "and") == 0 && ++i);
+
+    if (i + 1 < n && strcasecmp(tok[i], "for") == 0) {
+        char *end;
+        unsigned long secs = strtoul(tok[i + 1], &end, 10);  // would wrap a leading '-' to huge
+        if (!isdigit(*tok[i + 1]) || *end || secs > 86400) {
+            return false;
+        }
+        rule.hold_ms = secs * 1000;
+        i += 2;
+    }
+    if (i + 1 < n && strcasecmp(tok[i], "hyst") == 0) {
+        char *end;
+        rule.hyst = strtol(tok[i + 1], &end, 10);
+        if (end == tok[i + 1] || *end) {
+            return false;
+        }
+        i += 2;
+    }
+    if (i + 3 != n || strcasecmp(tok[i], "then")) {
+        return false;
+    }
+    char action[16];
+    snprintf(action, sizeof(action), "%s %s", tok[i + 1], tok[i + 2]);
+    for (size_t a = 0; a < sizeof(rule_actions)/sizeof(*rule_actions); a++) {
+        if (strcasecmp(rule_actions[a], action) == 0) {
+            rule.action = (rule_action_t)a;
+            rule.used = true;
+            snprintf(rule.text, sizeof(rule.text), "%s", text);
+            return true;
         }
-        if (es3ChgSts.wFault &0b0000001000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "Discharge over current");
+    }
+    return false;
+}
+
+// Queue the action of a rule
+void fire_rule( uint8_t slot, rule_t &rule ) {
+    uint8_t mosfets = jbdStatus.mosfetStatus;
+    if (!replay_active) {  // replayed samples must not switch the island
+        switch (rule.action) {
+            case RULE_LOAD_ON:       submit_command(CMD_LOAD, true, "rule", CMD_PRIO_HIGH); break;
+            case RULE_LOAD_OFF:      submit_command(CMD_LOAD, false, "rule", CMD_PRIO_HIGH); break;
+            case RULE_CHARGE_ON:     submit_command(CMD_MOSFETS, mosfets | JbdBms::MOSFET_CHARGE, "rule", CMD_PRIO_HIGH); break;
+            case RULE_CHARGE_OFF:    submit_command(CMD_MOSFETS, mosfets & ~JbdBms::MOSFET_CHARGE, "rule", CMD_PRIO_HIGH); break;
+            case RULE_DISCHARGE_ON:  submit_command(CMD_MOSFETS, mosfets | JbdBms::MOSFET_DISCHARGE, "rule", CMD_PRIO_HIGH); break;
+            case RULE_DISCHARGE_OFF: submit_command(CMD_MOSFETS, mosfets & ~JbdBms::MOSFET_DISCHARGE, "rule", CMD_PRIO_HIGH); break;
         }
-        if (es3ChgSts.wFault &0b0000010000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "Battery temperature alarm");
+    }
+    rule.hits++;
+
+    rule_hit_t &hit = rule_hits[rule_hit_count++ % RULE_HITS];
+    hit.time = time(NULL);
+    hit.slot = slot;
+    for (uint8_t c = 0; c < RULE_CONDS; c++) {
+        hit.values[c] = c < rule.conds ? rule_vars[rule.cond[c].var].get() : 0;
+    }
+
+    char text[RULE_TEXT_SIZE + 24];
+    snprintf(text, sizeof(text), "Rule %u hit: %s", slot, rule.text);
+    slog(text, LOG_NOTICE, LOG_CLASS_CMD);
+}
+
+// Check one rule against the current values
+void evaluate_rule( uint8_t slot, rule_t &rule, uint32_t now ) {
+    bool hold = true;
+    bool release = false;
+    for (uint8_t c = 0; c < rule.conds; c++) {
+        const rule_cond_t &cond = rule.cond[c];
+        const rule_var_t &var = rule_vars[cond.var];
+        if (!state_fresh(var.item, rule_max_age)) {
+            hold = false;  // unknown value neither holds nor releases
+            continue;
         }
-        if (es3ChgSts.wFault &0b0000100000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "Internal temperature alarm");
+        int32_t value = var.get();
+        if (cond.op == '<') {
+            hold = hold && value < cond.value;
+            release = release || value >= cond.value + rule.hyst;
         }
-        if (es3ChgSts.wFault &0b0001000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "PV low voltage");
+        else if (cond.op == '&') {
+            hold = hold && (value & cond.value);
+            release = release || !(value & cond.value);
         }
-        if (es3ChgSts.wFault &0b0010000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "Battery low voltage");
+        else {
+            hold = hold && value > cond.value;
+            release = release || value <= cond.value - rule.hyst;
         }
-        if (es3ChgSts.wFault &0b0100000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "Trip zero protection trigger");
+    }
+
+    if (rule.fired) {
+        rule.fired = !release;
+    }
+    else if (!hold) {
+        rule.holding = false;
+    }
+    else if (!rule.holding) {
+        rule.holding = true;
+        rule.since_ms = now;
+    }
+    if (!rule.fired && rule.holding && now - rule.since_ms >= rule.hold_ms) {
+        rule.holding = false;
+        rule.fired = true;
+        fire_rule(slot, rule);
+    }
+}
+
+// Evaluate rules that use records read since the last call
+void handle_rules() {
+    static uint32_t seen_ms[STATE_ITEMS] = {0};
+
+    uint32_t updated = 0;
+    for (size_t i = 0; i < STATE_ITEMS; i++) {
+        if (device_state[i].valid && device_state[i].read_ms != seen_ms[i]) {
+            seen_ms[i] = device_state[i].read_ms;
+            updated |= 1 << i;
         }
-        if (es3ChgSts.wFault &0b1000000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "CHG: %s<br/>\n", "In the control of manual switchgear");
+    }
+    if (!updated) {
+        return;
+    }
+
+    uint32_t start = micros();
+    uint32_t now = millis();
+    for (uint8_t slot = 0; slot < RULE_SLOTS; slot++) {
+        if (rules[slot].used && (rules[slot].items & updated)) {
+            evaluate_rule(slot, rules[slot], now);
         }
     }
+    rules_eval_us = micros() - start;
+    if (rules_eval_us > rules_eval_max_us) {
+        rules_eval_max_us = rules_eval_us;
+    }
+}
 
-    if (jbdStatus.fault) {
-        if (jbdStatus.fault &0b0000000000001 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Cell block over voltage");
+// Set rule in slot from text, or delete it if text is empty. Store it in nvs
+bool set_rule( uint8_t slot, const char *text ) {
+    rule_t rule = {};
+    if (slot >= RULE_SLOTS || (*text && !parse_rule(text, rule))) {
+        return false;
+    }
+    rules[slot] = rule;
+
+    Preferences prefs;
+    char key[4];
+    snprintf(key, sizeof(key), "r%u", slot);
+    if (prefs.begin("rules")) {
+        if (*text) {
+            prefs.putString(key, text);
         }
-        if (jbdStatus.fault &0b0000000000010 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Cell block under voltage");
+        else {
+            prefs.remove(key);
         }
-        if (jbdStatus.fault &0b0000000000100 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Battery over voltage");
+        prefs.end();
+    }
+    return true;
+}
+
+// Set rule from "<slot> [<rule text>]"
+bool set_rule( const char *arg ) {
+    char *text;
+    unsigned long slot = strtoul(arg, &text, 10);
+    if (!isdigit(*arg) || slot >= RULE_SLOTS || (*text && *text != ' ')) {
+        return false;  // check before narrowing to the uint8_t slot
+    }
+    while (*text == ' ') {
+        text++;
+    }
+    return set_rule(slot, text);
+}
+
+// Load stored rules
+void setup_rules() {
+    Preferences prefs;
+    if (prefs.begin("rules", true)) {
+        for (uint8_t slot = 0; slot < RULE_SLOTS; slot++) {
+            char key[4];
+            char text[RULE_TEXT_SIZE];
+            snprintf(key, sizeof(key), "r%u", slot);
+            if (prefs.isKey(key) && prefs.getString(key, text, sizeof(text)) && !parse_rule(text, rules[slot])) {
+                char msg[RULE_TEXT_SIZE + 32];
+                snprintf(msg, sizeof(msg), "Ignore invalid rule %u: %s", slot, text);
+                slog(msg, LOG_WARNING, LOG_CLASS_CMD);
+            }
         }
-        if (jbdStatus.fault &0b0000000001000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Battery under voltage");
+        prefs.end();
+    }
+}
+
+// Rules with state and the recent hits
+void write_Rules( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Rules\":{\"EvalUs\":%u,\"EvalMaxUs\":%u,\"Slots\":[",
+        WiFi.getHostname(), (unsigned)rules_eval_us, (unsigned)rules_eval_max_us);
+    bool first = true;
+    for (uint8_t slot = 0; slot < RULE_SLOTS; slot++) {
+        const rule_t &rule = rules[slot];
+        if (rule.used) {
+            out.printf("%s{\"Slot\":%u,\"Rule\":\"%s\",\"Holding\":%s,\"Fired\":%s,\"Hits\":%u}", first ? "" : ",",
+                slot, rule.text, rule.holding ? "true" : "false", rule.fired ? "true" : "false", (unsigned)rule.hits);
+            first = false;
         }
-        if (jbdStatus.fault &0b0000000010000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Charging over temperature");
+    }
+    out.print("],\"Hits\":[");
+    uint32_t count = min(rule_hit_count, (uint32_t)RULE_HITS);
+    for (uint32_t i = 0; i < count; i++) {
+        const rule_hit_t &hit = rule_hits[(rule_hit_count - 1 - i) % RULE_HITS];  // newest first
+        out.printf("%s{\"Time\":%u,\"Slot\":%u,\"Values\":[%d,%d]}", i ? "," : "", 
+            (unsigned)hit.time, hit.slot, (int)hit.values[0], (int)hit.values[1]);
+    }
+    out.print("]}}");
+}
+
+
+// Fast path for fault bit transitions: re-poll the affected device, let the rules react and 
+// execute their commands at once, then publish the event ahead of queued telemetry
+uint32_t fault_events = 0;          // handled transitions
+uint32_t fault_max_latency_ms = 0;  // longest time from detection to executed actions
+
+void handle_faults() {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Fault\":{"
+        "\"Source\":\"%s\","
+        "\"Bits\":%u,"
+        "\"Prev\":%u,"
+        "\"Set\":%u,"
+        "\"Cleared\":%u,"
+        "\"Confirmed\":%s,"
+        "\"Actions\":%u,"
+        "\"LatencyMs\":%u,"
+        "\"Faults\":";
+    static const char lineFmt[] =
+        "Fault,Host=%s,Version=" VERSION ",Source=%s "
+        "Bits=\"%s\","
+        "LatencyMs=%u,"
+        "Text=\"";
+
+    fault_state_t events[FAULT_SOURCES];
+    uint32_t latencies[FAULT_SOURCES] = { UINT32_MAX, UINT32_MAX };  // UINT32_MAX: no event
+    bool handled = false;
+    for (size_t source = 0; source < FAULT_SOURCES; source++) {
+        fault_state_t &fault = fault_state[source];
+        if (!fault.pending) {
+            continue;
         }
-        if (jbdStatus.fault &0b0000000100000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Charging low temperature");
+        fault_state_t event = fault;
+        fault.pending = false;
+
+        // a new transition seen by the re-poll is handled on the next call
+        uint32_t current;
+        if (source == FAULT_CHARGER) {
+            handle_es3ChgSts();
+            current = es3ChgSts.wFault;
         }
-        if (jbdStatus.fault &0b0000001000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Discharging over temperature");
+        else {
+            handle_jbdStatus();
+            handle_jbdCells();
+            current = jbdStatus.fault;
         }
-        if (jbdStatus.fault &0b0000010000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Discharging low temperature");
+
+        uint32_t executed = commands_done + commands_failed;
+        handle_rules();
+        handle_commands();
+        executed = commands_done + commands_failed - executed;
+        uint32_t latency = millis() - event.detect_ms;
+        if (latency > fault_max_latency_ms) {
+            fault_max_latency_ms = latency;
         }
-        if (jbdStatus.fault &0b0000100000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Charging over current");
+        fault_events++;
+        journal_write(JOURNAL_FAULT, source, event.bits | event.prev << 16);
+
+        const fault_table_t &table = source == FAULT_CHARGER ? es3_fault_table : jbd_fault_table;
+        char topic[OUTBOX_TOPIC_SIZE];
+        snprintf(topic, sizeof(topic), MQTT_TOPIC "/fault/%s", event.name);
+        Lease msg(POOL_SYSTEM);
+        if (msg.ok()) {
+            BufferWriter out(msg, msg.size());
+            out.printf(jsonFmt, WiFi.getHostname(), event.name, (unsigned)event.bits, (unsigned)event.prev, 
+                (unsigned)(event.bits & ~event.prev), (unsigned)(event.prev & ~event.bits), 
+                current == event.bits ? "true" : "false", (unsigned)executed, (unsigned)latency);
+            write_faults_json(out, table, event.bits);
+            out.print("}}");
+            out.finish();
+            publish_urgent(topic, msg, false, true);  // an event: a second transition must not replace the first
+            slog(msg, LOG_WARNING, LOG_CLASS_SYSTEM);
         }
-        if (jbdStatus.fault &0b0001000000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Discharging over current");
+        events[source] = event;
+        latencies[source] = latency;
+        handled = true;
+    }
+
+    if (handled && mqtt.connected()) {
+        drain_outbox(FAULT_SOURCES);  // urgent events go first
+    }
+
+    // database last, it is the slowest output
+    for (size_t source = 0; handled && source < FAULT_SOURCES; source++) {
+        if (latencies[source] != UINT32_MAX) {
+            const fault_state_t &event = events[source];
+            uint32_t latency = latencies[source];
+            const fault_table_t &table = source == FAULT_CHARGER ? es3_fault_table : jbd_fault_table;
+            postInfluxStreamed([&](ChunkWriter &out) {
+                out.printf(lineFmt, WiFi.getHostname(), event.name, fault_bits(table, event.bits).str, (unsigned)latency);
+                write_faults_line(out, table, event.bits);
+                out.print("\"");
+            });
         }
-        if (jbdStatus.fault &0b0010000000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Short circuit");
+    }
+}
+
+
+// Heap and buffer pool metrics to verify that the steady state does not allocate
+#include <esp_timer.h>
+
+uint32_t heap_setup = 0;  // free heap at end of setup
+
+// Snapshot of the metrics, so both passes of a streamed payload see the same values
+typedef struct metrics {
+    uint32_t uptime;         // s since boot
+    uint32_t heap_free;
+    uint32_t heap_min_free;  // low watermark since boot
+    uint32_t heap_max_block; // largest allocatable block
+    uint16_t pool_used;
+    pool_stats_t pool[POOL_USERS];
+    uint32_t outbox_sent, outbox_coalesced, outbox_dropped;
+    uint32_t commands_done, commands_failed, commands_rejected;
+    uint32_t fault_events, fault_max_latency_ms;
+    int32_t polls_saved, bus_ms_saved;
+    uint32_t cpu_idle;       // % of the time loop() slept since the previous snapshot
+    uint32_t loops;          // loop() runs since the previous snapshot
+    uint32_t loop_us;        // average awake time per loop since the previous snapshot
+    uint32_t overhead_us;    // of that, average time not spent in tasks
+} metrics_t;
+
+metrics_t metrics;
+
+void take_metrics() {
+    metrics.uptime = millis() / 1000;
+    metrics.heap_free = ESP.getFreeHeap();
+    metrics.heap_min_free = ESP.getMinFreeHeap();
+    metrics.heap_max_block = ESP.getMaxAllocHeap();
+    portENTER_CRITICAL(&pool_mux);
+    metrics.pool_used = __builtin_popcount(pool_used);
+    memcpy(metrics.pool, pool_stats, sizeof(metrics.pool));
+    portEXIT_CRITICAL(&pool_mux);
+    metrics.outbox_sent = outbox_sent;
+    metrics.outbox_coalesced = outbox_coalesced;
+    metrics.outbox_dropped = outbox_dropped;
+    metrics.commands_done = commands_done;
+    metrics.commands_failed = commands_failed;
+    metrics.commands_rejected = commands_rejected;
+    metrics.fault_events = fault_events;
+    metrics.fault_max_latency_ms = fault_max_latency_ms;
+    static uint64_t prev_idle_us = 0;
+    static int64_t prev_us = 0;
+    int64_t now_us = esp_timer_get_time();
+    metrics.cpu_idle = now_us > prev_us ? (idle_us - prev_idle_us) * 100 / (now_us - prev_us) : 0;
+    prev_idle_us = idle_us;
+    prev_us = now_us;
+    static uint32_t prev_loops = 0;
+    static uint64_t prev_awake_us = 0, prev_overhead_us = 0;
+    metrics.loops = loop_count - prev_loops;
+    metrics.loop_us = metrics.loops ? (loop_awake_us - prev_awake_us) / metrics.loops : 0;
+    metrics.overhead_us = metrics.loops ? (loop_overhead_us - prev_overhead_us) / metrics.loops : 0;
+    prev_loops = loop_count;
+    prev_awake_us = loop_awake_us;
+    prev_overhead_us = loop_overhead_us;
+    metrics.polls_saved = metrics.bus_ms_saved = 0;
+    for (size_t i = 0; i < STATE_ITEMS; i++) {
+        int32_t polls, bus_ms;
+        poll_savings((state_item_t)i, polls, bus_ms);
+        metrics.polls_saved += polls;
+        metrics.bus_ms_saved += bus_ms;
+    }
+}
+
+void write_Metrics( ChunkWriter &out ) {
+    const metrics_t &m = metrics;
+    unsigned fragmentation = m.heap_free ? 100 - (unsigned)((uint64_t)m.heap_max_block * 100 / m.heap_free) : 0;
+
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Metrics\":{\"Uptime\":%u,\"CpuIdle\":%u,\"CpuMhz\":%u,",
+        WiFi.getHostname(), (unsigned)m.uptime, (unsigned)m.cpu_idle, (unsigned)getCpuFrequencyMhz());
+    out.printf("\"Heap\":{\"Free\":%u,\"MinFree\":%u,\"MaxBlock\":%u,\"Fragmentation\":%u,\"SetupFree\":%u},",
+        (unsigned)m.heap_free, (unsigned)m.heap_min_free, (unsigned)m.heap_max_block, fragmentation, (unsigned)heap_setup);
+    out.printf("\"Pool\":{\"Buffers\":%u,\"Used\":%u,\"Peak\":%u", POOL_BUFFERS, m.pool_used, pool_peak);
+    for (auto &stats: m.pool) {
+        out.printf(",\"%s\":{\"Leases\":%u,\"Peak\":%u,\"Failed\":%u}",
+            stats.name, (unsigned)stats.count, stats.peak, (unsigned)stats.failed);
+    }
+    out.printf("},\"Outbox\":{\"Sent\":%u,\"Coalesced\":%u,\"Dropped\":%u}",
+        (unsigned)m.outbox_sent, (unsigned)m.outbox_coalesced, (unsigned)m.outbox_dropped);
+    out.printf(",\"Commands\":{\"Done\":%u,\"Failed\":%u,\"Rejected\":%u}",
+        (unsigned)m.commands_done, (unsigned)m.commands_failed, (unsigned)m.commands_rejected);
+    out.printf(",\"Faults\":{\"Events\":%u,\"MaxLatencyMs\":%u}",
+        (unsigned)m.fault_events, (unsigned)m.fault_max_latency_ms);
+    out.printf(",\"Polling\":{\"Saved\":%d,\"BusMsSaved\":%d}", m.polls_saved, m.bus_ms_saved);
+    out.printf(",\"Loop\":{\"Loops\":%u,\"AwakeUs\":%u,\"OverheadUs\":%u}}}",
+        (unsigned)m.loops, (unsigned)m.loop_us, (unsigned)m.overhead_us);
+}
+
+// Adaptive poll intervals and their savings per record
+void write_Polling( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Polling\":{\"Night\":%s,\"Charging\":%s,\"BatteryIdle\":%s",
+        WiFi.getHostname(), op_night ? "true" : "false", op_charging ? "true" : "false", op_battery_idle ? "true" : "false");
+    for (size_t i = 0; i < STATE_ITEMS; i++) {
+        const poll_entry_t &entry = poll_state[i];
+        if (entry.base_ms) {
+            int32_t polls, bus_ms;
+            poll_savings((state_item_t)i, polls, bus_ms);
+            out.printf(",\"%s\":{\"Interval\":%u,\"Limit\":%u,\"Polls\":%u,\"Changes\":%u,\"Errors\":%u,\"BusMs\":%u,\"Saved\":%d,\"BusMsSaved\":%d}",
+                device_state[i].name, (unsigned)entry.interval_ms, (unsigned)max(poll_limit((state_item_t)i), entry.min_ms),
+                (unsigned)entry.polls, (unsigned)entry.changes, (unsigned)entry.errors, (unsigned)(entry.bus_us / 1000), polls, bus_ms);
         }
-        if (jbdStatus.fault &0b0100000000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "Frontend IC error");
+    }
+    out.print("}}");
+}
+
+
+// Report metrics periodically
+void handle_metrics() {
+    static const char lineFmt[] =
+        "Metrics,Host=%s,Version=" VERSION " "
+        "HeapFree=%u,"
+        "HeapMinFree=%u,"
+        "HeapMaxBlock=%u,"
+        "PoolPeak=%u,"
+        "PoolFailed=%u,"
+        "FaultMaxLatency=%u,"
+        "PollsSaved=%d,"
+        "BusMsSaved=%d,"
+        "CpuIdle=%u,"
+        "LoopUs=%u,"
+        "LoopOverheadUs=%u";
+    static const uint32_t interval = 60000;
+    static uint32_t prev = 0;
+
+    uint32_t now = millis();
+    if (now - prev >= interval) {
+        prev = now;
+        take_metrics();
+        publish(MQTT_TOPIC "/json/Metrics", write_Metrics);  // streamed from the snapshot when sent
+
+        uint32_t failed = 0;
+        for (auto &stats: metrics.pool) {
+            failed += stats.failed;
         }
-        if (jbdStatus.fault &0b1000000000000 && endp > cursor) {
-            cursor += snprintf(cursor, endp - cursor, "BMS: %s<br/>\n", "MOS software lockout");
+        Lease msg(POOL_SYSTEM);
+        if (msg.ok()) {
+            snprintf(msg, msg.size(), lineFmt, WiFi.getHostname(), (unsigned)metrics.heap_free, (unsigned)metrics.heap_min_free,
+                (unsigned)metrics.heap_max_block, pool_peak, (unsigned)failed, (unsigned)metrics.fault_max_latency_ms,
+                metrics.polls_saved, metrics.bus_ms_saved, (unsigned)metrics.cpu_idle,
+                (unsigned)metrics.loop_us, (unsigned)metrics.overhead_us);
+            postInflux(msg);
         }
     }
+}
+
 
-    if (cursor >= endp) {
-        snprintf(endp - 5, 5, " ...");
+// Copy verbose error status string of charger and bms faults into msg
+// Return length of message (ends in ' ...' if cut due to msg_size too small)
+size_t decode_error( char *msg, size_t msg_size, uint16_t chg_faults, uint16_t bms_faults ) {
+    BufferWriter out(msg, msg_size);
+    write_faults_html(out, es3_fault_table, chg_faults);
+    write_faults_html(out, jbd_fault_table, bms_faults);
+    size_t len = out.flush();
+    if (len >= msg_size) {
+        snprintf(msg + msg_size - 5, 5, " ...");
     }
+    return len;
+}
 
-    return cursor - msg;
+size_t decode_error( char *msg, size_t msg_size ) {
+    return decode_error(msg, msg_size, es3ChgSts.wFault, jbdStatus.fault);
 }
 
 char web_msg[256] = "";  // main web page displays and then clears this
@@ -1161,6 +5413,21 @@ const char *main_page() {
         "   <tr><td>Cells</td><td><a href=\"/json/Cells\">JSON</a></td></tr>\n"
         "   <tr><td></td></tr>\n"
         "   <tr><td>Wifi</td><td><a href=\"/json/Wifi\">JSON</a></td></tr>\n"
+        "   <tr><td>Tasks</td><td><a href=\"/json/Tasks\">JSON</a></td></tr>\n"
+        "   <tr><td>Polling</td><td><a href=\"/json/Polling\">JSON</a></td></tr>\n"
+        "   <tr><td>Devices</td><td><a href=\"/json/Devices\">JSON</a></td></tr>\n"
+        "   <tr><td>Bank</td><td><a href=\"/json/Bank\">JSON</a></td></tr>\n"
+        "   <tr><td>RS485 proxy</td><td><a href=\"/json/Proxy\">JSON</a></td></tr>\n"
+        "   <tr><td>Record and replay</td><td><a href=\"/json/Record\">JSON</a> <a href=\"/record.bin\">Log</a></td></tr>\n"
+        "   <tr><td>RS485 sniffer</td><td><a href=\"/json/Sniffer\">JSON</a> <a href=\"/capture.pcap\">Capture</a></td></tr>\n"
+        "   <tr><td>Energy</td><td><a href=\"/json/Energy\">JSON</a></td></tr>\n"
+        "   <tr><td>Derived metrics</td><td><a href=\"/json/Derived\">JSON</a></td></tr>\n"
+        "   <tr><td>State of charge</td><td><a href=\"/json/SoC\">JSON</a></td></tr>\n"
+        "   <tr><td>Cell statistics</td><td><a href=\"/json/CellStats\">JSON</a></td></tr>\n"
+        "   <tr><td>State</td><td><a href=\"/json/State\">JSON</a></td></tr>\n"
+        "   <tr><td>Rules</td><td><a href=\"/json/Rules\">JSON</a></td></tr>\n"
+        "   <tr><td>Events</td><td><a href=\"/json/Events\">JSON</a></td></tr>\n"
+        "   <tr><td>Metrics</td><td><a href=\"/json/Metrics\">JSON</a></td></tr>\n"
         "   <tr><td></td></tr>\n"
         "   <tr><td>Post firmware image to</td><td><a href=\"/update\">/update</a></td></tr>\n"
         "   <tr><td>Last start time</td><td>%s</td></tr>\n"
@@ -1172,6 +5439,15 @@ const char *main_page() {
         "    <td>IP <input type=\"text\" id=\"ip\" name=\"ip\" value=\"%s\" /></td>\n"
         "    <td><input type=\"submit\" name=\"change\" value=\"Change IP\" /></td>\n"
         "   </form></tr>\n"
+        "   <tr><form action=\"loglevel\" method=\"post\">\n"
+        "    <td><a href=\"/log\">Log</a> level <input type=\"text\" id=\"level\" name=\"level\" value=\"%u\" size=\"7\" /></td>\n"
+        "    <td><input type=\"submit\" name=\"loglevel\" value=\"Set Level\" /></td>\n"
+        "   </form></tr>\n"
+        "   <tr><form action=\"rules\" method=\"post\">\n"
+        "    <td><a href=\"/json/Rules\">Rule</a> <input type=\"text\" name=\"slot\" size=\"1\" /> "
+        "<input type=\"text\" name=\"rule\" size=\"40\" placeholder=\"MinCell &lt; 3000 for 30 hyst 100 then load off\" /></td>\n"
+        "    <td><input type=\"submit\" name=\"set\" value=\"Set Rule\" /></td>\n"
+        "   </form></tr>\n"
         "  </table></p>\n"
         "  <p><table><tr>\n"
         "   <td><form action=\"/\" method=\"get\">\n"
@@ -1200,12 +5476,102 @@ const char *main_page() {
         (char *)es3Information.wModel, jbdHardware.id, 
         jbdStatus.mosfetStatus & JbdBms::MOSFET_CHARGE ? "checked " : "", 
         jbdStatus.mosfetStatus & JbdBms::MOSFET_DISCHARGE ? "checked " : "", 
-        web_msg, start_time, curr_time, influx_time, influx_status, lastBssid, lastRssi, WiFi.localIP().toString().c_str());
+        web_msg, start_time, curr_time, influx_time, influx_status, lastBssid, lastRssi, ip_str(WiFi.localIP()).str, log_level);
     *web_msg = '\0';
     return page;
 }
 
 
+// Measure size and encode time of one record in json and cbor
+template<typename T> int bench_record( char *out, size_t maxlen, const char *record, 
+        bool (*json)(char *, size_t, T), bool (*cbor)(cbor_t &, const T &), const T &data ) {
+    static const uint32_t iterations = 100;
+    uint8_t buf[MQTT_MAX_PACKET_SIZE];
+    cbor_t c = { buf, sizeof(buf), 0 };
+    Lease msg(POOL_WEB);
+
+    uint32_t start = micros();
+    for (uint32_t i = 0; i < iterations; i++) {
+        json(msg, msg.size(), data);
+    }
+    uint32_t json_us = micros() - start;
+
+    start = micros();
+    for (uint32_t i = 0; i < iterations; i++) {
+        c.len = 0;
+        cbor(c, data);
+    }
+    uint32_t cbor_us = micros() - start;
+
+    // ns per encode = us per 100 encodes * 10
+    return snprintf(out, maxlen, "\"%s\":{\"JsonBytes\":%u,\"CborBytes\":%u,\"JsonNs\":%u,\"CborNs\":%u},",
+        record, (unsigned)strlen(msg), (unsigned)c.len, 
+        (unsigned)(json_us * (1000 / iterations)), (unsigned)(cbor_us * (1000 / iterations)));
+}
+
+
+// Compare json and cbor encoding of the current records
+bool json_BenchEncoding(char *json, size_t maxlen) {
+    int len = snprintf(json, maxlen, "{\"Version\":" VERSION ",\"Encoding\":{");
+    #define BENCH(record, data) if (len < maxlen) { \
+        len += bench_record(&json[len], maxlen - len, #record, json_##record, cbor_##record, data); }
+    BENCH(Information, es3Information);
+    BENCH(ChgSts, es3ChgSts);
+    BENCH(BatParam, es3BatParam);
+    BENCH(Log, es3Log);
+    BENCH(Parameters, es3Parameters);
+    BENCH(LoadParam, es3LoadParam);
+    BENCH(ProParam, es3ProParam);
+    BENCH(Hardware, jbdHardware);
+    BENCH(Status, jbdStatus);
+    BENCH(Cells, jbdCells);
+    #undef BENCH
+    if (len < maxlen) {
+        json[len - 1] = '}';  // replace trailing comma
+        len += snprintf(&json[len], maxlen - len, "}");
+    }
+
+    return len < maxlen;
+}
+
+
+// Time the table driven fault decoding, worst case with all bits set
+bool json_BenchFaults( char *json, size_t maxlen ) {
+    static const uint32_t iterations = 1000;  // so us of all iterations is ns per call
+    static char html[1024];
+
+    // local copies, the live records stay untouched. Volatile so the loops are not folded into constants
+    volatile uint16_t chg = (1u << es3_fault_table.count) - 1;
+    volatile uint16_t bms = (1u << jbd_fault_table.count) - 1;
+    volatile size_t bytes = 0;  // consumes the results so the loops are not optimized away
+
+    uint32_t start = micros();
+    for (uint32_t i = 0; i < iterations; i++) {
+        bytes += decode_error(html, sizeof(html), chg, bms);
+    }
+    uint32_t html_us = micros() - start;
+
+    start = micros();
+    for (uint32_t i = 0; i < iterations; i++) {
+        BufferWriter out(html, sizeof(html));
+        write_faults_json(out, jbd_fault_table, bms);
+        bytes += out.flush();
+    }
+    uint32_t json_us = micros() - start;
+
+    start = micros();
+    for (uint32_t i = 0; i < iterations; i++) {
+        bytes += strlen(fault_bits(jbd_fault_table, bms).str);
+    }
+    uint32_t bits_us = micros() - start;
+
+    int len = snprintf(json, maxlen, "{\"Version\":" VERSION ",\"Faults\":{"
+        "\"TableHtmlNs\":%u,\"TableJsonNs\":%u,\"TableBitsNs\":%u,\"Bytes\":%u}}",
+        (unsigned)html_us, (unsigned)json_us, (unsigned)bits_us, (unsigned)bytes);
+    return len < maxlen;
+}
+
+
 // Read and write ip config
 bool ip_config(uint32_t *ip, int num_ip, bool write = false) {
     const uint32_t magic = 0xdeadbeef;
@@ -1244,16 +5610,33 @@ bool ip_config(uint32_t *ip, int num_ip, bool write = false) {
 // }
 
 
+// Copy a request argument into a char buffer.
+// Short values like ips or button names fit into the small String buffer, so this does not touch the heap.
+const char *web_arg( const char *name, char *buf, size_t size ) {
+    snprintf(buf, size, "%s", web_server.arg(name).c_str());
+    return buf;
+}
+
+
+// Send a json response built in a leased buffer, or 503 if the pool had none left
+void web_send_json( Lease &msg ) {
+    if (msg.ok()) {
+        web_send_json(msg);
+    }
+    else {
+        web_server.send(503, "text/plain", "Out of buffers");
+    }
+}
+
+
 // Define web pages for update, reset or for event infos
 void setup_webserver() {
     web_server.on("/toggle", HTTP_POST, []() {
         bool on;
         const char *msg = "Load unknown";
-        if (esmart3.getLoad(on)) {
-            on = !on;
-            if (esmart3.setLoad(on)) {
-                msg = on ? "Load on" : "Load off";
-            }
+        if (get_load(on, load_max_age)) {
+            msg = !submit_command(CMD_LOAD, !on, "web") ? "Command queue full"
+                : on ? "Load off requested" : "Load on requested";
         }
         snprintf(web_msg, sizeof(web_msg), "%s", msg);
         web_server.sendHeader("Location", "/", true);  
@@ -1263,10 +5646,8 @@ void setup_webserver() {
     web_server.on("/on", HTTP_POST, []() {
         bool on;
         const char *msg = "Load on";
-        if (!esmart3.getLoad(on) || !on) {
-            if (!esmart3.setLoad(true)) {
-                msg = "Load unknown";
-            }
+        if (!get_load(on, load_max_age) || !on) {
+            msg = submit_command(CMD_LOAD, true, "web") ? "Load on requested" : "Command queue full";
         }
         snprintf(web_msg, sizeof(web_msg), "%s", msg);
         web_server.sendHeader("Location", "/", true);  
@@ -1276,10 +5657,8 @@ void setup_webserver() {
     web_server.on("/off", HTTP_POST, []() {
         bool on;
         const char *msg = "Load off";
-        if (!esmart3.getLoad(on) || on) {
-            if (!esmart3.setLoad(false)) {
-                msg = "Load unknown";
-            }
+        if (!get_load(on, load_max_age) || on) {
+            msg = submit_command(CMD_LOAD, false, "web") ? "Load off requested" : "Command queue full";
         }
         snprintf(web_msg, sizeof(web_msg), "%s", msg);
         web_server.sendHeader("Location", "/", true);  
@@ -1290,33 +5669,33 @@ void setup_webserver() {
     web_server.on("/mosfets", HTTP_POST, []() {
         uint8_t mosfetStatus = 0;
         const char *msg = "Mosfet status unchanged";
+        char arg[16];
 
-        if (web_server.hasArg("charge") && web_server.arg("charge") == "Charge") {
+        if (web_server.hasArg("charge") && strcmp(web_arg("charge", arg, sizeof(arg)), "Charge") == 0) {
             mosfetStatus |= JbdBms::MOSFET_CHARGE;
         }
-        if (web_server.hasArg("discharge") && web_server.arg("discharge") == "Discharge") {
+        if (web_server.hasArg("discharge") && strcmp(web_arg("discharge", arg, sizeof(arg)), "Discharge") == 0) {
             mosfetStatus |= JbdBms::MOSFET_DISCHARGE;
         }
         if (mosfetStatus != jbdStatus.mosfetStatus) {
-            if (jbdbms.setMosfetStatus((JbdBms::mosfet_t)mosfetStatus)) {
-                jbdStatus.mosfetStatus = mosfetStatus;
+            if (submit_command(CMD_MOSFETS, mosfetStatus, "web")) {
                 switch (mosfetStatus) {
                     case JbdBms::MOSFET_NONE:
-                        msg = "Charge and discharge OFF";
+                        msg = "Charge and discharge OFF requested";
                         break; 
                     case JbdBms::MOSFET_CHARGE:
-                        msg = "Charge ON and discharge OFF";
+                        msg = "Charge ON and discharge OFF requested";
                         break; 
                     case JbdBms::MOSFET_DISCHARGE:
-                        msg = "Charge OFF and discharge ON";
+                        msg = "Charge OFF and discharge ON requested";
                         break; 
                     case JbdBms::MOSFET_BOTH:
-                        msg = "Charge and discharge ON";
+                        msg = "Charge and discharge ON requested";
                         break; 
                 }
             }
             else {
-                msg = "Set mosfet status failed";
+                msg = "Command queue full";
             }
         }
 
@@ -1346,7 +5725,7 @@ void setup_webserver() {
         bool on;
         const char *url = "switchoff";
         const char *txt = "Off";
-        if (!esmart3.getLoad(on) || !on ) {
+        if (!get_load(on, load_max_age) || !on ) {
             url = "switchon";
             txt = "On";
         }
@@ -1355,73 +5734,196 @@ void setup_webserver() {
     });
 
     web_server.on("/switchon", HTTP_POST, []() {
-        esmart3.setLoad(true);
+        submit_command(CMD_LOAD, true, "web");
         web_server.sendHeader("Location", "/switch", true);  
         web_server.send(302, "text/plain", "");
     });
 
     web_server.on("/switchoff", HTTP_POST, []() {
-        esmart3.setLoad(false);
+        submit_command(CMD_LOAD, false, "web");
         web_server.sendHeader("Location", "/switch", true);  
         web_server.send(302, "text/plain", "");
     });
 
 
     web_server.on("/json/Information", []() {
-        json_Information(msg, sizeof(msg), es3Information);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_Information(msg, msg.size(), es3Information);
+        web_send_json(msg);
     });
 
     web_server.on("/json/ChgSts", []() {
-        json_ChgSts(msg, sizeof(msg), es3ChgSts);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_ChgSts(msg, msg.size(), es3ChgSts);
+        web_send_json(msg);
     });
 
     web_server.on("/json/BatParam", []() {
-        json_BatParam(msg, sizeof(msg), es3BatParam);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_BatParam(msg, msg.size(), es3BatParam);
+        web_send_json(msg);
     });
 
     web_server.on("/json/Log", []() {
-        json_Log(msg, sizeof(msg), es3Log);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_Log(msg, msg.size(), es3Log);
+        web_send_json(msg);
     });
 
     web_server.on("/json/Parameters", []() {
-        json_Parameters(msg, sizeof(msg), es3Parameters);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_Parameters(msg, msg.size(), es3Parameters);
+        web_send_json(msg);
     });
 
     web_server.on("/json/LoadParam", []() {
-        json_LoadParam(msg, sizeof(msg), es3LoadParam);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_LoadParam(msg, msg.size(), es3LoadParam);
+        web_send_json(msg);
     });
 
     web_server.on("/json/ProParam", []() {
-        json_ProParam(msg, sizeof(msg), es3ProParam);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_ProParam(msg, msg.size(), es3ProParam);
+        web_send_json(msg);
     });
 
 
     web_server.on("/json/Status", []() {
-        json_Status(msg, sizeof(msg), jbdStatus);
-        web_server.send(200, "application/json", msg);
+        send_streamed("application/json", stream_Status);
     });
 
     web_server.on("/json/Cells", []() {
-        json_Cells(msg, sizeof(msg), jbdCells);
-        web_server.send(200, "application/json", msg);
+        send_streamed("application/json", stream_Cells);
+    });
+
+    web_server.on("/json/Rules", []() {
+        send_streamed("application/json", [](ChunkWriter &out) { write_Rules(out); });
+    });
+
+    // Set or delete (empty rule) a rule
+    web_server.on("/rules", HTTP_POST, []() {
+        char slot[8];
+        char rule[RULE_TEXT_SIZE];
+        web_arg("slot", slot, sizeof(slot));
+        web_arg("rule", rule, sizeof(rule));
+        char *end;
+        unsigned long n = strtoul(slot, &end, 10);
+        if (isdigit(*slot) && !*end && n < RULE_SLOTS && set_rule(n, rule)) {
+            snprintf(web_msg, sizeof(web_msg), "Rule %s %s", slot, *rule ? "set" : "deleted");
+        }
+        else {
+            snprintf(web_msg, sizeof(web_msg), "Invalid rule");
+        }
+        web_server.sendHeader("Location", "/", true);  
+        web_server.send(302, "text/plain", "");
+    });
+
+    // Event journal, newest first. Optional args from and to (unix time) and max (number of events)
+    web_server.on("/json/Events", []() {
+        static uint32_t from, to, max_count;
+        char arg[16];
+        from = strtoul(web_arg("from", arg, sizeof(arg)), NULL, 10);
+        to = web_server.hasArg("to") ? strtoul(web_arg("to", arg, sizeof(arg)), NULL, 10) : UINT32_MAX;
+        max_count = web_server.hasArg("max") ? strtoul(web_arg("max", arg, sizeof(arg)), NULL, 10) : 100;
+        send_streamed("application/json", [](ChunkWriter &out) { write_Events(out, from, to, max_count); });
+    });
+
+    web_server.on("/json/Sniffer", []() {
+        send_streamed("application/json", write_Sniffer);
+    });
+
+    web_server.on("/capture.pcap", []() {
+        time_t now = time(NULL);
+        int64_t boot_us = now > 1600000000 ? (int64_t)now * 1000000 - esp_timer_get_time() : 0;  // same for both passes
+        send_streamed("application/vnd.tcpdump.pcap", [boot_us](ChunkWriter &out) { write_Capture(out, boot_us); });
+    });
+
+    web_server.on("/json/Proxy", []() {
+        send_streamed("application/json", write_Proxy);
+    });
+
+    web_server.on("/json/Bank", []() {
+        send_streamed("application/json", write_Bank);
+    });
+
+    web_server.on("/json/Devices", []() {
+        uint32_t now = millis();  // same for both passes
+        send_streamed("application/json", [now](ChunkWriter &out) { write_Devices(out, now); });
+    });
+
+    web_server.on("/json/Polling", []() {
+        send_streamed("application/json", [](ChunkWriter &out) { write_Polling(out); });
+    });
+
+    web_server.on("/json/Energy", []() {
+        send_streamed("application/json", [](ChunkWriter &out) { write_Energy(out); });
+    });
+
+    web_server.on("/json/Derived", []() {
+        send_streamed("application/json", [](ChunkWriter &out) { write_Derived(out); });
+    });
+
+    web_server.on("/json/SoC", []() {
+        send_streamed("application/json", [](ChunkWriter &out) { write_SoC(out); });
+    });
+
+    web_server.on("/json/CellStats", []() {
+        send_streamed("application/json", [](ChunkWriter &out) { write_CellStats(out); });
+    });
+
+    web_server.on("/json/State", []() {
+        Lease msg(POOL_WEB);
+        json_State(msg, msg.size());
+        web_send_json(msg);
+    });
+
+    web_server.on("/json/Metrics", []() {
+        take_metrics();
+        send_streamed("application/json", [](ChunkWriter &out) { write_Metrics(out); });
     });
 
     web_server.on("/json/Wifi", []() {
-        json_Wifi(msg, sizeof(msg), lastBssid, lastRssi);
-        web_server.send(200, "application/json", msg);
+        Lease msg(POOL_WEB);
+        json_Wifi(msg, msg.size(), lastBssid, lastRssi);
+        web_send_json(msg);
+    });
+
+    web_server.on("/log", []() {
+        static char tail[LOG_TAIL_SIZE + 1];
+        log_tail_copy(tail, sizeof(tail));
+        send_streamed("text/plain", [](ChunkWriter &out) { out.print(tail); });
+    });
+
+    web_server.on("/loglevel", HTTP_POST, []() {
+        char level[16];
+        if (web_server.hasArg("level") && set_log_level(web_arg("level", level, sizeof(level)))) {
+            snprintf(web_msg, sizeof(web_msg), "Log level %u", log_level);
+        }
+        else {
+            snprintf(web_msg, sizeof(web_msg), "Invalid log level");
+        }
+        web_server.sendHeader("Location", "/", true);  
+        web_server.send(302, "text/plain", "");
+    });
+
+    web_server.on("/bench/faults", []() {
+        Lease msg(POOL_WEB);
+        json_BenchFaults(msg, msg.size());
+        web_send_json(msg);
+    });
+
+    web_server.on("/bench/encoding", []() {
+        static char json[1536];
+        json_BenchEncoding(json, sizeof(json));
+        web_server.send(200, "application/json", json);
     });
 
 
     // Change host part of ip, if ip&subnet == 0 -> dynamic
     web_server.on("/ip", HTTP_POST, []() {
-        String strIp = web_server.arg("ip");
+        char strIp[16];
+        web_arg("ip", strIp, sizeof(strIp));
         uint16_t prio = LOG_ERR;
         if (ip.fromString(strIp)) {
             uint32_t newIp = (uint32_t)ip;
@@ -1437,20 +5939,20 @@ void setup_webserver() {
                 if ((newIp & ~subMask) != ~subMask) {
                     changeIp = true;
                     ip = newIp;
-                    snprintf(web_msg, sizeof(web_msg), "Change IP to '%s'", ip.toString().c_str());
+                    snprintf(web_msg, sizeof(web_msg), "Change IP to '%s'", ip_str(ip).str);
                     prio = LOG_WARNING;
                 }
                 else {
-                    snprintf(web_msg, sizeof(web_msg), "Broadcast address '%s' not possible", IPAddress(newIp).toString().c_str());
+                    snprintf(web_msg, sizeof(web_msg), "Broadcast address '%s' not possible", ip_str(newIp).str);
                 }
             }
             else {
-                snprintf(web_msg, sizeof(web_msg), "No IP change for '%s'", strIp.c_str());
+                snprintf(web_msg, sizeof(web_msg), "No IP change for '%s'", strIp);
                 prio = LOG_WARNING;
             }
         }
         else {
-            snprintf(web_msg, sizeof(web_msg), "Invalid ip '%s'", strIp.c_str());
+            snprintf(web_msg, sizeof(web_msg), "Invalid ip '%s'", strIp);
         }
         slog(web_msg, prio);
 
@@ -1489,8 +5991,9 @@ void setup_webserver() {
                 ok = WiFi.config(0UL, 0UL, 0UL);
             }
 
-            snprintf(msg, sizeof(msg), "New IP config ip:%s, gw:%s, sn:%s, d0:%s, d1:%s", WiFi.localIP().toString().c_str(), WiFi.gatewayIP().toString().c_str(), 
-                WiFi.subnetMask().toString().c_str(), WiFi.dnsIP(0).toString().c_str(), WiFi.dnsIP(1).toString().c_str());
+            Lease msg(POOL_WEB);
+            snprintf(msg, msg.size(), "New IP config ip:%s, gw:%s, sn:%s, d0:%s, d1:%s", ip_str(WiFi.localIP()).str, ip_str(WiFi.gatewayIP()).str, 
+                ip_str(WiFi.subnetMask()).str, ip_str(WiFi.dnsIP(0)).str, ip_str(WiFi.dnsIP(1)).str);
             slog(msg, LOG_NOTICE);
             if (ok) {
                 uint32_t ip[5] = { (uint32_t)WiFi.localIP(), (uint32_t)WiFi.gatewayIP(), (uint32_t)WiFi.subnetMask(), (uint32_t)WiFi.dnsIP(0), (uint32_t)WiFi.dnsIP(1) };
@@ -1529,50 +6032,63 @@ void setup_webserver() {
 
     MDNS.addService("http", "tcp", WEBSERVER_PORT);
 
-    snprintf(msg, sizeof(msg), "Serving HTTP on port %d", WEBSERVER_PORT);
+    Lease msg(POOL_WEB);
+    snprintf(msg, msg.size(), "Serving HTTP on port %d", WEBSERVER_PORT);
     slog(msg, LOG_NOTICE);
 }
 
 
-// toggle load on key press
-// pin is pulled up if released and pulled down if pressed
-void handle_load_button( bool loadOn ) {
-    static uint32_t prevTime = 0;
-    static uint32_t debounceStatus = 1;
-    static bool pressed = false;
 
-    uint32_t now = millis();
-    if( now - prevTime > 2 ) {  // debounce check every 2 ms, decision after 2ms/bit * 32bit = 64ms
-        prevTime = now;
 
-        // shift bits left, set lowest bit if button pressed
-        debounceStatus = (debounceStatus << 1) | ((digitalRead(LOAD_BUTTON_PIN) == LOW) ? 1 : 0);
+// Toggle load on key press. Pin is pulled up if released and pulled down if pressed.
+// Every edge restarts a one-shot timer, its callback sees the level once it was stable for debounce_ms.
+// Runs in the timer task, so the main loop does not sample the button.
+const uint32_t debounce_ms = 50;
+TimerHandle_t button_timer = 0;
+bool button_pressed = false;
 
-        if( debounceStatus == 0 && pressed ) {
-            pressed = false;
-        }
-        else if( debounceStatus == 0xffffffff && !pressed ) {
-            pressed = true;
-            if (esmart3.setLoad(!loadOn)) {
-                if( !loadOn ) {
-                    slog("Load switched ON", LOG_NOTICE);
-                }
-                else {
-                    slog("Load switched OFF", LOG_NOTICE);
-                }
+void IRAM_ATTR button_edge() {
+    BaseType_t woken = pdFALSE;
+    xTimerResetFromISR(button_timer, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+void button_debounced( TimerHandle_t ) {
+    bool pressed = digitalRead(LOAD_BUTTON_PIN) == LOW;
+    if (pressed == button_pressed) {
+        return;  // just a glitch
+    }
+    button_pressed = pressed;
+    if (pressed) {
+        bool loadOn = es3Load;  // cached, as shown by the load led
+        if (submit_command(CMD_LOAD, !loadOn, "button")) {
+            if( !loadOn ) {
+                slog("Load ON requested", LOG_NOTICE, LOG_CLASS_CMD);
             }
             else {
-                slog("Load UNKNOWN", LOG_ERR);
+                slog("Load OFF requested", LOG_NOTICE, LOG_CLASS_CMD);
             }
         }
-        // else if (debounceStatus) {
-        //     Serial.println(debounceStatus, HEX);
-        // }
+        else {
+            slog("Command queue full", LOG_ERR, LOG_CLASS_CMD);
+        }
+    }
+}
+
+void setup_button() {
+    pinMode(LOAD_BUTTON_PIN, INPUT_PULLUP);  // to toggle load status
+    button_timer = xTimerCreate("button", pdMS_TO_TICKS(debounce_ms), pdFALSE, 0, button_debounced);
+    if (button_timer) {
+        attachInterrupt(digitalPinToInterrupt(LOAD_BUTTON_PIN), button_edge, CHANGE);
+    }
+    else {
+        slog("Button timer not created", LOG_ERR);
     }
 }
 
 
 // check once every 500ms if load status has changed
+// this is the regular poll of the load status, all other users take it from the cache
 // return true if load is on (or unknown)
 bool handle_load_led() {
     static uint32_t prevTime = 0;
@@ -1580,18 +6096,19 @@ bool handle_load_led() {
     static bool prevLoad = true;     // assume load is on
 
     uint32_t now = millis();
-    if( now - prevTime > 500 ) {
+    if( now - prevTime > load_poll_ms ) {
         prevTime = now;
         bool loadOn = false;
-        if( esmart3.getLoad(loadOn) ) {
+        if( get_load(loadOn, load_poll_ms) ) {  // only reads the bus if not recently read or switched
             if( !prevStatus || loadOn != prevLoad ) {
+                journal_write(JOURNAL_LOAD, 0, loadOn);
                 if( loadOn ) {
                     digitalWrite(LOAD_LED_PIN, LOAD_LED_ON);
-                    slog("Load is ON", LOG_NOTICE);
+                    slog("Load is ON", LOG_NOTICE, LOG_CLASS_CMD);
                 }
                 else {
                     digitalWrite(LOAD_LED_PIN, LOAD_LED_OFF);
-                    slog("Load is OFF", LOG_NOTICE);
+                    slog("Load is OFF", LOG_NOTICE, LOG_CLASS_CMD);
                 }
                 prevStatus = true;
                 prevLoad = loadOn;
@@ -1600,7 +6117,7 @@ bool handle_load_led() {
         else {
             if( prevStatus ) {
                 digitalWrite(LOAD_LED_PIN, LOAD_LED_ON);  // assume ON
-                slog("Load is UNKNOWN", LOG_ERR);
+                slog("Load is UNKNOWN", LOG_ERR, LOG_CLASS_CMD);
                 prevStatus = false;
                 prevLoad = true;
             }
@@ -1616,74 +6133,87 @@ bool handle_load_led() {
 bool check_ntptime() {
     static bool have_time = false;
 
-    #if defined(ESP32)
-        bool valid_time = time(0) > 1582230020;
-    #else
-        ntp.update();
-        bool valid_time = ntp.isTimeSet();
-    #endif
+    bool valid_time = time(0) > 1582230020;
 
     if (!have_time && valid_time) {
         have_time = true;
         time_t now = time(NULL);
         strftime(start_time, sizeof(start_time), "%FT%T", localtime(&now));
-        snprintf(msg, sizeof(msg), "Got valid time at %s", start_time);
+        Lease msg(POOL_SYSTEM);
+        snprintf(msg, msg.size(), "Got valid time at %s", start_time);
         slog(msg, LOG_NOTICE);
-        if (mqtt.connected()) {
-            publish(MQTT_TOPIC "/status/StartTime", start_time);
-        }
+        publish(MQTT_TOPIC "/status/StartTime", start_time);
     }
 
     return have_time;
 }
 
 
-// Status led update
-void handle_breathe() {
-    static uint32_t start = 0;  // start of last breath
-    static uint32_t min_duty = 1;  // limit min brightness
-    static uint32_t max_duty = PWMRANGE / 2;  // limit max brightness
-    static uint32_t prev_duty = 0;
-
-    // map elapsed in breathing intervals
-    uint32_t now = millis();
-    uint32_t elapsed = now - start;
-    if (elapsed > breathe_interval) {
-        start = now;
-        elapsed -= breathe_interval;
+// Status led breathing by the LEDC fade engine: an esp_timer starts the next fade up or down
+// every half interval, so the main loop only reprograms it when the interval changes.
+// Only the timer callback touches the led, set_breathing() just requests a new interval
+esp_timer_handle_t breathe_timer = 0;
+volatile uint32_t breathe_wanted = 0;  // interval requested by set_breathing(), 0: off
+uint32_t breathe_running = 0;          // interval of the running animation, 0: stopped
+bool breathe_up = true;                // direction of the next fade
+
+void breathe_fade( void * ) {
+    static const uint32_t min_duty = 1;             // limit min brightness
+    static const uint32_t max_duty = PWMRANGE / 4;  // limit max brightness, fade is linear
+
+    uint32_t wanted = breathe_wanted;
+    if (wanted != breathe_running) {
+        breathe_running = wanted;
+        breathe_up = true;
+        esp_timer_stop(breathe_timer);  // restarted below with the new period
+        if (!wanted) {
+            ledcWrite(HEALTH_LED_PIN, HEALTH_LED_ON == LOW ? PWMRANGE : 0);
+            return;
+        }
     }
-
-    // map min brightness to max brightness twice in one breathe interval
-    uint32_t duty = (max_duty - min_duty) * elapsed * 2 / breathe_interval + min_duty;
-    if (duty > max_duty) {
-        // second range: breathe out aka get darker
-        duty = 2 * max_duty - duty;
+    if (!breathe_running) {
+        return;
+    }
+    if (!esp_timer_is_active(breathe_timer)) {
+        esp_timer_start_periodic(breathe_timer, breathe_running * 500ULL);  // us per half cycle
     }
 
-    duty = duty * duty / max_duty;  // generally reduce lower brightness levels
+    uint32_t from = breathe_up ? min_duty : max_duty;
+    uint32_t to = breathe_up ? max_duty : min_duty;
+    if (HEALTH_LED_ON == LOW) {
+        // inverted
+        from = PWMRANGE - from;
+        to = PWMRANGE - to;
+    }
+    ledcFade(HEALTH_LED_PIN, from, to, breathe_running / 2);
+    breathe_up = !breathe_up;
+}
 
-    if (duty != prev_duty) {
-        // adjust pwm duty cycle
-        prev_duty = duty;
-        if (HEALTH_LED_ON == LOW) {
-            // inverted
-            duty = PWMRANGE - duty;
+// Breathe with interval ms per cycle or switch the led off if interval is 0
+void set_breathing( uint32_t interval ) {
+    if (interval == breathe_wanted) {
+        return;
+    }
+    if (!breathe_timer) {
+        const esp_timer_create_args_t args = { breathe_fade, 0, ESP_TIMER_TASK, "breathe" };
+        if (esp_timer_create(&args, &breathe_timer) != ESP_OK) {
+            return;
         }
-        #if defined(ESP32)
-            ledcWrite(HEALTH_PWM_CH, duty);
-        #else
-            analogWrite(HEALTH_LED_PIN, duty);
-        #endif
     }
+    breathe_wanted = interval;
+    // a running callback may still finish its fade, the one shot applies the change right after it
+    esp_timer_stop(breathe_timer);
+    esp_timer_start_once(breathe_timer, 1000);
 }
 
 
+
 void handle_es3Time( bool time_valid ) {
     static bool time_set = false;
 
     if( !time_set && time_valid ) {
         struct tm now;
-        getLocalTime(&now);  // TODO: ESP32 only?
+        getLocalTime(&now);
         if (esmart3.setTime(now)) {
             time_set = true;
             slog("eSmart3 time set", LOG_NOTICE);
@@ -1763,78 +6293,545 @@ void print_reset_reason(int core) {
 }
 
 
+// Replay driver: walks the log and hands each struct to its handler with a forced poll,
+// replay_speed times faster than recorded. A struct waits until the handler took the previous
+// one of its item, so every record passes the handlers even if they are slower than the log.
+uint32_t replay_speed = 1;
+size_t replay_pos = 0;
+uint32_t replay_start_ms;    // millis() at replay start
+uint32_t replay_log_ms;      // log time of the last handed over struct
+uint32_t replay_records = 0;
+uint32_t replay_wall_ms = 0; // duration of the last replay
+uint8_t replay_prev[STATE_ITEMS][RECORD_STRUCT_MAX];  // for unchanged marks
+
+bool record_alloc() {
+    if (!record_log) {
+        record_log = (uint8_t *)malloc(RECORD_SIZE);
+    }
+    if (!record_log) {
+        slog("No memory for the record log", LOG_ERR);
+    }
+    return record_log;
+}
+
+// Start a fresh log with the device identities, so a replay has them right away
+bool start_record() {
+    if (replay_active || !record_alloc()) {
+        return false;
+    }
+    const uint8_t magic[] = { 'L', 'I', 'R', '1', STATE_ITEMS };
+    uint32_t start = time(NULL);
+    memcpy(record_log, magic, sizeof(magic));
+    memcpy(&record_log[sizeof(magic)], record_sizes, STATE_ITEMS);
+    memcpy(&record_log[sizeof(magic) + STATE_ITEMS], &start, sizeof(start));
+    record_len = RECORD_HEADER;
+    record_known = 0;
+    record_prev_ms = millis();
+    record_on = true;
+    if (device_state[STATE_INFORMATION].valid) {
+        record_write(STATE_INFORMATION, &es3Information);
+    }
+    if (device_state[STATE_HARDWARE].valid) {
+        record_write(STATE_HARDWARE, &jbdHardware);
+    }
+    return true;
+}
+
+void stop_replay( const char *why ) {
+    replay_active = false;
+    replay_ready = 0;
+    replay_wall_ms = millis() - replay_start_ms;
+    // replayed samples must not stay in the persistent counters
+    setup_soc();
+    setup_energy();
+    // nor in the records: invalid until read again, which also publishes all fields anew
+    for (size_t i = 0; i < STATE_ITEMS; i++) {
+        device_state[i].valid = false;
+        force_poll((state_item_t)i);
+    }
+    // and rules start over on the live values
+    for (auto &rule: rules) {
+        rule.holding = false;
+        rule.fired = false;
+    }
+    char msg[100];
+    snprintf(msg, sizeof(msg), "Replay %s: %u records, %u ms log in %u ms", why,
+        (unsigned)replay_records, (unsigned)replay_log_ms, (unsigned)replay_wall_ms);
+    slog(msg, LOG_NOTICE);
+}
+
+bool start_replay( uint32_t speed ) {
+    const uint8_t magic[] = { 'L', 'I', 'R', '1', STATE_ITEMS };
+    if (!REPLAY) {
+        slog("Replay needs a bench build (REPLAY=1), it would leave the island unpolled and unprotected", LOG_ERR);
+        return false;
+    }
+    if (replay_active || !record_log || record_len < RECORD_HEADER || memcmp(record_log, magic, sizeof(magic))
+            || memcmp(&record_log[sizeof(magic)], record_sizes, STATE_ITEMS)) {
+        slog("No replayable log (other firmware or library version?)", LOG_ERR);
+        return false;
+    }
+    record_on = false;
+    save_soc();  // the replay restores the counters from flash
+    save_energy();
+    for (auto &s: outbox) {
+        if (s.seq && s.writer) {
+            s.seq = 0;  // would stream replayed records to the live topics
+        }
+    }
+    replay_speed = max(speed, (uint32_t)1);
+    replay_pos = RECORD_HEADER;
+    replay_start_ms = millis();
+    replay_log_ms = 0;
+    replay_records = 0;
+    replay_ready = 0;
+    replay_active = true;
+    return true;
+}
+
+void handle_replay() {
+    if (!replay_active) return;
+
+    uint32_t clock = (millis() - replay_start_ms) * replay_speed;  // log time that is due
+    while (replay_pos < record_len) {
+        size_t pos = replay_pos;
+        uint8_t head = record_log[pos++];
+        uint8_t item = head & ~RECORD_UNCHANGED;
+        uint32_t dt = 0;
+        for (uint8_t shift = 0; pos < record_len && shift < 32; shift += 7) {
+            uint8_t b = record_log[pos++];
+            dt |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        uint8_t size = item < STATE_ITEMS ? record_sizes[item] : 0;
+        if (!size || (!(head & RECORD_UNCHANGED) && pos + size > record_len)) {
+            stop_replay("broken log");
+            return;
+        }
+        if (replay_log_ms + dt > clock) {
+            idle_within((replay_log_ms + dt - clock) / replay_speed);
+            return;
+        }
+        if (replay_ready & (1 << item)) {
+            idle_within(0);  // handler is behind
+            return;
+        }
+        if (!(head & RECORD_UNCHANGED)) {
+            memcpy(replay_prev[item], &record_log[pos], size);
+            pos += size;
+        }
+        memcpy(replay_slot[item], replay_prev[item], size);
+        replay_ready |= 1 << item;
+        force_poll((state_item_t)item);
+        replay_log_ms += dt;
+        replay_pos = pos;
+        replay_records++;
+    }
+    stop_replay("done");
+}
+
+
+void write_Record( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Record\":{\"On\":%s,\"Bytes\":%u,\"Size\":%u},"
+        "\"Replay\":{\"Active\":%s,\"Speed\":%u,\"Records\":%u,\"LogMs\":%u,\"WallMs\":%u}}",
+        WiFi.getHostname(), record_on ? "true" : "false", (unsigned)record_len, (unsigned)RECORD_SIZE,
+        replay_active ? "true" : "false", (unsigned)replay_speed, (unsigned)replay_records, (unsigned)replay_log_ms,
+        (unsigned)(replay_active ? millis() - replay_start_ms : replay_wall_ms));
+}
+
+
+bool replay_upload_overflow = false;  // uploaded log did not fit, it is not replayed
+
+// Register download, upload and control of the log
+void setup_replay() {
+    web_server.on("/json/Record", []() {
+        send_streamed("application/json", write_Record);
+    });
+
+    web_server.on("/record.bin", []() {
+        send_streamed("application/octet-stream", [](ChunkWriter &out) { 
+            if (record_log) out.write(record_log, record_len); 
+        });
+    });
+
+    // curl -F log=@record.bin "http://<host>/replay?speed=10"
+    web_server.on("/replay", HTTP_POST, []() {
+        char arg[12];
+        uint32_t speed = web_server.hasArg("speed") ? strtoul(web_arg("speed", arg, sizeof(arg)), NULL, 10) : 1;
+        if (replay_upload_overflow) {
+            replay_upload_overflow = false;
+            web_server.send(413, "text/plain", "Log larger than the record buffer\n");
+            return;
+        }
+        bool ok = start_replay(speed);
+        web_server.send(ok ? 200 : 400, "text/plain", ok ? "Replay started\n" : "No replayable log\n");
+    }, []() {
+        HTTPUpload &upload = web_server.upload();
+        if (upload.status == UPLOAD_FILE_START) {
+            if (replay_active) stop_replay("aborted");
+            record_on = false;
+            record_len = 0;
+            replay_upload_overflow = false;
+            record_alloc();
+        }
+        else if (upload.status == UPLOAD_FILE_WRITE && record_log && !replay_upload_overflow) {
+            if (upload.currentSize > RECORD_SIZE - record_len) {
+                replay_upload_overflow = true;
+                record_len = 0;  // a cut log must not replay
+                slog("Uploaded log larger than the record buffer", LOG_ERR);
+                return;
+            }
+            memcpy(&record_log[record_len], upload.buf, upload.currentSize);
+            record_len += upload.currentSize;
+        }
+    });
+}
+
+
 // Called on incoming mqtt messages
+// A command is a name, optionally followed by a space and an argument
 void mqtt_callback(char* topic, byte* payload, unsigned int length) {
 
-    typedef struct cmd { const char *name; void (*action)(void); } cmd_t;
+    typedef struct cmd { const char *name; bool (*action)(const char *arg); } cmd_t;
     
     static cmd_t cmds[] = { 
-        { "load on", [](){ esmart3.setLoad(true); } },
-        { "load off", [](){ esmart3.setLoad(false); } }
+        { "load on", [](const char *arg){ return submit_command(CMD_LOAD, true, "mqtt") != 0; } },
+        { "load off", [](const char *arg){ return submit_command(CMD_LOAD, false, "mqtt") != 0; } },
+        { "fields on", [](const char *arg){ mqtt_fields = true; publish_all_fields(); return true; } },
+        { "fields off", [](const char *arg){ mqtt_fields = false; return true; } },
+        { "idle on", [](const char *arg){ idle_sleep = true; return true; } },
+        { "idle off", [](const char *arg){ idle_sleep = false; return true; } },
+        { "dispatch on", [](const char *arg){ dispatch_timed = true; return true; } },
+        { "dispatch off", [](const char *arg){ dispatch_timed = false; return true; } },
+        { "record on", [](const char *arg){ return start_record(); } },
+        { "record off", [](const char *arg){ record_on = false; return true; } },
+        { "replay stop", [](const char *arg){ if (replay_active) stop_replay("stopped"); return true; } },
+        { "replay", [](const char *arg){ return start_replay(strtoul(arg, NULL, 10)); } },
+        { "capture on", [](const char *arg){ set_capture(true); return true; } },
+        { "capture off", [](const char *arg){ set_capture(false); return true; } },
+        { "cbor on", [](const char *arg){ mqtt_cbor = true; publish_cbor_schemas(); return true; } },
+        { "cbor off", [](const char *arg){ mqtt_cbor = false; return true; } },
+        { "loglevel", [](const char *arg){ return set_log_level(arg); } },
+        { "rule", [](const char *arg){ return set_rule(arg); } }
     };
 
+    char command[RULE_TEXT_SIZE + 8];  // longest is a rule
+    snprintf(command, sizeof(command), "%.*s", length, (char *)payload);
+
     if (strcasecmp(MQTT_TOPIC "/cmd", topic) == 0) {
         for (auto &cmd: cmds) {
-            if (strncasecmp(cmd.name, (char *)payload, length) == 0) {
-                snprintf(msg, sizeof(msg), "Execute mqtt command '%s'", cmd.name);
-                slog(msg, LOG_INFO);
-                (*cmd.action)();
+            size_t len = strlen(cmd.name);
+            if (strncasecmp(cmd.name, command, len) == 0 && (command[len] == '\0' || command[len] == ' ')) {
+                const char *arg = command[len] ? &command[len + 1] : &command[len];
+                bool ok = (*cmd.action)(arg);
+                Lease msg(POOL_MQTT);
+                snprintf(msg, msg.size(), "Execute mqtt command '%s' %s", command, ok ? "done" : "failed");
+                slog(msg, ok ? LOG_INFO : LOG_WARNING, LOG_CLASS_CMD);
                 return;
             }
         }
     }
 
-    snprintf(msg, sizeof(msg), "Ignore mqtt %s: '%.*s'", topic, length, (char *)payload);
-    slog(msg, LOG_WARNING);
+    Lease msg(POOL_MQTT);
+    snprintf(msg, msg.size(), "Ignore mqtt %s: '%s'", topic, command);
+    slog(msg, LOG_WARNING, LOG_CLASS_CMD);
 }
 
 
+// Mqtt connection state machine
+// Each step is bounded by short timeouts, so the loop never waits long for a dead broker
+typedef enum { MQTT_OFFLINE, MQTT_TCP_UP, MQTT_ONLINE } mqtt_state_t;
+
 void handle_mqtt( bool time_valid ) {
-    static const int32_t interval = 5000;  // if disconnected try reconnect this often in ms
-    static uint32_t prev = -interval;      // first connect attempt without delay
+    static const uint32_t min_backoff = 1000;    // first retry after this many ms
+    static const uint32_t max_backoff = 60000;   // then double delay up to this
+    static const int32_t connect_timeout = 500;  // ms for tcp connect to broker
+    static const uint8_t drain_count = 4;        // send at most this many payloads per loop
+    static mqtt_state_t state = MQTT_OFFLINE;
+    static uint32_t backoff = 0;                 // first connect attempt without delay
+    static uint32_t prev = 0;
 
-    if (mqtt.connected()) {
-        mqtt.loop();
-    }
-    else {
-        uint32_t now = millis();
-        if (now - prev > interval) {
+    uint32_t now = millis();
+
+    switch (state) {
+        case MQTT_OFFLINE:
+            if (WiFi.isConnected() && now - prev >= backoff) {
+                prev = now;
+                backoff = backoff ? min(2 * backoff, max_backoff) : min_backoff;
+                if (wifiMqtt.connect(MQTT_SERVER, MQTT_PORT, connect_timeout)) {
+                    state = MQTT_TCP_UP;  // mqtt handshake on next loop
+                }
+                else {
+                    Lease msg(POOL_MQTT);
+                    snprintf(msg, msg.size(), "Connect to MQTT broker %s:%d failed, retry in %u ms", 
+                        MQTT_SERVER, MQTT_PORT, (unsigned)backoff);
+                    slog(msg, LOG_ERR, LOG_CLASS_NET);
+                }
+            }
+            break;
+
+        case MQTT_TCP_UP:
+            // PubSubClient reuses the already connected client and only does the mqtt handshake
             if (mqtt.connect(HOSTNAME, MQTT_TOPIC "/status/LWT", 0, true, "Offline")
-             && mqtt.publish(MQTT_TOPIC "/status/LWT", "Online", true)
-             && mqtt.publish(MQTT_TOPIC "/status/Hostname", HOSTNAME)
-             && mqtt.publish(MQTT_TOPIC "/status/DBServer", INFLUX_SERVER)
-             && mqtt.publish(MQTT_TOPIC "/status/DBPort", itoa(INFLUX_PORT, msg, 10))
-             && mqtt.publish(MQTT_TOPIC "/status/DBName", INFLUX_DB)
-             && mqtt.publish(MQTT_TOPIC "/status/Version", VERSION)
-             && (!time_valid || mqtt.publish(MQTT_TOPIC "/status/StartTime", start_time))
              && mqtt.subscribe(MQTT_TOPIC "/cmd")) {
-                snprintf(msg, sizeof(msg), "Connected to MQTT broker %s:%d using topic %s", MQTT_SERVER, MQTT_PORT, MQTT_TOPIC);
-                slog(msg, LOG_NOTICE);
+                char port[8];
+                // urgent: status goes first and is not evicted when the fields fill the queue
+                publish_urgent(MQTT_TOPIC "/status/LWT", "Online", true);
+                publish_urgent(MQTT_TOPIC "/status/Hostname", HOSTNAME);
+                publish_urgent(MQTT_TOPIC "/status/DBServer", INFLUX_SERVER);
+                publish_urgent(MQTT_TOPIC "/status/DBPort", itoa(INFLUX_PORT, port, 10));
+                publish_urgent(MQTT_TOPIC "/status/DBName", INFLUX_DB);
+                publish_urgent(MQTT_TOPIC "/status/Version", VERSION);
+                if (time_valid) {
+                    publish_urgent(MQTT_TOPIC "/status/StartTime", start_time);
+                }
+                if (mqtt_fields) {
+                    publish_all_fields();  // broker might have lost retained values
+                }
+                if (mqtt_cbor) {
+                    publish_cbor_schemas();
+                }
+                Lease msg(POOL_MQTT);
+                snprintf(msg, msg.size(), "Connected to MQTT broker %s:%d using topic %s", MQTT_SERVER, MQTT_PORT, MQTT_TOPIC);
+                slog(msg, LOG_NOTICE, LOG_CLASS_NET);
+                backoff = 0;
+                state = MQTT_ONLINE;
             }
             else {
                 int error = mqtt.state();
                 mqtt.disconnect();
-                snprintf(msg, sizeof(msg), "Connect to MQTT broker %s:%d failed with code %d", MQTT_SERVER, MQTT_PORT, error);
-                slog(msg, LOG_ERR);
+                wifiMqtt.stop();
+                Lease msg(POOL_MQTT);
+                snprintf(msg, msg.size(), "Connect to MQTT broker %s:%d failed with code %d, retry in %u ms", 
+                    MQTT_SERVER, MQTT_PORT, error, (unsigned)backoff);
+                slog(msg, LOG_ERR, LOG_CLASS_NET);
+                state = MQTT_OFFLINE;
+            }
+            break;
+
+        case MQTT_ONLINE:
+            if (!mqtt.loop() || !drain_outbox(drain_count)) {
+                int error = mqtt.state();
+                mqtt.disconnect();
+                wifiMqtt.stop();
+                Lease msg(POOL_MQTT);
+                snprintf(msg, msg.size(), "Lost MQTT broker %s:%d with code %d", MQTT_SERVER, MQTT_PORT, error);
+                slog(msg, LOG_ERR, LOG_CLASS_NET);
+                backoff = min_backoff;
+                prev = now;
+                state = MQTT_OFFLINE;
+            }
+            break;
+    }
+}
+
+
+// Dispatcher for the main loop: each task runs when its period passed, when a handler in it asked for
+// an earlier run with idle_within(), when one of its records got a forced poll or when its event flag is set.
+// Tasks with period 0 run on every loop. With dispatch_timed off all tasks run on every loop (the old
+// polling loop) to compare the loop overhead reported in /json/Tasks and the Metrics record.
+bool have_time = false;       // ntp time is valid
+bool samples_pending = false; // event: a device record was read (see state_touch)
+
+typedef struct task_entry {
+    const char *name;
+    void (*run)();
+    uint32_t period_ms;       // run at least this often, 0: every loop
+    uint32_t items;           // state items whose forced poll makes the task due
+    bool *event;              // makes the task due if set, cleared before the run
+    uint32_t next_ms;         // due time
+    uint32_t runs;
+    uint64_t run_us;          // total run time
+    uint32_t max_us;          // longest run
+} task_entry_t;
+
+bool es3_ready() { return es3Information.wSerial[0]; }  // we have required esmart3 infos
+bool jbd_ready() { return jbdHardware.id[0]; }          // we have required bms infos
+
+task_entry_t tasks[] = {
+    { "Commands", handle_commands, 0 },  // control writes go ahead of routine polls
+    { "Information", handle_es3Information, 60000, 1 << STATE_INFORMATION },
+    { "Hardware", handle_jbdHardware, 60000, 1 << STATE_HARDWARE },
+    { "Time", []() {
+        have_time = check_ntptime();
+        if (es3_ready()) {
+            handle_es3Time(have_time);
+        } }, 1000 },
+    { "Charger", []() {
+        if (es3_ready()) {
+            handle_es3ChgSts();
+            handle_faults();  // right after records with fault bits
+        } }, 1000, 1 << STATE_CHGSTS },
+    { "ChargerParams", []() {
+        if (es3_ready()) {
+            handle_es3BatParam();
+            handle_es3Log();
+            handle_es3Parameters();
+            handle_es3ProParam();
+            handle_es3LoadParam();
+            // ignoring TempParam and EngSave (for now?)
+        } }, 10000, 1 << STATE_BATPARAM | 1 << STATE_LOG | 1 << STATE_PARAMETERS | 1 << STATE_PROPARAM | 1 << STATE_LOADPARAM },
+    { "Bms", []() {
+        if (jbd_ready()) {
+            handle_jbdStatus();
+            handle_faults();
+            handle_jbdCells();
+        } }, 1000, 1 << STATE_STATUS | 1 << STATE_CELLS },
+    { "Devices", handle_devices, 1000 },  // extra chargers and BMSes, sets its own idle budget
+    { "Proxy", handle_proxy, 20 },  // bus requests of external tools between our polls
+    { "Sniffer", handle_sniffer, 1000 },
+    { "Replay", handle_replay, 1000 },  // sets its own idle budget while replaying
+    { "Samples", []() {
+        handle_soc();
+        handle_derived();
+        handle_bank();
+        handle_energy(have_time);
+        handle_rules();  // react on new samples
+        }, 1000, 0, &samples_pending },
+    { "Publish", []() {
+        publish_soc();
+        publish_derived();
+        }, 60000 },
+    { "Breathe", []() {
+        if (es3_ready() && jbd_ready() && have_time && enabledBreathing) {
+            breathe_interval = (influx_status < 200 || influx_status >= 300 || es3ChgSts.wFault || jbdStatus.fault) ? err_interval : ok_interval;
+            set_breathing(breathe_interval);  // health indicator, the fade engine does the rest
+        }
+        else {
+            set_breathing(0);
+        } }, 1000 },
+    { "LoadLed", []() { handle_load_led(); }, load_poll_ms + 1 },
+    { "Web", []() { web_server.handleClient(); }, 0 },
+    { "Mqtt", []() { handle_mqtt(have_time); }, 0 },
+    { "Wifi", handle_wifi, 1000 },
+    { "Metrics", handle_metrics, 60000 }
+};
+
+// Run due tasks, return ms until the next one is due
+uint32_t dispatch() {
+    uint32_t loop_start = micros();
+    uint32_t task_us = 0;
+    uint32_t budget = IDLE_MAX_MS;
+    for (auto &task: tasks) {
+        uint32_t now = millis();
+        bool due = !dispatch_timed || !task.period_ms || (int32_t)(now - task.next_ms) >= 0
+            || (task.items & poll_forced_items) || (task.event && *task.event);
+        if (due) {
+            if (task.event) {
+                *task.event = false;
+            }
+            idle_budget_ms = task.period_ms ? task.period_ms : IDLE_MAX_MS;
+            uint32_t start = micros();
+            task.run();
+            uint32_t us = micros() - start;
+            task_us += us;
+            task.runs++;
+            task.run_us += us;
+            if (us > task.max_us) {
+                task.max_us = us;
+            }
+            task.next_ms = millis() + idle_budget_ms;
+        }
+        int32_t left = task.next_ms - millis();
+        budget = min(budget, (uint32_t)max(left, (int32_t)0));
+    }
+    uint32_t awake = micros() - loop_start;
+    loop_count++;
+    loop_awake_us += awake;
+    loop_overhead_us += awake - task_us;
+    return (samples_pending || poll_forced_items) ? 0 : budget;
+}
+
+// Tasks with run counts and times and the loop overhead
+void write_Tasks( ChunkWriter &out ) {
+    out.printf("{\"Version\":" VERSION ",\"Hostname\":\"%s\",\"Tasks\":{\"Timed\":%s,\"Loops\":%u,\"AwakeUs\":%u,\"OverheadUs\":%u",
+        WiFi.getHostname(), dispatch_timed ? "true" : "false", (unsigned)loop_count,
+        (unsigned)(loop_count ? loop_awake_us / loop_count : 0), (unsigned)(loop_count ? loop_overhead_us / loop_count : 0));
+    for (auto &task: tasks) {
+        out.printf(",\"%s\":{\"Period\":%u,\"Runs\":%u,\"AvgUs\":%u,\"MaxUs\":%u}", task.name, (unsigned)task.period_ms,
+            (unsigned)task.runs, (unsigned)(task.runs ? task.run_us / task.runs : 0), (unsigned)task.max_us);
+    }
+    out.print("}}");
+}
+
+// Register the task page, after setup_webserver() since the dispatcher needs all handlers
+void setup_tasks() {
+    web_server.on("/json/Tasks", []() {
+        send_streamed("application/json", [](ChunkWriter &out) { write_Tasks(out); });
+    });
+}
+
+
+// Power management for the idle mode: the idle task may lower the cpu clock down to IDLE_MIN_MHZ
+// (and light sleep if the framework has tickless idle) while loop() sleeps.
+// The loop holds an APB lock while awake, so rs485 and network run at full clock. The bus is only
+// used from the loop (devices answer within its transfers) and the log task locks around Serial output.
+
+esp_pm_lock_handle_t idle_lock = 0;
+
+void setup_idle() {
+    #if CONFIG_PM_ENABLE
+        esp_pm_config_t pm;
+        pm.max_freq_mhz = getCpuFrequencyMhz();
+        pm.min_freq_mhz = IDLE_MIN_MHZ;
+        #if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+            pm.light_sleep_enable = true;
+        #else
+            pm.light_sleep_enable = false;
+        #endif
+        if (esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "loop", &idle_lock) == ESP_OK) {
+            esp_pm_lock_acquire(idle_lock);
+        }
+        int rc = esp_pm_configure(&pm);
+        if (rc != ESP_OK) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Power management not configured: error %d", rc);
+            slog(msg, LOG_WARNING);
+        }
+    #endif
+    WiFi.setSleep(IDLE_MODEM_SLEEP ? true : false);  // modem sleep adds up to a beacon interval of latency
+}
+
+// Sleep for budget ms until the next task is due, unless work is pending
+void handle_idle( uint32_t budget ) {
+    if (!idle_sleep || !budget || poll_forced_items || command_count) {
+        return;
+    }
+    if (mqtt.connected()) {
+        for (auto &s: outbox) {
+            if (s.seq) {
+                return;  // keep draining
             }
-            prev = now;
         }
     }
- }
+
+    uint32_t start = micros();
+    if (idle_lock) {
+        esp_pm_lock_release(idle_lock);
+    }
+    vTaskDelay(pdMS_TO_TICKS(budget));
+    if (idle_lock) {
+        esp_pm_lock_acquire(idle_lock);
+    }
+    idle_us += micros() - start;
+}
 
 
 // Startup
 void setup() {
     WiFi.mode(WIFI_STA);
-    String host(HOSTNAME);
-    host.toLowerCase();
-    WiFi.hostname(host.c_str());
+    char host[] = HOSTNAME;
+    for (char *c = host; *c; c++) {
+        *c = tolower(*c);
+    }
+    WiFi.hostname(host);
 
     pinMode(HEALTH_LED_PIN, OUTPUT);
     digitalWrite(HEALTH_LED_PIN, HEALTH_LED_ON);
 
     Serial.begin(BAUDRATE);
     Serial.println("\nStarting " PROGNAME " v" VERSION " " __DATE__ " " __TIME__);
+    setup_log();
 
     // Syslog setup
     syslog.server(SYSLOG_SERVER, SYSLOG_PORT);
@@ -1873,40 +6870,39 @@ void setup() {
     }
 
     digitalWrite(HEALTH_LED_PIN, HEALTH_LED_ON);
-    char msg[80];
-    snprintf(msg, sizeof(msg), "%s Version %s, WLAN IP is %s", PROGNAME, VERSION,
-        WiFi.localIP().toString().c_str());
+    Lease msg(POOL_SYSTEM);
+    snprintf(msg, msg.size(), "%s Version %s, WLAN IP is %s", PROGNAME, VERSION,
+        ip_str(WiFi.localIP()).str);
     slog(msg, LOG_NOTICE);
 
-    #if defined(ESP8266)
-        ntp.begin();
-    #else
-        configTime(3600, 3600, NTP_SERVER);  // MEZ/MESZ
-    #endif
+    configTime(3600, 3600, NTP_SERVER);  // MEZ/MESZ
 
     MDNS.begin(WiFi.getHostname());
 
     esp_updater.setup(&web_server);
     setup_webserver();
 
+    setup_journal();
+    setup_rules();
+    setup_devices();
+    setup_proxy();
+    setup_soc();
+    setup_energy();
+    setup_outbox();
+    setup_idle();
+    setup_replay();
+    setup_tasks();
     mqtt.setServer(MQTT_SERVER, MQTT_PORT);
     mqtt.setCallback(mqtt_callback);
+    mqtt.setSocketTimeout(1);  // s to wait for broker responses
 
-#if defined(ESP8266)
-    rs485.begin(9600, SWSERIAL_8N1, 13, 15);  // Use pins 13 and 15 for RX and TX
-    analogWriteRange(PWMRANGE);  // for health led breathing steps
-#elif defined(ESP32)
     print_reset_reason(0);
     print_reset_reason(1);  // assume 2nd core (should I ask?)
 
     rs485.begin(9600, SERIAL_8N1, RS485_RX_PIN, RS485_TX_PIN, false, 1000);
     ledcAttach(HEALTH_LED_PIN, 1000, PWMBITS);
-#else
-    analogWriteRange(PWMRANGE);  // for health led breathing steps
-    // init your non ESP serial port here
-#endif
 
-    pinMode(LOAD_BUTTON_PIN, INPUT_PULLUP);  // to toggle load status
+    setup_button();
     pinMode(LOAD_LED_PIN, OUTPUT);  // to show load status
     digitalWrite(LOAD_LED_PIN, LOAD_LED_OFF);
 
@@ -1915,42 +6911,12 @@ void setup() {
 
     jbdbms.begin(RS485_DIR_PIN);  // same pin as esmart3
 
+    heap_setup = ESP.getFreeHeap();
     slog("Setup done", LOG_NOTICE);
 }
 
 
 // Main loop
 void loop() {
-    handle_es3Information();
-    handle_jbdHardware();
-    
-    bool have_time = check_ntptime();
-    if( es3Information.wSerial[0] ) {  // we have required esmart3 infos
-        handle_es3Time(have_time);
-        handle_es3ChgSts();
-        handle_es3BatParam();
-        handle_es3Log();
-        handle_es3Parameters();
-        handle_es3ProParam();
-        handle_es3LoadParam();
-        // ignoring TempParam and EngSave (for now?)
-    }
-    
-    if( jbdHardware.id[0] ) {  // we have required bms infos
-        handle_jbdStatus();
-        handle_jbdCells();
-    }
-
-    if (es3Information.wSerial[0] 
-     && jbdHardware.id[0]
-     && have_time 
-     && enabledBreathing) {
-        breathe_interval = (influx_status < 200 || influx_status >= 300 || es3ChgSts.wFault || jbdStatus.fault) ? err_interval : ok_interval;
-        handle_breathe();  // health indicator
-    }
-
-    handle_load_button(handle_load_led());
-    web_server.handleClient();
-    handle_mqtt(have_time);
-    handle_wifi();
+    handle_idle(dispatch());
 }